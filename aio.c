@@ -23,7 +23,8 @@ static LIST_HEAD(, AioHandler) aio_handlers;
 
 /* This is a simple lock used to protect the aio_handlers list.  Specifically,
  * it's used to ensure that no callbacks are removed while we're walking and
- * dispatching callbacks.
+ * dispatching callbacks.  It is a count because a callback may wait for
+ * AIO in turn, and walk the list again.
  */
 static int walking_handlers;
 
@@ -43,7 +44,8 @@ static AioHandler *find_aio_handler(int fd)
     AioHandler *node;
 
     LIST_FOREACH(node, &aio_handlers, node) {
-        if (node->fd == fd)
+        /* a deleted node may still be there for an fd that was reused */
+        if (node->fd == fd && !node->deleted)
             return node;
     }
 
@@ -124,7 +126,7 @@ void qemu_aio_wait(void)
         fd_set rdfds, wrfds;
         int max_fd = -1;
 
-        walking_handlers = 1;
+        walking_handlers++;
 
         FD_ZERO(&rdfds);
         FD_ZERO(&wrfds);
@@ -148,7 +150,7 @@ void qemu_aio_wait(void)
             }
         }
 
-        walking_handlers = 0;
+        walking_handlers--;
 
         /* No AIO operations?  Get us out of here */
         if (max_fd == -1)
@@ -161,14 +163,14 @@ void qemu_aio_wait(void)
 
         /* if we have any readable fds, dispatch event */
         if (ret > 0) {
-            walking_handlers = 1;
-
             /* we have to walk very carefully in case
              * qemu_aio_set_fd_handler is called while we're walking */
             node = LIST_FIRST(&aio_handlers);
             while (node) {
                 AioHandler *tmp;
 
+                walking_handlers++;
+
                 if (!node->deleted &&
                     FD_ISSET(node->fd, &rdfds) &&
                     node->io_read) {
@@ -183,13 +185,14 @@ void qemu_aio_wait(void)
                 tmp = node;
                 node = LIST_NEXT(node, node);
 
-                if (tmp->deleted) {
+                walking_handlers--;
+
+                /* the outer walks may still point to deleted nodes */
+                if (!walking_handlers && tmp->deleted) {
                     LIST_REMOVE(tmp, node);
                     qemu_free(tmp);
                 }
             }
-
-            walking_handlers = 0;
         }
     } while (ret == 0);
 }
@@ -810,62 +810,47 @@ static int qcow_make_empty(BlockDriverState *bs)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                 const uint8_t *buf, int nb_sectors)
+static int qcow_write_precompressed(BlockDriverState *bs, int64_t sector_num,
+                                    const uint8_t *buf, int nb_sectors,
+                                    const uint8_t *cbuf, int clen)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
     uint64_t cluster_offset;
 
     if (nb_sectors != s->cluster_sectors)
         return -EINVAL;
 
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-    if (!out_buf)
-        return -1;
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
+    if (clen < 0) {
+        /* could not compress: write normal cluster */
+        return qcow_write(bs, sector_num, buf, s->cluster_sectors);
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
-        deflateEnd(&strm);
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
+                                        clen, 0, 0);
+    cluster_offset &= s->cluster_offset_mask;
+    if (bdrv_pwrite(s->hd, cluster_offset, cbuf, clen) != clen)
         return -1;
-    }
-    out_len = strm.next_out - out_buf;
+    return 0;
+}
 
-    deflateEnd(&strm);
+static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                 const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret, out_len;
+    uint8_t *out_buf;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        qcow_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
-                                            out_len, 0, 0);
-        cluster_offset &= s->cluster_offset_mask;
-        if (bdrv_pwrite(s->hd, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
-    }
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
 
+    out_buf = qemu_malloc(s->cluster_size);
+    if (!out_buf)
+        return -1;
+    out_len = bdrv_compress_cluster(out_buf, buf, s->cluster_size);
+    ret = qcow_write_precompressed(bs, sector_num, buf, nb_sectors,
+                                   out_buf, out_len);
     qemu_free(out_buf);
-    return 0;
+    return ret;
 }
 
 static void qcow_flush(BlockDriverState *bs)
@@ -900,5 +885,6 @@ BlockDriver bdrv_qcow = {
     .bdrv_aio_cancel = qcow_aio_cancel,
     .aiocb_size = sizeof(QCowAIOCB),
     .bdrv_write_compressed = qcow_write_compressed,
+    .bdrv_write_precompressed = qcow_write_precompressed,
     .bdrv_get_info = qcow_get_info,
 };
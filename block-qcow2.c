@@ -25,6 +25,7 @@
 #include "block_int.h"
 #include <zlib.h>
 #include "aes.h"
+#include "sys-queue.h"
 #include <assert.h>
 
 /*
@@ -61,6 +62,8 @@
 
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
+#define REFCOUNT_CACHE_SIZE 16
+
 typedef struct QCowHeader {
     uint32_t magic;
     uint32_t version;
@@ -97,7 +100,53 @@ typedef struct __attribute__((packed)) QCowSnapshotHeader {
     /* name follows  */
 } QCowSnapshotHeader;
 
-#define L2_CACHE_SIZE 16
+/* L2 tables cached by default: enough to map the whole image, within
+   these bounds */
+#define L2_CACHE_MIN_SIZE 16
+#define L2_CACHE_MAX_BYTES (32 << 20)
+
+typedef struct L2CacheEntry {
+    uint64_t offset;            /* offset of the table in the image, or 0 */
+    int dirty;                  /* modified since it was written */
+    LIST_ENTRY(L2CacheEntry) hash_link;
+    TAILQ_ENTRY(L2CacheEntry) lru_link;
+} L2CacheEntry;
+
+#define QCOW_META_L2       0
+#define QCOW_META_REFCOUNT 1
+
+/* a completion that arrived while another request step was running */
+typedef struct QCowDeferredCB {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    int ret;
+    int queued;                 /* in BDRVQcowState.deferred */
+    TAILQ_ENTRY(QCowDeferredCB) link;
+} QCowDeferredCB;
+
+/* an L2 table or refcount block being read for AIO requests */
+typedef struct QCowMetaLoad {
+    BlockDriverState *bs;
+    int type;                   /* QCOW_META_xxx */
+    uint64_t offset;
+    uint8_t *buf;
+    int stale;                  /* cached while the read was in flight */
+    int submitting;             /* inside bdrv_aio_read */
+    int done;                   /* completed while submitting */
+    BlockDriverAIOCB *aiocb;
+    QCowDeferredCB deferred;
+    LIST_HEAD(QCowMetaWaiters, QCowAIOCB) waiters;
+    LIST_ENTRY(QCowMetaLoad) link;
+} QCowMetaLoad;
+
+/* new clusters whose L2 entries are written but whose padded data is
+   still being written by an AIO request */
+typedef struct QCowAllocRun {
+    uint64_t offset;            /* guest offset of the first cluster */
+    int nb_clusters;
+    LIST_HEAD(QCowAllocWaiters, QCowAIOCB) waiters;
+    LIST_ENTRY(QCowAllocRun) link;
+} QCowAllocRun;
 
 typedef struct QCowSnapshot {
     uint64_t l1_table_offset;
@@ -125,17 +174,28 @@ typedef struct BDRVQcowState {
     uint64_t l1_table_offset;
     uint64_t *l1_table;
     uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
+    int l2_cache_size;          /* number of tables in l2_cache */
+    L2CacheEntry *l2_cache_entries;
+    LIST_HEAD(L2CacheBucket, L2CacheEntry) *l2_cache_hash;
+    int l2_cache_hash_mask;
+    TAILQ_HEAD(L2CacheLRU, L2CacheEntry) l2_cache_lru; /* oldest first */
+    int l2_writeback;           /* write L2 updates when tables are evicted */
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
     uint64_t cluster_cache_offset;
+    LIST_HEAD(QCowMetaLoads, QCowMetaLoad) meta_loads;
+    LIST_HEAD(QCowAllocRuns, QCowAllocRun) alloc_runs;
+    int in_step;                /* an AIO request step is running */
+    TAILQ_HEAD(QCowDeferredCBs, QCowDeferredCB) deferred;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
-    uint64_t refcount_block_cache_offset;
     uint16_t *refcount_block_cache;
+    uint64_t refcount_cache_offsets[REFCOUNT_CACHE_SIZE];
+    uint64_t refcount_cache_used[REFCOUNT_CACHE_SIZE];
+    uint8_t refcount_cache_dirty[REFCOUNT_CACHE_SIZE];
+    uint64_t refcount_cache_clock;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
@@ -167,6 +227,14 @@ static int64_t alloc_clusters(BlockDriverState *bs, int64_t size);
 static int64_t alloc_bytes(BlockDriverState *bs, int size);
 static void free_clusters(BlockDriverState *bs,
                           int64_t offset, int64_t size);
+static int l2_cache_init(BlockDriverState *bs, int flags);
+static void l2_cache_close(BlockDriverState *bs);
+static int l2_cache_flush(BlockDriverState *bs);
+static int refcount_cache_flush(BlockDriverState *bs);
+static int refcount_cache_find(BDRVQcowState *s, uint64_t offset);
+static uint16_t *refcount_cache_block(BDRVQcowState *s, int i);
+static int refcount_cache_new_entry(BlockDriverState *bs);
+static void meta_load_invalidate(BDRVQcowState *s, int type, uint64_t offset);
 #ifdef DEBUG_ALLOC
 static void check_refcounts(BlockDriverState *bs);
 #endif
@@ -254,9 +322,11 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
         be64_to_cpus(&s->l1_table[i]);
     }
     /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    if (!s->l2_cache)
+    if (l2_cache_init(bs, flags) < 0)
         goto fail;
+    LIST_INIT(&s->meta_loads);
+    LIST_INIT(&s->alloc_runs);
+    TAILQ_INIT(&s->deferred);
     s->cluster_cache = qemu_malloc(s->cluster_size);
     if (!s->cluster_cache)
         goto fail;
@@ -291,7 +361,7 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     qcow_free_snapshots(bs);
     refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    l2_cache_close(bs);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     bdrv_delete(s->hd);
@@ -390,31 +460,176 @@ static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
     return 0;
 }
 
-static void l2_cache_reset(BlockDriverState *bs)
+/*
+ * The L2 cache holds l2_cache_size tables.  Tables are found through a
+ * hash on their offset, and the least recently used one is evicted.
+ * With write-back caching of the image, updated entries only mark
+ * their table dirty; it is written when it is evicted or flushed.
+ */
+
+static int l2_cache_init(BlockDriverState *bs, int flags)
 {
     BDRVQcowState *s = bs->opaque;
+    int i, max_size, hash_size;
 
-    memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+    if (bs->l2_cache_size > 0) {
+        s->l2_cache_size = bs->l2_cache_size >> s->cluster_bits;
+        if (s->l2_cache_size < 1)
+            s->l2_cache_size = 1;
+    } else {
+        max_size = L2_CACHE_MAX_BYTES >> s->cluster_bits;
+        s->l2_cache_size = s->l1_vm_state_index;
+        if (s->l2_cache_size > max_size)
+            s->l2_cache_size = max_size;
+        if (s->l2_cache_size < L2_CACHE_MIN_SIZE)
+            s->l2_cache_size = L2_CACHE_MIN_SIZE;
+    }
+    s->l2_writeback = (flags & BDRV_O_CACHE_WB) != 0;
+
+    s->l2_cache = qemu_malloc((size_t)s->l2_cache_size *
+                              s->l2_size * sizeof(uint64_t));
+    s->l2_cache_entries = qemu_mallocz(s->l2_cache_size *
+                                       sizeof(L2CacheEntry));
+    for (hash_size = 1; hash_size < s->l2_cache_size; hash_size <<= 1)
+        continue;
+    s->l2_cache_hash = qemu_mallocz(hash_size * sizeof(*s->l2_cache_hash));
+    if (!s->l2_cache || !s->l2_cache_entries || !s->l2_cache_hash)
+        return -1;
+    s->l2_cache_hash_mask = hash_size - 1;
+    TAILQ_INIT(&s->l2_cache_lru);
+    for (i = 0; i < s->l2_cache_size; i++)
+        TAILQ_INSERT_TAIL(&s->l2_cache_lru, &s->l2_cache_entries[i], lru_link);
+    return 0;
 }
 
-static inline int l2_cache_new_entry(BlockDriverState *bs)
+static void l2_cache_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
-    uint32_t min_count;
-    int min_index, i;
 
-    /* find a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
+    qemu_free(s->l2_cache);
+    qemu_free(s->l2_cache_entries);
+    qemu_free(s->l2_cache_hash);
+}
+
+static inline uint64_t *l2_cache_table(BDRVQcowState *s, L2CacheEntry *e)
+{
+    return s->l2_cache + ((size_t)(e - s->l2_cache_entries) << s->l2_bits);
+}
+
+static inline L2CacheEntry *l2_cache_entry(BDRVQcowState *s,
+                                           uint64_t *l2_table)
+{
+    return &s->l2_cache_entries[(l2_table - s->l2_cache) >> s->l2_bits];
+}
+
+static int l2_cache_writeback(BlockDriverState *bs, L2CacheEntry *e)
+{
+    BDRVQcowState *s = bs->opaque;
+    int size = s->l2_size * sizeof(uint64_t);
+
+    if (!e->dirty)
+        return 0;
+    /* the clusters the table points to must be marked as used first */
+    if (refcount_cache_flush(bs) < 0)
+        return -EIO;
+    if (bdrv_pwrite(s->hd, e->offset, l2_cache_table(s, e), size) != size)
+        return -EIO;
+    e->dirty = 0;
+    return 0;
+}
+
+/* write all dirty tables, in the order of their offsets */
+static int l2_cache_flush(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    L2CacheEntry *e, *next;
+    int i, ret;
+
+    for (;;) {
+        next = NULL;
+        for (i = 0; i < s->l2_cache_size; i++) {
+            e = &s->l2_cache_entries[i];
+            if (e->dirty && (!next || e->offset < next->offset))
+                next = e;
         }
+        if (!next)
+            return 0;
+        ret = l2_cache_writeback(bs, next);
+        if (ret < 0)
+            return ret;
     }
-    return min_index;
+}
+
+static void l2_cache_reset(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowMetaLoad *load;
+    int i;
+
+    /* tables being read for AIO requests may be freed too */
+    LIST_FOREACH(load, &s->meta_loads, link)
+        load->stale = 1;
+    l2_cache_flush(bs);
+    for (i = 0; i < s->l2_cache_size; i++) {
+        if (s->l2_cache_entries[i].offset) {
+            LIST_REMOVE(&s->l2_cache_entries[i], hash_link);
+            s->l2_cache_entries[i].offset = 0;
+        }
+        s->l2_cache_entries[i].dirty = 0;
+    }
+}
+
+/* take the least recently used entry, writing it back if needed */
+static L2CacheEntry *l2_cache_new_entry(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    L2CacheEntry *e;
+
+    e = TAILQ_FIRST(&s->l2_cache_lru);
+    if (l2_cache_writeback(bs, e) < 0)
+        return NULL;
+    if (e->offset) {
+        LIST_REMOVE(e, hash_link);
+        e->offset = 0;
+    }
+    return e;
+}
+
+static void l2_cache_insert(BDRVQcowState *s, L2CacheEntry *e,
+                            uint64_t l2_offset)
+{
+    meta_load_invalidate(s, QCOW_META_L2, l2_offset);
+    e->offset = l2_offset;
+    LIST_INSERT_HEAD(&s->l2_cache_hash[(l2_offset >> s->cluster_bits) &
+                                       s->l2_cache_hash_mask],
+                     e, hash_link);
+    TAILQ_REMOVE(&s->l2_cache_lru, e, lru_link);
+    TAILQ_INSERT_TAIL(&s->l2_cache_lru, e, lru_link);
+}
+
+/*
+ * l2_update
+ *
+ * Entries l2_index to l2_index + n - 1 of a cached table were changed:
+ * write them now, or mark the table dirty with write-back caching.
+ */
+
+static int l2_update(BlockDriverState *bs, uint64_t *l2_table,
+                     uint64_t l2_offset, int l2_index, int n)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->l2_writeback) {
+        l2_cache_entry(s, l2_table)->dirty = 1;
+        return 0;
+    }
+    if (refcount_cache_flush(bs) < 0)
+        return -EIO;
+    if (bdrv_pwrite(s->hd, l2_offset + l2_index * sizeof(uint64_t),
+                    l2_table + l2_index, n * sizeof(uint64_t)) !=
+        n * sizeof(uint64_t))
+        return -EIO;
+    return 0;
 }
 
 static int64_t align_offset(int64_t offset, int n)
@@ -460,6 +675,8 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
         new_l1_table[i] = be64_to_cpu(new_l1_table[i]);
 
     /* set new table */
+    if (refcount_cache_flush(bs) < 0)
+        goto fail;
     data64 = cpu_to_be64(new_l1_table_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, l1_table_offset),
                     &data64, sizeof(data64)) != sizeof(data64))
@@ -484,26 +701,21 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
  *
  * seek l2_offset in the l2_cache table
  * if not found, return NULL,
- * if found,
- *   increments the l2 cache hit count of the entry,
- *   if counter overflow, divide by two all counters
- *   return the pointer to the l2 cache entry
+ * if found, mark the entry as the most recently used one and
+ * return the pointer to the l2 cache entry
  *
  */
 
 static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
 {
-    int i, j;
-
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
-            }
-            return s->l2_cache + (i << s->l2_bits);
+    L2CacheEntry *e;
+
+    LIST_FOREACH(e, &s->l2_cache_hash[(l2_offset >> s->cluster_bits) &
+                                      s->l2_cache_hash_mask], hash_link) {
+        if (e->offset == l2_offset) {
+            TAILQ_REMOVE(&s->l2_cache_lru, e, lru_link);
+            TAILQ_INSERT_TAIL(&s->l2_cache_lru, e, lru_link);
+            return l2_cache_table(s, e);
         }
     }
     return NULL;
@@ -522,7 +734,7 @@ static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
 static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
+    L2CacheEntry *e;
     uint64_t *l2_table;
 
     /* seek if the table for the given offset is in the cache */
@@ -533,13 +745,14 @@ static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
 
     /* not found: load a new entry in the least used one */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
+    e = l2_cache_new_entry(bs);
+    if (e == NULL)
+        return NULL;
+    l2_table = l2_cache_table(s, e);
     if (bdrv_pread(s->hd, l2_offset, l2_table, s->l2_size * sizeof(uint64_t)) !=
         s->l2_size * sizeof(uint64_t))
         return NULL;
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
+    l2_cache_insert(s, e, l2_offset);
 
     return l2_table;
 }
@@ -557,9 +770,9 @@ static uint64_t *l2_load(BlockDriverState *bs, uint64_t l2_offset)
 static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
+    L2CacheEntry *e;
     uint64_t old_l2_offset, tmp;
-    uint64_t *l2_table, l2_offset;
+    uint64_t *l2_table, *old_l2_table, l2_offset;
 
     old_l2_offset = s->l1_table[l1_index];
 
@@ -571,6 +784,8 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
 
+    if (refcount_cache_flush(bs) < 0)
+        return NULL;
     tmp = cpu_to_be64(l2_offset | QCOW_OFLAG_COPIED);
     if (bdrv_pwrite(s->hd, s->l1_table_offset + l1_index * sizeof(tmp),
                     &tmp, sizeof(tmp)) != sizeof(tmp))
@@ -578,14 +793,19 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new entry in the l2 cache */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
+    e = l2_cache_new_entry(bs);
+    if (e == NULL)
+        return NULL;
+    l2_table = l2_cache_table(s, e);
 
     if (old_l2_offset == 0) {
         /* if there was no old l2 table, clear the new table */
         memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+    } else if ((old_l2_table = seek_l2_table(s, old_l2_offset)) != NULL) {
+        /* if there was an old l2 table, copy it from the cache... */
+        memcpy(l2_table, old_l2_table, s->l2_size * sizeof(uint64_t));
     } else {
-        /* if there was an old l2 table, read it from the disk */
+        /* ... or read it from the disk */
         if (bdrv_pread(s->hd, old_l2_offset,
                        l2_table, s->l2_size * sizeof(uint64_t)) !=
             s->l2_size * sizeof(uint64_t))
@@ -599,8 +819,7 @@ static uint64_t *l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* update the l2 cache entry */
 
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
+    l2_cache_insert(s, e, l2_offset);
 
     return l2_table;
 }
@@ -645,6 +864,10 @@ static uint64_t get_cluster_offset(BlockDriverState *bs,
 
     nb_available = (nb_available >> 9) + index_in_cluster;
 
+    /* don't look past the end of the L2 table */
+    if (nb_needed > nb_available)
+        nb_needed = nb_available;
+
     cluster_offset = 0;
 
     /* seek the the l2 offset in the l1 table */
@@ -836,10 +1059,7 @@ static uint64_t alloc_compressed_cluster_offset(BlockDriverState *bs,
     /* compressed clusters never have the copied flag */
 
     l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    if (bdrv_pwrite(s->hd,
-                    l2_offset + l2_index * sizeof(uint64_t),
-                    l2_table + l2_index,
-                    sizeof(uint64_t)) != sizeof(uint64_t))
+    if (l2_update(bs, l2_table, l2_offset, l2_index, 1) < 0)
         return 0;
 
     return cluster_offset;
@@ -851,7 +1071,14 @@ static uint64_t alloc_compressed_cluster_offset(BlockDriverState *bs,
  * For a given offset of the disk image, return cluster offset in
  * qcow2 file.
  *
- * If the offset is not found, allocate a new cluster.
+ * If the offset is not found, allocate a new run of clusters.
+ *
+ * When the new clusters only replace unallocated ones, lie beyond the
+ * end of the file and would have to be filled with zeros around the
+ * written sectors, *pad is set to
+ * the number of sectors from the start of the first cluster to the
+ * end of the last one: the caller must then write them all, padding
+ * with zeros.  Otherwise *pad is 0 and the padding is written here.
  *
  * Return the cluster offset if successful,
  * Return 0, otherwise.
@@ -861,14 +1088,16 @@ static uint64_t alloc_compressed_cluster_offset(BlockDriverState *bs,
 static uint64_t alloc_cluster_offset(BlockDriverState *bs,
                                      uint64_t offset,
                                      int n_start, int n_end,
-                                     int *num)
+                                     int *num, int *pad)
 {
     BDRVQcowState *s = bs->opaque;
     int l2_index, ret;
     uint64_t l2_offset, *l2_table, cluster_offset;
-    int nb_available, nb_clusters, i, j;
+    int nb_available, nb_clusters, i, j, unallocated;
     uint64_t start_sect, current;
 
+    *pad = 0;
+
     ret = get_cluster_table(bs, offset, &l2_table, &l2_offset, &l2_index);
     if (ret == 0)
         return 0;
@@ -907,6 +1136,7 @@ static uint64_t alloc_cluster_offset(BlockDriverState *bs,
 
     /* how many available clusters ? */
 
+    unallocated = 1;
     i = 0;
     while (i < nb_clusters) {
 
@@ -943,6 +1173,7 @@ static uint64_t alloc_cluster_offset(BlockDriverState *bs,
             }
 
             free_any_clusters(bs, cluster_offset, j);
+            unallocated = 0;
             if (current)
                 break;
             cluster_offset = current;
@@ -961,6 +1192,20 @@ static uint64_t alloc_cluster_offset(BlockDriverState *bs,
     if (nb_available > n_end)
         nb_available = n_end;
 
+    /* unallocated clusters read as zeros without a backing file: let
+       the caller write the padding along with the data.  The L2 entries
+       are updated first, so this is only done for clusters beyond the
+       end of the file, which read as zeros until the data is written;
+       a freed cluster still holds its old contents. */
+
+    if (unallocated && !bs->backing_hd && !s->crypt_method &&
+        nb_clusters <= QCOW_MAX_CRYPT_CLUSTERS &&
+        (n_start || (nb_available & (s->cluster_sectors - 1))) &&
+        cluster_offset >= bdrv_getlength(s->hd)) {
+        *pad = nb_clusters << (s->cluster_bits - 9);
+        goto update;
+    }
+
     /* copy content of unmodified sectors */
 
     start_sect = (offset & ~(s->cluster_size - 1)) >> 9;
@@ -981,17 +1226,13 @@ static uint64_t alloc_cluster_offset(BlockDriverState *bs,
     }
 
     /* update L2 table */
-
+ update:
     for (i = 0; i < nb_clusters; i++)
         l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
                                              (i << s->cluster_bits)) |
                                              QCOW_OFLAG_COPIED);
 
-    if (bdrv_pwrite(s->hd,
-                    l2_offset + l2_index * sizeof(uint64_t),
-                    l2_table + l2_index,
-                    nb_clusters * sizeof(uint64_t)) !=
-                    nb_clusters * sizeof(uint64_t))
+    if (l2_update(bs, l2_table, l2_offset, l2_index, nb_clusters) < 0)
         return 0;
 
 out:
@@ -1062,6 +1303,8 @@ static int decompress_cluster(BDRVQcowState *s, uint64_t cluster_offset)
 }
 
 /* handle reading after the end of the backing file */
+/* return the number of sectors to read from the base image, zeroing the
+   rest of buf unless it is NULL */
 static int backing_read1(BlockDriverState *bs,
                          int64_t sector_num, uint8_t *buf, int nb_sectors)
 {
@@ -1072,7 +1315,8 @@ static int backing_read1(BlockDriverState *bs,
         n1 = 0;
     else
         n1 = bs->total_sectors - sector_num;
-    memset(buf + n1 * 512, 0, 512 * (nb_sectors - n1));
+    if (buf)
+        memset(buf + n1 * 512, 0, 512 * (nb_sectors - n1));
     return n1;
 }
 
@@ -1119,11 +1363,21 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
     return 0;
 }
 
+/* build the cluster-aligned data to write for a padded allocation */
+static uint8_t *pad_clusters(uint8_t *out_buf, const uint8_t *buf,
+                             int n_start, int n, int pad)
+{
+    memset(out_buf, 0, n_start * 512);
+    memcpy(out_buf + n_start * 512, buf, n * 512);
+    memset(out_buf + (n_start + n) * 512, 0, (pad - n_start - n) * 512);
+    return out_buf;
+}
+
 static int qcow_write(BlockDriverState *bs, int64_t sector_num,
                      const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret, index_in_cluster, n;
+    int ret, index_in_cluster, n, pad;
     uint64_t cluster_offset;
     int n_end;
 
@@ -1135,10 +1389,17 @@ static int qcow_write(BlockDriverState *bs, int64_t sector_num,
             n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
         cluster_offset = alloc_cluster_offset(bs, sector_num << 9,
                                               index_in_cluster,
-                                              n_end, &n);
+                                              n_end, &n, &pad);
         if (!cluster_offset)
             return -1;
-        if (s->crypt_method) {
+        if (pad) {
+            ret = bdrv_pwrite(s->hd, cluster_offset,
+                              pad_clusters(s->cluster_data, buf,
+                                           index_in_cluster, n, pad),
+                              pad * 512);
+            if (ret != pad * 512)
+                return -1;
+        } else if (s->crypt_method) {
             encrypt_sectors(s, sector_num, s->cluster_data, buf, n, 1,
                             &s->aes_encrypt_key);
             ret = bdrv_pwrite(s->hd, cluster_offset + index_in_cluster * 512,
@@ -1159,16 +1420,291 @@ static int qcow_write(BlockDriverState *bs, int64_t sector_num,
 typedef struct QCowAIOCB {
     BlockDriverAIOCB common;
     int64_t sector_num;
-    uint8_t *buf;
+    QEMUIOVector *qiov;
+    size_t bytes_done;
     int nb_sectors;
     int n;
     uint64_t cluster_offset;
     uint8_t *cluster_data;
+    /* the part of qiov transferred by hd_aiocb */
+    QEMUIOVector hd_qiov;
+    /* qiov of bdrv_aio_read/write requests */
+    struct iovec buf_iov;
+    QEMUIOVector buf_qiov;
     BlockDriverAIOCB *hd_aiocb;
+    QCowDeferredCB deferred;
     QEMUBH *bh;
+    /* padded allocation written by this request */
+    QCowAllocRun alloc_run;
+    int alloc_run_active;
+    /* metadata read or padded allocation this request waits for */
+    QCowMetaLoad *wait_load;
+    QCowAllocRun *wait_run;
+    void (*resume)(struct QCowAIOCB *acb);
+    LIST_ENTRY(QCowAIOCB) wait_link;
 } QCowAIOCB;
 
+/*
+ * Metadata for AIO requests
+ *
+ * Before an AIO request looks up or allocates clusters, the L2 table and
+ * refcount block it needs are read asynchronously, and the request is
+ * resumed once they are cached.  Requests needing the same table share
+ * one read.  The lookups themselves stay synchronous: they find the
+ * tables in the cache, and simply read them again if they were evicted
+ * in between.
+ */
+
+/* A request step may wait synchronously: copy on write from a base image
+   that has no synchronous read goes through bdrv_read, which runs other
+   AIO completions.  The completions of this image that arrive meanwhile,
+   table reads included, are deferred until the step is over, so that no
+   step sees a cluster allocation that another one has only half done. */
+
+/* return 1 if cb(opaque, ret) has to run after the current step; it is
+   then queued in 'd', which belongs to opaque and has at most one
+   completion pending */
+static int qcow_step_enter(BlockDriverState *bs, QCowDeferredCB *d,
+                           BlockDriverCompletionFunc *cb, void *opaque,
+                           int ret)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->in_step) {
+        s->in_step = 1;
+        return 0;
+    }
+    d->cb = cb;
+    d->opaque = opaque;
+    d->ret = ret;
+    d->queued = 1;
+    TAILQ_INSERT_TAIL(&s->deferred, d, link);
+    return 1;
+}
+
+static void qcow_step_leave(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowDeferredCB *d;
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    int ret;
+
+    s->in_step = 0;
+    while (!s->in_step && (d = TAILQ_FIRST(&s->deferred)) != NULL) {
+        TAILQ_REMOVE(&s->deferred, d, link);
+        d->queued = 0;
+        cb = d->cb;
+        opaque = d->opaque;
+        ret = d->ret;
+        cb(opaque, ret);
+    }
+}
+
+/* return 1 if a completion was pending in 'd', and drop it */
+static int qcow_step_cancel(BlockDriverState *bs, QCowDeferredCB *d)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!d->queued)
+        return 0;
+    TAILQ_REMOVE(&s->deferred, d, link);
+    d->queued = 0;
+    return 1;
+}
+
+static void meta_load_invalidate(BDRVQcowState *s, int type, uint64_t offset)
+{
+    QCowMetaLoad *load;
+
+    /* the table was loaded by someone else, and may then change: drop
+       the copy being read */
+    LIST_FOREACH(load, &s->meta_loads, link) {
+        if (load->type == type && load->offset == offset)
+            load->stale = 1;
+    }
+}
+
+static void meta_load_cb(void *opaque, int ret)
+{
+    QCowMetaLoad *load = opaque;
+    BlockDriverState *bs = load->bs;
+    BDRVQcowState *s = bs->opaque;
+    L2CacheEntry *e;
+    QCowAIOCB *acb;
+    int i;
+
+    if (qcow_step_enter(bs, &load->deferred, meta_load_cb, opaque, ret))
+        return;
+    LIST_REMOVE(load, link);
+    if (ret >= 0 && !load->stale) {
+        if (load->type == QCOW_META_L2) {
+            e = l2_cache_new_entry(bs);
+            if (e != NULL) {
+                memcpy(l2_cache_table(s, e), load->buf, s->cluster_size);
+                l2_cache_insert(s, e, load->offset);
+            }
+        } else {
+            i = refcount_cache_new_entry(bs);
+            if (i >= 0) {
+                memcpy(refcount_cache_block(s, i), load->buf,
+                       s->cluster_size);
+                s->refcount_cache_offsets[i] = load->offset;
+            }
+        }
+    }
+    while ((acb = LIST_FIRST(&load->waiters)) != NULL) {
+        LIST_REMOVE(acb, wait_link);
+        acb->wait_load = NULL;
+        if (ret < 0) {
+            acb->common.cb(acb->common.opaque, ret);
+            qemu_aio_release(acb);
+        } else {
+            acb->resume(acb);
+        }
+    }
+    if (load->submitting) {
+        /* meta_load_wait frees it */
+        load->done = 1;
+    } else {
+        qemu_free(load->buf);
+        qemu_free(load);
+    }
+    qcow_step_leave(bs);
+}
+
+/* return 1 if acb has to wait for the table at offset to be read */
+static int meta_load_wait(QCowAIOCB *acb, int type, uint64_t offset)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    QCowMetaLoad *load;
+
+    LIST_FOREACH(load, &s->meta_loads, link) {
+        if (load->type == type && load->offset == offset && !load->stale)
+            goto wait;
+    }
+
+    load = qemu_mallocz(sizeof(QCowMetaLoad));
+    if (!load)
+        return 0;
+    load->buf = qemu_malloc(s->cluster_size);
+    if (!load->buf) {
+        qemu_free(load);
+        return 0;
+    }
+    load->bs = bs;
+    load->type = type;
+    load->offset = offset;
+    LIST_INIT(&load->waiters);
+    LIST_INSERT_HEAD(&s->meta_loads, load, link);
+    LIST_INSERT_HEAD(&load->waiters, acb, wait_link);
+    acb->wait_load = load;
+    load->submitting = 1;
+    load->aiocb = bdrv_aio_read(s->hd, offset >> 9, load->buf,
+                                s->cluster_sectors, meta_load_cb, load);
+    load->submitting = 0;
+    if (load->done) {
+        /* completed at once: acb was already resumed */
+        qemu_free(load->buf);
+        qemu_free(load);
+        return 1;
+    }
+    if (load->aiocb == NULL) {
+        /* the synchronous path will read it */
+        LIST_REMOVE(acb, wait_link);
+        acb->wait_load = NULL;
+        LIST_REMOVE(load, link);
+        qemu_free(load->buf);
+        qemu_free(load);
+        return 0;
+    }
+    return 1;
+
+ wait:
+    acb->wait_load = load;
+    LIST_INSERT_HEAD(&load->waiters, acb, wait_link);
+    return 1;
+}
+
+/* wait for the L2 table mapping offset, if it exists and is not cached */
+static int meta_wait_l2(QCowAIOCB *acb, uint64_t offset)
+{
+    BDRVQcowState *s = acb->common.bs->opaque;
+    uint64_t l2_offset;
+    int l1_index;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size)
+        return 0;
+    l2_offset = s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED;
+    if (!l2_offset || seek_l2_table(s, l2_offset))
+        return 0;
+    return meta_load_wait(acb, QCOW_META_L2, l2_offset);
+}
+
+/* wait for the refcount block the next cluster allocation will update */
+static int meta_wait_refcount(QCowAIOCB *acb)
+{
+    BDRVQcowState *s = acb->common.bs->opaque;
+    uint64_t refcount_block_offset;
+    int64_t refcount_table_index;
+
+    refcount_table_index = s->free_cluster_index >>
+        (s->cluster_bits - REFCOUNT_SHIFT);
+    if (refcount_table_index >= s->refcount_table_size)
+        return 0;
+    refcount_block_offset = s->refcount_table[refcount_table_index];
+    if (!refcount_block_offset ||
+        refcount_cache_find(s, refcount_block_offset) >= 0)
+        return 0;
+    return meta_load_wait(acb, QCOW_META_REFCOUNT, refcount_block_offset);
+}
+
+/* return 1 if acb has to wait for the padded allocation of the cluster
+   at its current sector; otherwise limit *nb so that the next step
+   stops before the next such allocation */
+static int alloc_run_wait(QCowAIOCB *acb, int *nb)
+{
+    BDRVQcowState *s = acb->common.bs->opaque;
+    QCowAllocRun *run;
+    uint64_t offset, end, run_end;
+
+    offset = acb->sector_num << 9;
+    end = offset + ((uint64_t)*nb << 9);
+    LIST_FOREACH(run, &s->alloc_runs, link) {
+        run_end = run->offset + ((uint64_t)run->nb_clusters << s->cluster_bits);
+        if (run->offset <= offset && offset < run_end) {
+            acb->wait_run = run;
+            LIST_INSERT_HEAD(&run->waiters, acb, wait_link);
+            return 1;
+        }
+        if (offset < run->offset && run->offset < end)
+            end = run->offset;
+    }
+    *nb = (end - offset) >> 9;
+    return 0;
+}
+
+/* the padded data of acb's allocation is written: resume the requests
+   that wait for it */
+static void alloc_run_done(QCowAIOCB *acb)
+{
+    QCowAIOCB *waiter;
+
+    if (!acb->alloc_run_active)
+        return;
+    acb->alloc_run_active = 0;
+    LIST_REMOVE(&acb->alloc_run, link);
+    while ((waiter = LIST_FIRST(&acb->alloc_run.waiters)) != NULL) {
+        LIST_REMOVE(waiter, wait_link);
+        waiter->wait_run = NULL;
+        waiter->resume(waiter);
+    }
+}
+
 static void qcow_aio_read_cb(void *opaque, int ret);
+static void qcow_aio_read_next(QCowAIOCB *acb);
 static void qcow_aio_read_bh(void *opaque)
 {
     QCowAIOCB *acb = opaque;
@@ -1177,16 +1713,20 @@ static void qcow_aio_read_bh(void *opaque)
     qcow_aio_read_cb(opaque, 0);
 }
 
-static void qcow_aio_read_cb(void *opaque, int ret)
+/* point hd_qiov at the bytes of the request the next chunk transfers */
+static void qcow_aio_slice(QCowAIOCB *acb, size_t skip, size_t size)
+{
+    qemu_iovec_reset(&acb->hd_qiov);
+    qemu_iovec_copy(&acb->hd_qiov, acb->qiov, acb->bytes_done + skip, size);
+}
+
+static void qcow_aio_read_step(QCowAIOCB *acb, int ret)
 {
-    QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
     BDRVQcowState *s = bs->opaque;
-    int index_in_cluster, n1;
 
     acb->hd_aiocb = NULL;
     if (ret < 0) {
-    fail:
         acb->common.cb(acb->common.opaque, ret);
         qemu_aio_release(acb);
         return;
@@ -1199,15 +1739,17 @@ static void qcow_aio_read_cb(void *opaque, int ret)
         /* nothing to do */
     } else {
         if (s->crypt_method) {
-            encrypt_sectors(s, acb->sector_num, acb->buf, acb->buf,
-                            acb->n, 0,
+            encrypt_sectors(s, acb->sector_num, acb->cluster_data,
+                            acb->cluster_data, acb->n, 0,
                             &s->aes_decrypt_key);
+            qemu_iovec_from_buffer(&acb->hd_qiov, acb->cluster_data,
+                                   acb->n * 512);
         }
     }
 
     acb->nb_sectors -= acb->n;
     acb->sector_num += acb->n;
-    acb->buf += acb->n * 512;
+    acb->bytes_done += acb->n * 512;
 
     if (acb->nb_sectors == 0) {
         /* request completed */
@@ -1216,19 +1758,54 @@ static void qcow_aio_read_cb(void *opaque, int ret)
         return;
     }
 
+    qcow_aio_read_next(acb);
+}
+
+static void qcow_aio_read_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    if (qcow_step_enter(bs, &acb->deferred, qcow_aio_read_cb, opaque, ret))
+        return;
+    qcow_aio_read_step(acb, ret);
+    qcow_step_leave(bs);
+}
+
+static void qcow_aio_read_next(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster, n, n1, ret;
+
+    n = acb->nb_sectors;
+    if (alloc_run_wait(acb, &n))
+        return;
+    /* get the L2 table without blocking */
+    if (meta_wait_l2(acb, acb->sector_num << 9))
+        return;
+
     /* prepare next AIO request */
-    acb->n = acb->nb_sectors;
+    ret = -EIO;
+    acb->n = n;
+    if (s->crypt_method && acb->n > QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors)
+        acb->n = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
     acb->cluster_offset = get_cluster_offset(bs, acb->sector_num << 9, &acb->n);
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
 
     if (!acb->cluster_offset) {
         if (bs->backing_hd) {
             /* read from the base image */
-            n1 = backing_read1(bs->backing_hd, acb->sector_num,
-                               acb->buf, acb->n);
+            n1 = backing_read1(bs->backing_hd, acb->sector_num, NULL, acb->n);
+            if (n1 < acb->n) {
+                /* beyond the end of the base image */
+                qcow_aio_slice(acb, n1 * 512, (acb->n - n1) * 512);
+                qemu_iovec_memset(&acb->hd_qiov, 0, (acb->n - n1) * 512);
+            }
             if (n1 > 0) {
-                acb->hd_aiocb = bdrv_aio_read(bs->backing_hd, acb->sector_num,
-                                    acb->buf, acb->n, qcow_aio_read_cb, acb);
+                qcow_aio_slice(acb, 0, n1 * 512);
+                acb->hd_aiocb = bdrv_aio_readv(bs->backing_hd, acb->sector_num,
+                                    &acb->hd_qiov, n1, qcow_aio_read_cb, acb);
                 if (acb->hd_aiocb == NULL)
                     goto fail;
             } else {
@@ -1245,7 +1822,8 @@ static void qcow_aio_read_cb(void *opaque, int ret)
             }
         } else {
             /* Note: in this case, no need to wait */
-            memset(acb->buf, 0, 512 * acb->n);
+            qcow_aio_slice(acb, 0, acb->n * 512);
+            qemu_iovec_memset(&acb->hd_qiov, 0, acb->n * 512);
 	    if (acb->bh) {
 		ret = -EIO;
 		goto fail;
@@ -1261,8 +1839,10 @@ static void qcow_aio_read_cb(void *opaque, int ret)
         /* add AIO support for compressed blocks ? */
         if (decompress_cluster(s, acb->cluster_offset) < 0)
             goto fail;
-        memcpy(acb->buf,
-               s->cluster_cache + index_in_cluster * 512, 512 * acb->n);
+        qcow_aio_slice(acb, 0, acb->n * 512);
+        qemu_iovec_from_buffer(&acb->hd_qiov,
+                               s->cluster_cache + index_in_cluster * 512,
+                               acb->n * 512);
 	if (acb->bh) {
 	    ret = -EIO;
 	    goto fail;
@@ -1278,16 +1858,38 @@ static void qcow_aio_read_cb(void *opaque, int ret)
             ret = -EIO;
             goto fail;
         }
-        acb->hd_aiocb = bdrv_aio_read(s->hd,
-                            (acb->cluster_offset >> 9) + index_in_cluster,
-                            acb->buf, acb->n, qcow_aio_read_cb, acb);
+        qcow_aio_slice(acb, 0, acb->n * 512);
+        if (s->crypt_method) {
+            /* decrypted into the request when the read completes */
+            if (!acb->cluster_data) {
+                acb->cluster_data = qemu_mallocz(QCOW_MAX_CRYPT_CLUSTERS *
+                                                 s->cluster_size);
+                if (!acb->cluster_data) {
+                    ret = -ENOMEM;
+                    goto fail;
+                }
+            }
+            acb->hd_aiocb = bdrv_aio_read(s->hd,
+                                (acb->cluster_offset >> 9) + index_in_cluster,
+                                acb->cluster_data, acb->n,
+                                qcow_aio_read_cb, acb);
+        } else {
+            acb->hd_aiocb = bdrv_aio_readv(s->hd,
+                                (acb->cluster_offset >> 9) + index_in_cluster,
+                                &acb->hd_qiov, acb->n, qcow_aio_read_cb, acb);
+        }
         if (acb->hd_aiocb == NULL)
             goto fail;
     }
+    return;
+
+ fail:
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
 }
 
 static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
-        int64_t sector_num, uint8_t *buf, int nb_sectors,
+        int64_t sector_num, QEMUIOVector *qiov, uint8_t *buf, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     QCowAIOCB *acb;
@@ -1297,41 +1899,66 @@ static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
         return NULL;
     acb->hd_aiocb = NULL;
     acb->sector_num = sector_num;
-    acb->buf = buf;
+    if (!qiov) {
+        /* single buffer request */
+        acb->buf_iov.iov_base = buf;
+        acb->buf_iov.iov_len = nb_sectors * 512;
+        qemu_iovec_init_external(&acb->buf_qiov, &acb->buf_iov, 1);
+        qiov = &acb->buf_qiov;
+    }
+    acb->qiov = qiov;
+    acb->bytes_done = 0;
+    /* the AIOCB is recycled with its slice vector */
+    if (!acb->hd_qiov.nalloc)
+        qemu_iovec_init(&acb->hd_qiov, qiov->niov);
     acb->nb_sectors = nb_sectors;
     acb->n = 0;
     acb->cluster_offset = 0;
+    acb->deferred.queued = 0;
+    acb->alloc_run_active = 0;
+    acb->wait_load = NULL;
+    acb->wait_run = NULL;
     return acb;
 }
 
+static BlockDriverAIOCB *qcow_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    QCowAIOCB *acb;
+
+    acb = qcow_aio_setup(bs, sector_num, qiov, NULL, nb_sectors, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->resume = qcow_aio_read_next;
+
+    qcow_aio_read_cb(acb, 0);
+    return &acb->common;
+}
+
 static BlockDriverAIOCB *qcow_aio_read(BlockDriverState *bs,
         int64_t sector_num, uint8_t *buf, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     QCowAIOCB *acb;
 
-    acb = qcow_aio_setup(bs, sector_num, buf, nb_sectors, cb, opaque);
+    acb = qcow_aio_setup(bs, sector_num, NULL, buf, nb_sectors, cb, opaque);
     if (!acb)
         return NULL;
+    acb->resume = qcow_aio_read_next;
 
     qcow_aio_read_cb(acb, 0);
     return &acb->common;
 }
 
-static void qcow_aio_write_cb(void *opaque, int ret)
-{
-    QCowAIOCB *acb = opaque;
-    BlockDriverState *bs = acb->common.bs;
-    BDRVQcowState *s = bs->opaque;
-    int index_in_cluster;
-    uint64_t cluster_offset;
-    const uint8_t *src_buf;
-    int n_end;
+static void qcow_aio_write_next(QCowAIOCB *acb);
 
+static void qcow_aio_write_step(QCowAIOCB *acb, int ret)
+{
     acb->hd_aiocb = NULL;
+    alloc_run_done(acb);
 
     if (ret < 0) {
-    fail:
         acb->common.cb(acb->common.opaque, ret);
         qemu_aio_release(acb);
         return;
@@ -1339,7 +1966,7 @@ static void qcow_aio_write_cb(void *opaque, int ret)
 
     acb->nb_sectors -= acb->n;
     acb->sector_num += acb->n;
-    acb->buf += acb->n * 512;
+    acb->bytes_done += acb->n * 512;
 
     if (acb->nb_sectors == 0) {
         /* request completed */
@@ -1348,20 +1975,72 @@ static void qcow_aio_write_cb(void *opaque, int ret)
         return;
     }
 
+    qcow_aio_write_next(acb);
+}
+
+static void qcow_aio_write_cb(void *opaque, int ret)
+{
+    QCowAIOCB *acb = opaque;
+    BlockDriverState *bs = acb->common.bs;
+
+    if (qcow_step_enter(bs, &acb->deferred, qcow_aio_write_cb, opaque, ret))
+        return;
+    qcow_aio_write_step(acb, ret);
+    qcow_step_leave(bs);
+}
+
+/* return 1 if writing at offset may allocate clusters */
+static int qcow_aio_write_allocates(BDRVQcowState *s, uint64_t offset)
+{
+    uint64_t l2_offset, *l2_table;
+    int l1_index;
+
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size)
+        return 1;
+    l2_offset = s->l1_table[l1_index];
+    if (!(l2_offset & QCOW_OFLAG_COPIED))
+        return 1;
+    l2_table = seek_l2_table(s, l2_offset & ~QCOW_OFLAG_COPIED);
+    if (l2_table == NULL)
+        return 1;
+    return !(be64_to_cpu(l2_table[(offset >> s->cluster_bits) &
+                                  (s->l2_size - 1)]) & QCOW_OFLAG_COPIED);
+}
+
+static void qcow_aio_write_next(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster, n, pad;
+    uint64_t cluster_offset;
+    int n_end, ret;
+
+    n = acb->nb_sectors;
+    if (alloc_run_wait(acb, &n))
+        return;
+    /* get the L2 table and refcount block without blocking */
+    if (meta_wait_l2(acb, acb->sector_num << 9))
+        return;
+    if (qcow_aio_write_allocates(s, acb->sector_num << 9) &&
+        meta_wait_refcount(acb))
+        return;
+
+    ret = -EIO;
     index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
-    n_end = index_in_cluster + acb->nb_sectors;
+    n_end = index_in_cluster + n;
     if (s->crypt_method &&
         n_end > QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors)
         n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
 
     cluster_offset = alloc_cluster_offset(bs, acb->sector_num << 9,
                                           index_in_cluster,
-                                          n_end, &acb->n);
+                                          n_end, &acb->n, &pad);
     if (!cluster_offset || (cluster_offset & 511) != 0) {
         ret = -EIO;
         goto fail;
     }
-    if (s->crypt_method) {
+    if (pad || s->crypt_method) {
         if (!acb->cluster_data) {
             acb->cluster_data = qemu_mallocz(QCOW_MAX_CRYPT_CLUSTERS *
                                              s->cluster_size);
@@ -1370,18 +2049,51 @@ static void qcow_aio_write_cb(void *opaque, int ret)
                 goto fail;
             }
         }
-        encrypt_sectors(s, acb->sector_num, acb->cluster_data, acb->buf,
-                        acb->n, 1, &s->aes_encrypt_key);
-        src_buf = acb->cluster_data;
+    }
+    qcow_aio_slice(acb, 0, acb->n * 512);
+    if (pad) {
+        /* the write completes acb->n sectors of the request.  The L2
+           entries already point to the clusters: the other requests for
+           them wait until the padding is written too. */
+        memset(acb->cluster_data, 0, pad * 512);
+        qemu_iovec_to_buffer(&acb->hd_qiov,
+                             acb->cluster_data + index_in_cluster * 512);
+        acb->alloc_run.offset = (acb->sector_num << 9) &
+                                ~(uint64_t)(s->cluster_size - 1);
+        acb->alloc_run.nb_clusters = pad >> (s->cluster_bits - 9);
+        LIST_INIT(&acb->alloc_run.waiters);
+        LIST_INSERT_HEAD(&s->alloc_runs, &acb->alloc_run, link);
+        acb->alloc_run_active = 1;
+        acb->hd_aiocb = bdrv_aio_write(s->hd, cluster_offset >> 9,
+                                       acb->cluster_data, pad,
+                                       qcow_aio_write_cb, acb);
+        if (acb->hd_aiocb == NULL) {
+            alloc_run_done(acb);
+            goto fail;
+        }
+        return;
+    }
+    if (s->crypt_method) {
+        qemu_iovec_to_buffer(&acb->hd_qiov, acb->cluster_data);
+        encrypt_sectors(s, acb->sector_num, acb->cluster_data,
+                        acb->cluster_data, acb->n, 1, &s->aes_encrypt_key);
+        acb->hd_aiocb = bdrv_aio_write(s->hd,
+                                       (cluster_offset >> 9) + index_in_cluster,
+                                       acb->cluster_data, acb->n,
+                                       qcow_aio_write_cb, acb);
     } else {
-        src_buf = acb->buf;
+        acb->hd_aiocb = bdrv_aio_writev(s->hd,
+                                        (cluster_offset >> 9) + index_in_cluster,
+                                        &acb->hd_qiov, acb->n,
+                                        qcow_aio_write_cb, acb);
     }
-    acb->hd_aiocb = bdrv_aio_write(s->hd,
-                                   (cluster_offset >> 9) + index_in_cluster,
-                                   src_buf, acb->n,
-                                   qcow_aio_write_cb, acb);
     if (acb->hd_aiocb == NULL)
         goto fail;
+    return;
+
+ fail:
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
 }
 
 static BlockDriverAIOCB *qcow_aio_write(BlockDriverState *bs,
@@ -1393,9 +2105,29 @@ static BlockDriverAIOCB *qcow_aio_write(BlockDriverState *bs,
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
-    acb = qcow_aio_setup(bs, sector_num, (uint8_t*)buf, nb_sectors, cb, opaque);
+    acb = qcow_aio_setup(bs, sector_num, NULL, (uint8_t*)buf, nb_sectors,
+                         cb, opaque);
     if (!acb)
         return NULL;
+    acb->resume = qcow_aio_write_next;
+
+    qcow_aio_write_cb(acb, 0);
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *qcow_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowAIOCB *acb;
+
+    s->cluster_cache_offset = -1; /* disable compressed cache */
+
+    acb = qcow_aio_setup(bs, sector_num, qiov, NULL, nb_sectors, cb, opaque);
+    if (!acb)
+        return NULL;
+    acb->resume = qcow_aio_write_next;
 
     qcow_aio_write_cb(acb, 0);
     return &acb->common;
@@ -1404,16 +2136,32 @@ static BlockDriverAIOCB *qcow_aio_write(BlockDriverState *bs,
 static void qcow_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QCowAIOCB *acb = (QCowAIOCB *)blockacb;
+    if (qcow_step_cancel(acb->common.bs, &acb->deferred))
+        acb->hd_aiocb = NULL;
     if (acb->hd_aiocb)
         bdrv_aio_cancel(acb->hd_aiocb);
+    if (acb->wait_load || acb->wait_run)
+        LIST_REMOVE(acb, wait_link);
+    alloc_run_done(acb);
     qemu_aio_release(acb);
 }
 
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    QCowMetaLoad *load;
+
+    while ((load = LIST_FIRST(&s->meta_loads)) != NULL) {
+        if (!qcow_step_cancel(bs, &load->deferred))
+            bdrv_aio_cancel(load->aiocb);
+        LIST_REMOVE(load, link);
+        qemu_free(load->buf);
+        qemu_free(load);
+    }
+    refcount_cache_flush(bs);
+    l2_cache_flush(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
+    l2_cache_close(bs);
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     refcount_close(bs);
@@ -1449,6 +2197,60 @@ static void create_refcount_update(QCowCreateState *s,
     }
 }
 
+/* allocate the L2 tables and clusters of the whole image */
+static int qcow_preallocate(const char *filename)
+{
+    BlockDriverState *bs;
+    BDRVQcowState *s;
+    int64_t sector_num, nb_sectors, end, last;
+    uint64_t cluster_offset;
+    int n, n_end, pad, ret;
+    uint8_t zero[512];
+
+    bs = bdrv_new("");
+    if (!bs)
+        return -ENOMEM;
+    ret = bdrv_open2(bs, filename, BDRV_O_RDWR | BDRV_O_CACHE_WB, &bdrv_qcow2);
+    if (ret < 0) {
+        bdrv_delete(bs);
+        return ret;
+    }
+    s = bs->opaque;
+
+    ret = -EIO;
+    end = 0;
+    sector_num = 0;
+    nb_sectors = bs->total_sectors;
+    while (nb_sectors > 0) {
+        /* one L2 table at a time */
+        n_end = s->l2_size << (s->cluster_bits - 9);
+        if (n_end > nb_sectors)
+            n_end = nb_sectors;
+        cluster_offset = alloc_cluster_offset(bs, sector_num << 9, 0, n_end,
+                                              &n, &pad);
+        if (!cluster_offset)
+            goto fail;
+        /* the data clusters are never written: no padding needed */
+        last = cluster_offset + align_offset(n << 9, s->cluster_size);
+        if (last > end)
+            end = last;
+        sector_num += n;
+        nb_sectors -= n;
+    }
+
+    /* extend the file so that the data clusters read as zeros */
+    if (end > bdrv_getlength(s->hd)) {
+        memset(zero, 0, sizeof(zero));
+        if (bdrv_pwrite(s->hd, end - sizeof(zero), zero, sizeof(zero)) !=
+            sizeof(zero))
+            goto fail;
+    }
+    ret = 0;
+ fail:
+    bdrv_delete(bs);
+    return ret;
+}
+
 static int qcow_create(const char *filename, int64_t total_size,
                       const char *backing_file, int flags)
 {
@@ -1457,6 +2259,12 @@ static int qcow_create(const char *filename, int64_t total_size,
     uint64_t tmp, offset;
     QCowCreateState s1, *s = &s1;
 
+    /* preallocated clusters would hide the base image, and decrypt to
+       garbage */
+    if ((flags & BLOCK_FLAG_PREALLOC) &&
+        (backing_file || (flags & BLOCK_FLAG_ENCRYPT)))
+        return -ENOTSUP;
+
     memset(s, 0, sizeof(*s));
 
     fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
@@ -1533,6 +2341,9 @@ static int qcow_create(const char *filename, int64_t total_size,
     qemu_free(s->refcount_table);
     qemu_free(s->refcount_block);
     close(fd);
+
+    if (flags & BLOCK_FLAG_PREALLOC)
+        return qcow_preallocate(filename);
     return 0;
  fail:
     qemu_free(s->refcount_table);
@@ -1563,11 +2374,35 @@ static int qcow_make_empty(BlockDriverState *bs)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+static int qcow_write_precompressed(BlockDriverState *bs, int64_t sector_num,
+                                    const uint8_t *buf, int nb_sectors,
+                                    const uint8_t *cbuf, int clen)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    if (clen < 0) {
+        /* could not compress: write normal cluster */
+        return qcow_write(bs, sector_num, buf, s->cluster_sectors);
+    }
+
+    cluster_offset = alloc_compressed_cluster_offset(bs, sector_num << 9,
+                                                     clen);
+    if (!cluster_offset)
+        return -1;
+    cluster_offset &= s->cluster_offset_mask;
+    if (bdrv_pwrite(s->hd, cluster_offset, cbuf, clen) != clen)
+        return -1;
+    return 0;
+}
+
 static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -1584,57 +2419,21 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     if (nb_sectors != s->cluster_sectors)
         return -EINVAL;
 
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    out_buf = qemu_malloc(s->cluster_size);
     if (!out_buf)
         return -ENOMEM;
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
-        deflateEnd(&strm);
-        return -1;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        qcow_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = alloc_compressed_cluster_offset(bs, sector_num << 9,
-                                              out_len);
-        if (!cluster_offset)
-            return -1;
-        cluster_offset &= s->cluster_offset_mask;
-        if (bdrv_pwrite(s->hd, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
-    }
-
+    out_len = bdrv_compress_cluster(out_buf, buf, s->cluster_size);
+    ret = qcow_write_precompressed(bs, sector_num, buf, nb_sectors,
+                                   out_buf, out_len);
     qemu_free(out_buf);
-    return 0;
+    return ret;
 }
 
 static void qcow_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    refcount_cache_flush(bs);
+    l2_cache_flush(bs);
     bdrv_flush(s->hd);
 }
 
@@ -1758,6 +2557,8 @@ static int update_snapshot_refcount(BlockDriverState *bs,
     if (l1_allocated)
         qemu_free(l1_table);
     qemu_free(l2_table);
+    if (refcount_cache_flush(bs) < 0)
+        return -EIO;
     return 0;
  fail:
     if (l1_allocated)
@@ -1886,6 +2687,11 @@ static int qcow_write_snapshots(BlockDriverState *bs)
         offset += name_size;
     }
 
+    /* the new table and the snapshot clusters must be accounted for
+       before the header points to them */
+    if (refcount_cache_flush(bs) < 0)
+        goto fail;
+
     /* update the various header fields */
     data64 = cpu_to_be64(snapshots_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, snapshots_offset),
@@ -2053,6 +2859,8 @@ static int qcow_snapshot_goto(BlockDriverState *bs,
 
     if (update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1) < 0)
         goto fail;
+    if (refcount_cache_flush(bs) < 0)
+        goto fail;
 
 #ifdef DEBUG_ALLOC
     check_refcounts(bs);
@@ -2136,7 +2944,8 @@ static int refcount_init(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     int ret, refcount_table_size2, i;
 
-    s->refcount_block_cache = qemu_malloc(s->cluster_size);
+    s->refcount_block_cache = qemu_malloc(REFCOUNT_CACHE_SIZE *
+                                          s->cluster_size);
     if (!s->refcount_block_cache)
         goto fail;
     refcount_table_size2 = s->refcount_table_size * sizeof(uint64_t);
@@ -2164,23 +2973,103 @@ static void refcount_close(BlockDriverState *bs)
 }
 
 
+/*
+ * Refcount blocks are cached like L2 tables, but only a few of them,
+ * evicting the least recently used one.  Updated blocks are written
+ * when they are evicted, and always before any L2 or L1 entry is
+ * written, so that the image never points to a cluster whose
+ * refcount is still 0 on disk.
+ */
+
+static inline uint16_t *refcount_cache_block(BDRVQcowState *s, int i)
+{
+    return s->refcount_block_cache +
+        ((size_t)i << (s->cluster_bits - REFCOUNT_SHIFT));
+}
+
+static int refcount_cache_find(BDRVQcowState *s, uint64_t offset)
+{
+    int i;
+
+    for (i = 0; i < REFCOUNT_CACHE_SIZE; i++) {
+        if (s->refcount_cache_offsets[i] == offset) {
+            s->refcount_cache_used[i] = ++s->refcount_cache_clock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int refcount_cache_writeback(BlockDriverState *bs, int i)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!s->refcount_cache_dirty[i])
+        return 0;
+    if (bdrv_pwrite(s->hd, s->refcount_cache_offsets[i],
+                    refcount_cache_block(s, i), s->cluster_size) !=
+        s->cluster_size)
+        return -EIO;
+    s->refcount_cache_dirty[i] = 0;
+    return 0;
+}
+
+static int refcount_cache_flush(BlockDriverState *bs)
+{
+    int i, ret;
+
+    for (i = 0; i < REFCOUNT_CACHE_SIZE; i++) {
+        ret = refcount_cache_writeback(bs, i);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* return the index of a free entry, writing back the evicted block */
+static int refcount_cache_new_entry(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, min_index;
+
+    min_index = 0;
+    for (i = 1; i < REFCOUNT_CACHE_SIZE; i++) {
+        if (s->refcount_cache_used[i] < s->refcount_cache_used[min_index])
+            min_index = i;
+    }
+    if (refcount_cache_writeback(bs, min_index) < 0)
+        return -EIO;
+    s->refcount_cache_offsets[min_index] = 0;
+    s->refcount_cache_used[min_index] = ++s->refcount_cache_clock;
+    return min_index;
+}
+
+/* return the cache index of the refcount block, reading it if needed */
 static int load_refcount_block(BlockDriverState *bs,
                                int64_t refcount_block_offset)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret;
-    ret = bdrv_pread(s->hd, refcount_block_offset, s->refcount_block_cache,
+    int i, ret;
+
+    i = refcount_cache_find(s, refcount_block_offset);
+    if (i >= 0)
+        return i;
+    i = refcount_cache_new_entry(bs);
+    if (i < 0)
+        return i;
+    ret = bdrv_pread(s->hd, refcount_block_offset, refcount_cache_block(s, i),
                      s->cluster_size);
     if (ret != s->cluster_size)
         return -EIO;
-    s->refcount_block_cache_offset = refcount_block_offset;
-    return 0;
+    meta_load_invalidate(s, QCOW_META_REFCOUNT, refcount_block_offset);
+    s->refcount_cache_offsets[i] = refcount_block_offset;
+    return i;
 }
 
 static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
 {
     BDRVQcowState *s = bs->opaque;
-    int refcount_table_index, block_index;
+    int refcount_table_index, block_index, i;
     int64_t refcount_block_offset;
 
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
@@ -2189,14 +3078,13 @@ static int get_refcount(BlockDriverState *bs, int64_t cluster_index)
     refcount_block_offset = s->refcount_table[refcount_table_index];
     if (!refcount_block_offset)
         return 0;
-    if (refcount_block_offset != s->refcount_block_cache_offset) {
-        /* better than nothing: return allocated if read error */
-        if (load_refcount_block(bs, refcount_block_offset) < 0)
-            return 1;
-    }
+    i = load_refcount_block(bs, refcount_block_offset);
+    /* better than nothing: return allocated if read error */
+    if (i < 0)
+        return 1;
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    return be16_to_cpu(s->refcount_block_cache[block_index]);
+    return be16_to_cpu(refcount_cache_block(s, i)[block_index]);
 }
 
 /* return < 0 if error */
@@ -2353,14 +3241,14 @@ static int grow_refcount_table(BlockDriverState *bs, int min_size)
 }
 
 /* addend must be 1 or -1 */
-/* XXX: cache several refcount block clusters ? */
 static int update_cluster_refcount(BlockDriverState *bs,
                                    int64_t cluster_index,
                                    int addend)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t offset, refcount_block_offset;
-    int ret, refcount_table_index, block_index, refcount;
+    int ret, refcount_table_index, block_index, refcount, i;
+    uint16_t *refcount_block;
     uint64_t data64;
 
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
@@ -2378,10 +3266,15 @@ static int update_cluster_refcount(BlockDriverState *bs,
         /* create a new refcount block */
         /* Note: we cannot update the refcount now to avoid recursion */
         offset = alloc_clusters_noref(bs, s->cluster_size);
-        memset(s->refcount_block_cache, 0, s->cluster_size);
-        ret = bdrv_pwrite(s->hd, offset, s->refcount_block_cache, s->cluster_size);
+        i = refcount_cache_new_entry(bs);
+        if (i < 0)
+            return i;
+        memset(refcount_cache_block(s, i), 0, s->cluster_size);
+        ret = bdrv_pwrite(s->hd, offset, refcount_cache_block(s, i),
+                          s->cluster_size);
         if (ret != s->cluster_size)
             return -EINVAL;
+        s->refcount_cache_offsets[i] = offset;
         s->refcount_table[refcount_table_index] = offset;
         data64 = cpu_to_be64(offset);
         ret = bdrv_pwrite(s->hd, s->refcount_table_offset +
@@ -2391,29 +3284,25 @@ static int update_cluster_refcount(BlockDriverState *bs,
             return -EINVAL;
 
         refcount_block_offset = offset;
-        s->refcount_block_cache_offset = offset;
         update_refcount(bs, offset, s->cluster_size, 1);
-    } else {
-        if (refcount_block_offset != s->refcount_block_cache_offset) {
-            if (load_refcount_block(bs, refcount_block_offset) < 0)
-                return -EIO;
-        }
     }
-    /* we can update the count and save it */
+    i = load_refcount_block(bs, refcount_block_offset);
+    if (i < 0)
+        return -EIO;
+    refcount_block = refcount_cache_block(s, i);
+
+    /* we can update the count, it is written with the block */
     block_index = cluster_index &
         ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
-    refcount = be16_to_cpu(s->refcount_block_cache[block_index]);
+    refcount = be16_to_cpu(refcount_block[block_index]);
     refcount += addend;
     if (refcount < 0 || refcount > 0xffff)
         return -EINVAL;
     if (refcount == 0 && cluster_index < s->free_cluster_index) {
         s->free_cluster_index = cluster_index;
     }
-    s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
-    if (bdrv_pwrite(s->hd,
-                    refcount_block_offset + (block_index << REFCOUNT_SHIFT),
-                    &s->refcount_block_cache[block_index], 2) != 2)
-        return -EIO;
+    refcount_block[block_index] = cpu_to_be16(refcount);
+    s->refcount_cache_dirty[i] = 1;
     return refcount;
 }
 
@@ -2562,6 +3451,7 @@ static void check_refcounts(BlockDriverState *bs)
     QCowSnapshot *sn;
     uint16_t *refcount_table;
 
+    l2_cache_flush(bs);
     size = bdrv_getlength(s->hd);
     nb_clusters = (size + s->cluster_size - 1) >> s->cluster_bits;
     refcount_table = qemu_mallocz(nb_clusters * sizeof(uint16_t));
@@ -2646,7 +3536,10 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_aio_write = qcow_aio_write,
     .bdrv_aio_cancel = qcow_aio_cancel,
     .aiocb_size = sizeof(QCowAIOCB),
+    .bdrv_aio_readv = qcow_aio_readv,
+    .bdrv_aio_writev = qcow_aio_writev,
     .bdrv_write_compressed = qcow_write_compressed,
+    .bdrv_write_precompressed = qcow_write_precompressed,
 
     .bdrv_snapshot_create = qcow_snapshot_create,
     .bdrv_snapshot_goto = qcow_snapshot_goto,
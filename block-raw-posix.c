@@ -27,7 +27,13 @@
 #include "block_int.h"
 #include <assert.h>
 #ifdef CONFIG_AIO
-#include <aio.h>
+#include <signal.h>
+#include "posix-aio-compat.h"
+#endif
+#ifdef CONFIG_LINUX_AIO
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/aio_abi.h>
 #endif
 
 #ifdef CONFIG_COCOA
@@ -93,16 +99,13 @@
    reopen it to see if the disk has been changed */
 #define FD_OPEN_TIMEOUT 1000
 
-/* posix-aio doesn't allow multiple outstanding requests to a single file
- * descriptor.  we implement a pool of dup()'d file descriptors to work
- * around this */
-#define RAW_FD_POOL_SIZE	64
+/* upper bound on the AIO worker threads, see bdrv_set_aio_threads() */
+static int raw_aio_threads = 64;
 
 typedef struct BDRVRawState {
     int fd;
     int type;
     unsigned int lseek_err_cnt;
-    int fd_pool[RAW_FD_POOL_SIZE];
 #if defined(__linux__)
     /* linux floppy specific */
     int fd_open_flags;
@@ -112,9 +115,13 @@ typedef struct BDRVRawState {
     int fd_media_changed;
 #endif
     uint8_t* aligned_buf;
+    int use_linux_aio;
 } BDRVRawState;
 
 static int posix_aio_init(void);
+#ifdef CONFIG_LINUX_AIO
+static int laio_init(void);
+#endif
 
 static int fd_open(BlockDriverState *bs);
 
@@ -122,7 +129,6 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVRawState *s = bs->opaque;
     int fd, open_flags, ret;
-    int i;
 
     posix_aio_init();
 
@@ -138,6 +144,10 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
     if (flags & BDRV_O_CREAT)
         open_flags |= O_CREAT | O_TRUNC;
 
+    /* native AIO is only asynchronous for files opened with O_DIRECT */
+    if (flags & BDRV_O_NATIVE_AIO)
+        flags |= BDRV_O_NOCACHE;
+
     /* Use O_DSYNC for write-through caching, no flags for write-back caching,
      * and O_DIRECT for no caching. */
     if ((flags & BDRV_O_NOCACHE))
@@ -155,8 +165,6 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
         return ret;
     }
     s->fd = fd;
-    for (i = 0; i < RAW_FD_POOL_SIZE; i++)
-        s->fd_pool[i] = -1;
     s->aligned_buf = NULL;
     if ((flags & BDRV_O_NOCACHE)) {
         s->aligned_buf = qemu_memalign(512, ALIGNED_BUFFER_SIZE);
@@ -166,6 +174,10 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
             return ret;
         }
     }
+#ifdef CONFIG_LINUX_AIO
+    if ((flags & BDRV_O_NATIVE_AIO) && laio_init() == 0)
+        s->use_linux_aio = 1;
+#endif
     return 0;
 }
 
@@ -442,14 +454,18 @@ static int raw_pwrite(BlockDriverState *bs, int64_t offset,
 
 #ifdef CONFIG_AIO
 /***********************************************************/
-/* Unix AIO using POSIX AIO */
+/* Unix AIO using a pool of worker threads */
 
 typedef struct RawAIOCB {
     BlockDriverAIOCB common;
-    int fd;
-    struct aiocb aiocb;
+    struct qemu_paiocb aiocb;
+    struct iovec iov;
     struct RawAIOCB *next;
     int ret;
+#ifdef CONFIG_LINUX_AIO
+    int is_linux_aio;
+    struct iocb iocb;
+#endif
 } RawAIOCB;
 
 typedef struct PosixAioState
@@ -458,38 +474,6 @@ typedef struct PosixAioState
     RawAIOCB *first_aio;
 } PosixAioState;
 
-static int raw_fd_pool_get(BDRVRawState *s)
-{
-    int i;
-
-    for (i = 0; i < RAW_FD_POOL_SIZE; i++) {
-        /* already in use */
-        if (s->fd_pool[i] != -1)
-            continue;
-
-        /* try to dup file descriptor */
-        s->fd_pool[i] = dup(s->fd);
-        if (s->fd_pool[i] != -1)
-            return s->fd_pool[i];
-    }
-
-    /* we couldn't dup the file descriptor so just use the main one */
-    return s->fd;
-}
-
-static void raw_fd_pool_put(RawAIOCB *acb)
-{
-    BDRVRawState *s = acb->common.bs->opaque;
-    int i;
-
-    for (i = 0; i < RAW_FD_POOL_SIZE; i++) {
-        if (s->fd_pool[i] == acb->fd) {
-            close(s->fd_pool[i]);
-            s->fd_pool[i] = -1;
-        }
-    }
-}
-
 static void posix_aio_read(void *opaque)
 {
     PosixAioState *s = opaque;
@@ -497,7 +481,7 @@ static void posix_aio_read(void *opaque)
     int ret;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the notification pipe */
     for (;;) {
         char bytes[16];
 
@@ -515,16 +499,15 @@ static void posix_aio_read(void *opaque)
             acb = *pacb;
             if (!acb)
                 goto the_end;
-            ret = aio_error(&acb->aiocb);
+            ret = qemu_paio_error(&acb->aiocb);
             if (ret == ECANCELED) {
                 /* remove the request */
                 *pacb = acb->next;
-                raw_fd_pool_put(acb);
                 qemu_aio_release(acb);
             } else if (ret != EINPROGRESS) {
                 /* end of aio */
                 if (ret == 0) {
-                    ret = aio_return(&acb->aiocb);
+                    ret = qemu_paio_return(&acb->aiocb);
                     if (ret == acb->aiocb.aio_nbytes)
                         ret = 0;
                     else
@@ -536,7 +519,6 @@ static void posix_aio_read(void *opaque)
                 *pacb = acb->next;
                 /* call the callback */
                 acb->common.cb(acb->common.opaque, ret);
-                raw_fd_pool_put(acb);
                 qemu_aio_release(acb);
                 break;
             } else {
@@ -557,21 +539,16 @@ static PosixAioState *posix_aio_state;
 
 static void aio_signal_handler(int signum)
 {
-    if (posix_aio_state) {
-        char byte = 0;
-
-        write(posix_aio_state->wfd, &byte, sizeof(byte));
-    }
-
     qemu_service_io();
 }
 
 static int posix_aio_init(void)
 {
+    struct qemu_paioinit ai;
     struct sigaction act;
     PosixAioState *s;
     int fds[2];
-  
+
     if (posix_aio_state)
         return 0;
 
@@ -579,11 +556,6 @@ static int posix_aio_init(void)
     if (s == NULL)
         return -ENOMEM;
 
-    sigfillset(&act.sa_mask);
-    act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
-    act.sa_handler = aio_signal_handler;
-    sigaction(SIGUSR2, &act, NULL);
-
     s->first_aio = NULL;
     if (pipe(fds) == -1) {
         fprintf(stderr, "failed to create pipe\n");
@@ -598,31 +570,29 @@ static int posix_aio_init(void)
 
     qemu_aio_set_fd_handler(s->rfd, posix_aio_read, NULL, posix_aio_flush, s);
 
-#if defined(__linux__)
-    {
-        struct aioinit ai;
+    sigfillset(&act.sa_mask);
+    act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
+    act.sa_handler = aio_signal_handler;
+    sigaction(SIGUSR2, &act, NULL);
+
+    /* the worker threads write to the pipe when a request is done.  If
+       the main loop is running guest code, they also send SIGUSR2 so that
+       it returns from cpu_exec(); this never happens in the tools */
+    memset(&ai, 0, sizeof(ai));
+    ai.aio_threads = raw_aio_threads;
+    ai.aio_idle_time = 10;
+    ai.aio_notify_fd = s->wfd;
+    ai.aio_notify_signo = SIGUSR2;
+    ai.aio_notify_busy = &qemu_in_cpu_exec;
+    qemu_paio_init(&ai);
 
-        memset(&ai, 0, sizeof(ai));
-#if defined(__GLIBC_PREREQ) && __GLIBC_PREREQ(2, 4)
-        ai.aio_threads = 64;
-        ai.aio_num = 64;
-#else
-        /* XXX: aio thread exit seems to hang on RedHat 9 and this init
-           seems to fix the problem. */
-        ai.aio_threads = 1;
-        ai.aio_num = 1;
-        ai.aio_idle_time = 365 * 100000;
-#endif
-        aio_init(&ai);
-    }
-#endif
     posix_aio_state = s;
 
     return 0;
 }
 
-static RawAIOCB *raw_aio_setup(BlockDriverState *bs,
-        int64_t sector_num, uint8_t *buf, int nb_sectors,
+static RawAIOCB *raw_aio_setup(BlockDriverState *bs, int64_t sector_num,
+        QEMUIOVector *qiov, int nb_sectors, int type,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     BDRVRawState *s = bs->opaque;
@@ -634,21 +604,44 @@ static RawAIOCB *raw_aio_setup(BlockDriverState *bs,
     acb = qemu_aio_get(bs, cb, opaque);
     if (!acb)
         return NULL;
-    acb->fd = raw_fd_pool_get(s);
-    acb->aiocb.aio_fildes = acb->fd;
-    acb->aiocb.aio_sigevent.sigev_signo = SIGUSR2;
-    acb->aiocb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-    acb->aiocb.aio_buf = buf;
-    if (nb_sectors < 0)
-        acb->aiocb.aio_nbytes = -nb_sectors;
-    else
-        acb->aiocb.aio_nbytes = nb_sectors * 512;
+#ifdef CONFIG_LINUX_AIO
+    acb->is_linux_aio = 0;
+#endif
+    acb->aiocb.aio_fildes = s->fd;
+    acb->aiocb.aio_type = type;
+    if (qiov->niov == 1) {
+        /* the vector may live on the caller's stack */
+        acb->iov = qiov->iov[0];
+        acb->aiocb.aio_iov = &acb->iov;
+    } else {
+        acb->aiocb.aio_iov = qiov->iov;
+    }
+    acb->aiocb.aio_niov = qiov->niov;
+    acb->aiocb.aio_nbytes = nb_sectors * 512;
     acb->aiocb.aio_offset = sector_num * 512;
     acb->next = posix_aio_state->first_aio;
     posix_aio_state->first_aio = acb;
     return acb;
 }
 
+/* remove a request from the queue and free it */
+static void raw_aio_remove(RawAIOCB *acb)
+{
+    RawAIOCB **pacb;
+
+    pacb = &posix_aio_state->first_aio;
+    for(;;) {
+        if (*pacb == NULL) {
+            break;
+        } else if (*pacb == acb) {
+            *pacb = acb->next;
+            qemu_aio_release(acb);
+            break;
+        }
+        pacb = &(*pacb)->next;
+    }
+}
+
 static void raw_aio_em_cb(void* opaque)
 {
     RawAIOCB *acb = opaque;
@@ -656,94 +649,373 @@ static void raw_aio_em_cb(void* opaque)
     qemu_aio_release(acb);
 }
 
-static BlockDriverAIOCB *raw_aio_read(BlockDriverState *bs,
-        int64_t sector_num, uint8_t *buf, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque)
+static int raw_iovec_aligned(QEMUIOVector *qiov)
+{
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        if (((uintptr_t) qiov->iov[i].iov_base % 512) ||
+            (qiov->iov[i].iov_len % 512))
+            return 0;
+    }
+    return 1;
+}
+
+#ifdef CONFIG_LINUX_AIO
+/***********************************************************/
+/* Linux native AIO
+ *
+ * Files opened with BDRV_O_NATIVE_AIO hand their requests to a kernel
+ * AIO context instead of the thread pool.  The requests of one main loop
+ * iteration are collected and submitted together from a bottom half; the
+ * kernel reports completions on an eventfd.
+ */
+
+/* requests that may be queued or in flight in the kernel context */
+#define LAIO_MAX_EVENTS 128
+
+typedef struct LinuxAioState {
+    aio_context_t ctx;
+    int efd;
+    int nb_pending;             /* queued or in flight */
+    int nb_queued;              /* waiting for io_submit */
+    struct iocb *queued[LAIO_MAX_EVENTS];
+    QEMUBH *submit_bh;
+} LinuxAioState;
+
+static LinuxAioState *linux_aio_state;
+
+static int laio_io_setup(unsigned int nr_events, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr_events, ctx);
+}
+
+static int laio_io_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int laio_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                             struct io_event *events, struct timespec *ts)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, ts);
+}
+
+static void laio_complete(LinuxAioState *s, struct io_event *ev)
+{
+    RawAIOCB *acb = (RawAIOCB *)(uintptr_t)ev->data;
+    int ret;
+
+    s->nb_pending--;
+    if (ev->res == acb->aiocb.aio_nbytes)
+        ret = 0;
+    else if ((long)ev->res < 0)
+        ret = ev->res;
+    else
+        ret = -EINVAL;
+    /* a canceled request is freed, but its callback is not called */
+    if (acb->ret != -ECANCELED)
+        acb->common.cb(acb->common.opaque, ret);
+    acb->ret = 0;
+    qemu_aio_release(acb);
+}
+
+/* complete the requests the kernel is done with, waiting for at least
+   min_nr of them; return the number of requests completed */
+static int laio_reap(LinuxAioState *s, int min_nr)
+{
+    struct io_event events[LAIO_MAX_EVENTS];
+    struct timespec ts = { 0, 0 };
+    int i, nevents;
+
+    do {
+        nevents = laio_io_getevents(s->ctx, min_nr, LAIO_MAX_EVENTS, events,
+                                    min_nr ? NULL : &ts);
+    } while (nevents == -1 && errno == EINTR);
+
+    for (i = 0; i < nevents; i++)
+        laio_complete(s, &events[i]);
+    return nevents > 0 ? nevents : 0;
+}
+
+static void laio_completion_cb(void *opaque)
+{
+    LinuxAioState *s = opaque;
+    uint64_t count;
+
+    /* the eventfd counter is only a wake up, io_getevents tells what
+       is done */
+    while (read(s->efd, &count, sizeof(count)) == -1 && errno == EINTR);
+    while (laio_reap(s, 0) > 0);
+}
+
+static int laio_flush_cb(void *opaque)
 {
+    LinuxAioState *s = opaque;
+    return !!s->nb_pending;
+}
+
+static void laio_submit_bh(void *opaque)
+{
+    LinuxAioState *s = opaque;
+    struct iocb *iocbs[LAIO_MAX_EVENTS];
     RawAIOCB *acb;
+    int i, n, done, ret;
 
-    /*
-     * If O_DIRECT is used and the buffer is not aligned fall back
-     * to synchronous IO.
-     */
-    BDRVRawState *s = bs->opaque;
+    /* the callbacks of failed requests may queue new ones */
+    n = s->nb_queued;
+    memcpy(iocbs, s->queued, n * sizeof(struct iocb *));
+    s->nb_queued = 0;
 
-    if (unlikely(s->aligned_buf != NULL && ((uintptr_t) buf % 512))) {
-        QEMUBH *bh;
-        acb = qemu_aio_get(bs, cb, opaque);
-        acb->ret = raw_pread(bs, 512 * sector_num, buf, 512 * nb_sectors);
-        bh = qemu_bh_new(raw_aio_em_cb, acb);
-        qemu_bh_schedule(bh);
-        return &acb->common;
+    for (done = 0; done < n; done += ret) {
+        ret = laio_io_submit(s->ctx, n - done, iocbs + done);
+        if (ret == -1 && errno == EINTR) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0) {
+            ret = ret < 0 ? -errno : -EIO;
+            for (i = done; i < n; i++) {
+                acb = (RawAIOCB *)(uintptr_t)iocbs[i]->aio_data;
+                s->nb_pending--;
+                acb->common.cb(acb->common.opaque, ret);
+                qemu_aio_release(acb);
+            }
+            break;
+        }
+    }
+}
+
+static int laio_init(void)
+{
+    LinuxAioState *s;
+
+    if (linux_aio_state)
+        return 0;
+
+    s = qemu_mallocz(sizeof(LinuxAioState));
+    if (s == NULL)
+        return -ENOMEM;
+
+    s->efd = eventfd(0, 0);
+    if (s->efd == -1)
+        goto fail;
+    fcntl(s->efd, F_SETFL, O_NONBLOCK);
+
+    s->ctx = 0;
+    if (laio_io_setup(LAIO_MAX_EVENTS, &s->ctx) == -1) {
+        close(s->efd);
+        goto fail;
     }
 
-    acb = raw_aio_setup(bs, sector_num, buf, nb_sectors, cb, opaque);
+    s->submit_bh = qemu_bh_new(laio_submit_bh, s);
+    qemu_aio_set_fd_handler(s->efd, laio_completion_cb, NULL,
+                            laio_flush_cb, s);
+    linux_aio_state = s;
+    return 0;
+
+ fail:
+    fprintf(stderr, "qemu: native AIO not available (%s), using threads\n",
+            strerror(errno));
+    qemu_free(s);
+    return -1;
+}
+
+static BlockDriverAIOCB *laio_submit(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    LinuxAioState *s = linux_aio_state;
+    BDRVRawState *rs = bs->opaque;
+    struct iocb *iocb;
+    RawAIOCB *acb;
+
+    acb = qemu_aio_get(bs, cb, opaque);
     if (!acb)
         return NULL;
-    if (aio_read(&acb->aiocb) < 0) {
-        qemu_aio_release(acb);
-        return NULL;
+    acb->is_linux_aio = 1;
+    acb->ret = -EINPROGRESS;
+    acb->aiocb.aio_nbytes = nb_sectors * 512;
+
+    iocb = &acb->iocb;
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_data = (uintptr_t)acb;
+    iocb->aio_fildes = rs->fd;
+    iocb->aio_offset = sector_num * 512;
+    if (qiov->niov == 1) {
+        iocb->aio_lio_opcode =
+            type == QEMU_PAIO_WRITE ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+        iocb->aio_buf = (uintptr_t)qiov->iov[0].iov_base;
+        iocb->aio_nbytes = qiov->iov[0].iov_len;
+    } else {
+        iocb->aio_lio_opcode =
+            type == QEMU_PAIO_WRITE ? IOCB_CMD_PWRITEV : IOCB_CMD_PREADV;
+        iocb->aio_buf = (uintptr_t)qiov->iov;
+        iocb->aio_nbytes = qiov->niov;
     }
+    iocb->aio_flags = IOCB_FLAG_RESFD;
+    iocb->aio_resfd = s->efd;
+
+    s->queued[s->nb_queued++] = iocb;
+    s->nb_pending++;
+    qemu_bh_schedule(s->submit_bh);
     return &acb->common;
 }
 
-static BlockDriverAIOCB *raw_aio_write(BlockDriverState *bs,
-        int64_t sector_num, const uint8_t *buf, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque)
+static void laio_cancel(RawAIOCB *acb)
+{
+    LinuxAioState *s = linux_aio_state;
+    int i;
+
+    for (i = 0; i < s->nb_queued; i++) {
+        if (s->queued[i] == &acb->iocb) {
+            /* not submitted yet */
+            memmove(s->queued + i, s->queued + i + 1,
+                    (s->nb_queued - i - 1) * sizeof(struct iocb *));
+            s->nb_queued--;
+            s->nb_pending--;
+            qemu_aio_release(acb);
+            return;
+        }
+    }
+
+    /* the kernel cannot cancel requests on regular files, so wait for
+       it to finish as the thread pool does */
+    acb->ret = -ECANCELED;
+    while (acb->ret == -ECANCELED)
+        laio_reap(s, 1);
+}
+#endif /* CONFIG_LINUX_AIO */
+
+static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
+    BDRVRawState *s = bs->opaque;
     RawAIOCB *acb;
+    int64_t offset;
+    uint8_t *base;
+    size_t len;
+    int i, ret;
 
     /*
      * If O_DIRECT is used and the buffer is not aligned fall back
      * to synchronous IO.
      */
-    BDRVRawState *s = bs->opaque;
-
-    if (unlikely(s->aligned_buf != NULL && ((uintptr_t) buf % 512))) {
+    if (unlikely(s->aligned_buf != NULL && !raw_iovec_aligned(qiov))) {
         QEMUBH *bh;
         acb = qemu_aio_get(bs, cb, opaque);
-        acb->ret = raw_pwrite(bs, 512 * sector_num, buf, 512 * nb_sectors);
+        if (!acb)
+            return NULL;
+#ifdef CONFIG_LINUX_AIO
+        acb->is_linux_aio = 0;
+#endif
+        acb->ret = 0;
+        offset = sector_num * 512;
+        for (i = 0; i < qiov->niov; i++) {
+            base = qiov->iov[i].iov_base;
+            len = qiov->iov[i].iov_len;
+            if (type == QEMU_PAIO_WRITE)
+                ret = raw_pwrite(bs, offset, base, len);
+            else
+                ret = raw_pread(bs, offset, base, len);
+            if (ret != len) {
+                acb->ret = ret < 0 ? ret : -EIO;
+                break;
+            }
+            offset += len;
+        }
         bh = qemu_bh_new(raw_aio_em_cb, acb);
         qemu_bh_schedule(bh);
         return &acb->common;
     }
 
-    acb = raw_aio_setup(bs, sector_num, (uint8_t*)buf, nb_sectors, cb, opaque);
+#ifdef CONFIG_LINUX_AIO
+    /* requests that do not fit in the kernel context use the threads */
+    if (s->use_linux_aio && linux_aio_state->nb_pending < LAIO_MAX_EVENTS)
+        return laio_submit(bs, sector_num, qiov, nb_sectors, cb, opaque, type);
+#endif
+
+    acb = raw_aio_setup(bs, sector_num, qiov, nb_sectors, type, cb, opaque);
     if (!acb)
         return NULL;
-    if (aio_write(&acb->aiocb) < 0) {
-        qemu_aio_release(acb);
+    if (qemu_paio_submit(&acb->aiocb) < 0) {
+        raw_aio_remove(acb);
         return NULL;
     }
     return &acb->common;
 }
 
+static BlockDriverAIOCB *raw_aio_read(BlockDriverState *bs,
+        int64_t sector_num, uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors * 512;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return raw_aio_submit(bs, sector_num, &qiov, nb_sectors,
+                          cb, opaque, QEMU_PAIO_READ);
+}
+
+static BlockDriverAIOCB *raw_aio_write(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+
+    iov.iov_base = (uint8_t *)buf;
+    iov.iov_len = nb_sectors * 512;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+    return raw_aio_submit(bs, sector_num, &qiov, nb_sectors,
+                          cb, opaque, QEMU_PAIO_WRITE);
+}
+
+/*
+ * Vectored requests are handed to a worker thread as a whole and done
+ * with one preadv/pwritev where the host has them.  The vector must stay
+ * valid until the request completes.
+ */
+static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return raw_aio_submit(bs, sector_num, qiov, nb_sectors,
+                          cb, opaque, QEMU_PAIO_READ);
+}
+
+static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    return raw_aio_submit(bs, sector_num, qiov, nb_sectors,
+                          cb, opaque, QEMU_PAIO_WRITE);
+}
+
 static void raw_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     int ret;
     RawAIOCB *acb = (RawAIOCB *)blockacb;
-    RawAIOCB **pacb;
 
-    ret = aio_cancel(acb->aiocb.aio_fildes, &acb->aiocb);
-    if (ret == AIO_NOTCANCELED) {
+#ifdef CONFIG_LINUX_AIO
+    if (acb->is_linux_aio) {
+        laio_cancel(acb);
+        return;
+    }
+#endif
+
+    ret = qemu_paio_cancel(acb->aiocb.aio_fildes, &acb->aiocb);
+    if (ret == QEMU_PAIO_NOTCANCELED) {
         /* fail safe: if the aio could not be canceled, we wait for
            it */
-        while (aio_error(&acb->aiocb) == EINPROGRESS);
+        while (qemu_paio_error(&acb->aiocb) == EINPROGRESS);
     }
 
     /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
-    for(;;) {
-        if (*pacb == NULL) {
-            break;
-        } else if (*pacb == acb) {
-            *pacb = acb->next;
-            raw_fd_pool_put(acb);
-            qemu_aio_release(acb);
-            break;
-        }
-        pacb = &acb->next;
-    }
+    raw_aio_remove(acb);
 }
 
 #else /* CONFIG_AIO */
@@ -753,16 +1025,10 @@ static int posix_aio_init(void)
 }
 #endif /* CONFIG_AIO */
 
-static void raw_close_fd_pool(BDRVRawState *s)
+void bdrv_set_aio_threads(int nb_threads)
 {
-    int i;
-
-    for (i = 0; i < RAW_FD_POOL_SIZE; i++) {
-        if (s->fd_pool[i] != -1) {
-            close(s->fd_pool[i]);
-            s->fd_pool[i] = -1;
-        }
-    }
+    if (nb_threads > 0)
+        raw_aio_threads = nb_threads;
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -774,7 +1040,6 @@ static void raw_close(BlockDriverState *bs)
         if (s->aligned_buf != NULL)
             qemu_free(s->aligned_buf);
     }
-    raw_close_fd_pool(s);
 }
 
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
@@ -894,6 +1159,8 @@ BlockDriver bdrv_raw = {
     .bdrv_aio_write = raw_aio_write,
     .bdrv_aio_cancel = raw_aio_cancel,
     .aiocb_size = sizeof(RawAIOCB),
+    .bdrv_aio_readv = raw_aio_readv,
+    .bdrv_aio_writev = raw_aio_writev,
 #endif
     .bdrv_pread = raw_pread,
     .bdrv_pwrite = raw_pwrite,
@@ -965,7 +1232,7 @@ kern_return_t GetBSDPath( io_iterator_t mediaIterator, char *bsdPath, CFIndex ma
 static int hdev_open(BlockDriverState *bs, const char *filename, int flags)
 {
     BDRVRawState *s = bs->opaque;
-    int fd, open_flags, ret, i;
+    int fd, open_flags, ret;
 
     posix_aio_init();
 
@@ -1032,8 +1299,6 @@ static int hdev_open(BlockDriverState *bs, const char *filename, int flags)
         return ret;
     }
     s->fd = fd;
-    for (i = 0; i < RAW_FD_POOL_SIZE; i++)
-        s->fd_pool[i] = -1;
 #if defined(__linux__)
     /* close fd so that we can reopen it as needed */
     if (s->type == FTYPE_FD) {
@@ -1061,7 +1326,6 @@ static int fd_open(BlockDriverState *bs)
         (qemu_get_clock(rt_clock) - s->fd_open_time) >= FD_OPEN_TIMEOUT) {
         close(s->fd);
         s->fd = -1;
-        raw_close_fd_pool(s);
 #ifdef DEBUG_FLOPPY
         printf("Floppy closed\n");
 #endif
@@ -1162,7 +1426,6 @@ static int raw_eject(BlockDriverState *bs, int eject_flag)
             if (s->fd >= 0) {
                 close(s->fd);
                 s->fd = -1;
-                raw_close_fd_pool(s);
             }
             fd = open(bs->filename, s->fd_open_flags | O_NONBLOCK);
             if (fd >= 0) {
@@ -1251,6 +1514,8 @@ BlockDriver bdrv_host_device = {
     .bdrv_aio_write = raw_aio_write,
     .bdrv_aio_cancel = raw_aio_cancel,
     .aiocb_size = sizeof(RawAIOCB),
+    .bdrv_aio_readv = raw_aio_readv,
+    .bdrv_aio_writev = raw_aio_writev,
 #endif
     .bdrv_pread = raw_pread,
     .bdrv_pwrite = raw_pwrite,
@@ -24,6 +24,7 @@
 #include "qemu-common.h"
 #include "console.h"
 #include "block_int.h"
+#include <zlib.h>
 
 #ifdef _BSD
 #include <sys/types.h>
@@ -395,7 +396,8 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
     /* Note: for compatibility, we open disk image files as RDWR, and
        RDONLY as fallback */
     if (!(flags & BDRV_O_FILE))
-        open_flags = BDRV_O_RDWR | (flags & BDRV_O_CACHE_MASK);
+        open_flags = BDRV_O_RDWR |
+            (flags & (BDRV_O_CACHE_MASK | BDRV_O_NATIVE_AIO));
     else
         open_flags = flags & ~(BDRV_O_FILE | BDRV_O_SNAPSHOT);
     ret = drv->bdrv_open(bs, filename, open_flags);
@@ -427,6 +429,7 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
         }
         path_combine(backing_filename, sizeof(backing_filename),
                      filename, bs->backing_file);
+        bs->backing_hd->l2_cache_size = bs->l2_cache_size;
         if (bdrv_open(bs->backing_hd, backing_filename, open_flags) < 0)
             goto fail;
     }
@@ -863,6 +866,12 @@ void bdrv_set_geometry_hint(BlockDriverState *bs,
     bs->secs = secs;
 }
 
+/* size in bytes of the cache of image metadata, 0 for the default */
+void bdrv_set_l2_cache_hint(BlockDriverState *bs, int64_t size)
+{
+    bs->l2_cache_size = size;
+}
+
 void bdrv_set_type_hint(BlockDriverState *bs, int type)
 {
     bs->type = type;
@@ -1106,6 +1115,51 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+/* Deflate a cluster the way the qcow formats store it: small window, no
+   zlib header.  'out_buf' must hold 'size' bytes.  Return the compressed
+   length, or -1 if the cluster does not compress.  This only touches its
+   arguments, so it can run on any thread. */
+int bdrv_compress_cluster(uint8_t *out_buf, const uint8_t *buf, int size)
+{
+    z_stream strm;
+    int ret, out_len;
+
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0)
+        return -1;
+
+    strm.avail_in = size;
+    strm.next_in = (uint8_t *)buf;
+    strm.avail_out = size;
+    strm.next_out = out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    out_len = strm.next_out - out_buf;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= size)
+        return -1;
+    return out_len;
+}
+
+/* Write a cluster that bdrv_compress_cluster() compressed to 'clen' bytes
+   of 'cbuf'; if 'clen' is negative, 'buf' is written uncompressed. */
+int bdrv_write_precompressed(BlockDriverState *bs, int64_t sector_num,
+                             const uint8_t *buf, int nb_sectors,
+                             const uint8_t *cbuf, int clen)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_write_precompressed)
+        return bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    return drv->bdrv_write_precompressed(bs, sector_num, buf, nb_sectors,
+                                         cbuf, clen);
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -1284,10 +1338,123 @@ BlockDriverAIOCB *bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
     return ret;
 }
 
+/* vectored requests for drivers that only take a single buffer */
+typedef struct VectorTranslationState {
+    QEMUIOVector *qiov;
+    uint8_t *bounce;
+    int is_write;
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+} VectorTranslationState;
+
+static void bdrv_aio_rw_vector_cb(void *opaque, int ret)
+{
+    VectorTranslationState *s = opaque;
+
+    if (!s->is_write && ret >= 0)
+        qemu_iovec_from_buffer(s->qiov, s->bounce, s->qiov->size);
+    qemu_vfree(s->bounce);
+    s->cb(s->opaque, ret);
+    qemu_free(s);
+}
+
+static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
+{
+    VectorTranslationState *s;
+    BlockDriverAIOCB *acb;
+
+    s = qemu_mallocz(sizeof(VectorTranslationState));
+    if (!s)
+        return NULL;
+    s->bounce = qemu_memalign(512, nb_sectors * 512);
+    if (!s->bounce) {
+        qemu_free(s);
+        return NULL;
+    }
+    s->qiov = qiov;
+    s->is_write = is_write;
+    s->cb = cb;
+    s->opaque = opaque;
+    /* the caller gets the AIOCB of the bounce request, which
+       bdrv_aio_cancel recognizes by its callback */
+    if (is_write) {
+        qemu_iovec_to_buffer(qiov, s->bounce);
+        acb = bdrv_aio_write(bs, sector_num, s->bounce, nb_sectors,
+                             bdrv_aio_rw_vector_cb, s);
+    } else {
+        acb = bdrv_aio_read(bs, sector_num, s->bounce, nb_sectors,
+                            bdrv_aio_rw_vector_cb, s);
+    }
+    if (!acb) {
+        qemu_vfree(s->bounce);
+        qemu_free(s);
+    }
+    return acb;
+}
+
+BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                                 QEMUIOVector *qiov, int nb_sectors,
+                                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+
+    if (!drv)
+        return NULL;
+    if (!drv->bdrv_aio_readv)
+        return bdrv_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque, 0);
+
+    ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors, cb, opaque);
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+	bs->rd_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
+	bs->rd_ops ++;
+    }
+
+    return ret;
+}
+
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *qiov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+
+    if (!drv)
+        return NULL;
+    if (bs->read_only)
+        return NULL;
+    if (!drv->bdrv_aio_writev)
+        return bdrv_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque, 1);
+
+    ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors, cb, opaque);
+
+    if (ret) {
+	/* Update stats even though technically transfer has not happened. */
+	bs->wr_bytes += (unsigned) nb_sectors * SECTOR_SIZE;
+	bs->wr_ops ++;
+    }
+
+    return ret;
+}
+
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 {
     BlockDriver *drv = acb->bs->drv;
 
+    if (acb->cb == bdrv_aio_rw_vector_cb) {
+        VectorTranslationState *s = acb->opaque;
+        drv->bdrv_aio_cancel(acb);
+        qemu_vfree(s->bounce);
+        qemu_free(s);
+        return;
+    }
     drv->bdrv_aio_cancel(acb);
 }
 
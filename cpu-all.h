@@ -730,6 +730,7 @@ void page_set_flags(target_ulong start, target_ulong end, int flags);
 int page_check_range(target_ulong start, target_ulong len, int flags);
 
 void cpu_exec_init_all(unsigned long tb_size);
+void tb_threads_init(int nb_threads);
 CPUState *cpu_copy(CPUState *env);
 
 void cpu_dump_state(CPUState *env, FILE *f,
@@ -743,7 +744,17 @@ void cpu_abort(CPUState *env, const char *fmt, ...)
     __attribute__ ((__format__ (__printf__, 2, 3)))
     __attribute__ ((__noreturn__));
 extern CPUState *first_cpu;
+#if defined(CONFIG_TB_THREADS) && !defined(CONFIG_USER_ONLY) && \
+    defined(TARGET_ARM)
+/* successor blocks can be translated on helper threads, which fetch
+   the guest code through their own copy of the CPU state, and each
+   CPU can run in a host thread of its own */
+#define USE_TB_THREADS
+#define USE_CPU_THREADS
+extern __thread CPUState *cpu_single_env;
+#else
 extern CPUState *cpu_single_env;
+#endif
 extern int64_t qemu_icount;
 extern int use_icount;
 
@@ -761,6 +772,41 @@ extern int use_icount;
 void cpu_interrupt(CPUState *s, int mask);
 void cpu_reset_interrupt(CPUState *env, int mask);
 
+/* one host thread per CPU (-cpu-threads) */
+typedef void CPUWorkFunc(CPUState *env, target_ulong arg);
+
+typedef struct CPUWorkItem {
+    CPUWorkFunc *func;
+    target_ulong arg;
+    struct CPUWorkItem *next;
+} CPUWorkItem;
+
+#ifdef USE_CPU_THREADS
+extern int cpu_threads_enabled;
+
+void qemu_global_lock(void);
+void qemu_global_unlock(void);
+void qemu_global_lock_reset(void);
+void start_exclusive(void);
+void end_exclusive(void);
+void async_run_on_cpu(CPUState *env, CPUWorkFunc *func, target_ulong arg);
+void qemu_cpu_kick(CPUState *env);
+#else
+#define cpu_threads_enabled 0
+
+static inline void qemu_global_lock(void)
+{
+}
+
+static inline void qemu_global_unlock(void)
+{
+}
+
+static inline void qemu_global_lock_reset(void)
+{
+}
+#endif
+
 /* Breakpoint/watchpoint flags */
 #define BP_MEM_READ           0x01
 #define BP_MEM_WRITE          0x02
@@ -902,6 +948,11 @@ static inline void cpu_physical_memory_write(target_phys_addr_t addr,
 {
     cpu_physical_memory_rw(addr, (uint8_t *)buf, len, 1);
 }
+void *cpu_physical_memory_map(target_phys_addr_t addr,
+                              target_phys_addr_t *plen,
+                              int is_write);
+void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
+                               int is_write, target_phys_addr_t access_len);
 uint32_t ldub_phys(target_phys_addr_t addr);
 uint32_t lduw_phys(target_phys_addr_t addr);
 uint32_t ldl_phys(target_phys_addr_t addr);
@@ -942,6 +993,7 @@ static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
+ram_addr_t cpu_physical_memory_collect_dirty(uint64_t *bitmap, int dirty_flag);
 void cpu_tlb_update_dirty(CPUState *env);
 
 int cpu_physical_memory_set_dirty_tracking(int enable);
@@ -206,6 +206,8 @@ typedef struct CPUWatchpoint {
     void *next_cpu; /* next CPU sharing TB cache */                     \
     int cpu_index; /* CPU index (informative) */                        \
     int running; /* Nonzero if cpu is currently running(usermode).  */  \
+    struct CPUWorkItem *queued_work; /* run by this CPU's thread */     \
+    int tlb_resync; /* update the TLB from the dirty bits first */      \
     /* user data */                                                     \
     void *opaque;                                                       \
                                                                         \
@@ -46,7 +46,11 @@
 #define env cpu_single_env
 #endif
 
+#ifdef USE_CPU_THREADS
+__thread int tb_invalidated_flag;
+#else
 int tb_invalidated_flag;
+#endif
 
 //#define DEBUG_EXEC
 //#define DEBUG_SIGNAL
@@ -350,14 +354,14 @@ int cpu_exec(CPUState *env1)
                                                CPU_INTERRUPT_NMI);
                     }
                     if (interrupt_request & CPU_INTERRUPT_DEBUG) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_DEBUG;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_DEBUG);
                         env->exception_index = EXCP_DEBUG;
                         cpu_loop_exit();
                     }
 #if defined(TARGET_ARM) || defined(TARGET_SPARC) || defined(TARGET_MIPS) || \
     defined(TARGET_PPC) || defined(TARGET_ALPHA) || defined(TARGET_CRIS)
                     if (interrupt_request & CPU_INTERRUPT_HALT) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_HALT;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_HALT);
                         env->halted = 1;
                         env->exception_index = EXCP_HLT;
                         cpu_loop_exit();
@@ -520,13 +524,13 @@ int cpu_exec(CPUState *env1)
                    /* Don't use the cached interupt_request value,
                       do_interrupt may have updated the EXITTB flag. */
                     if (env->interrupt_request & CPU_INTERRUPT_EXITTB) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_EXITTB;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_EXITTB);
                         /* ensure that no TB jump will be modified as
                            the program flow was changed */
                         next_tb = 0;
                     }
                     if (interrupt_request & CPU_INTERRUPT_EXIT) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_EXIT;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_EXIT);
                         env->exception_index = EXCP_INTERRUPT;
                         cpu_loop_exit();
                     }
@@ -565,6 +569,7 @@ int cpu_exec(CPUState *env1)
                 }
 #endif
                 spin_lock(&tb_lock);
+                tb_gen_lock();
                 tb = tb_find_fast();
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -591,9 +596,27 @@ int cpu_exec(CPUState *env1)
                         (env->kqemu_enabled != 2) &&
 #endif
                         tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~3), next_tb & 3, tb);
+                    TranslationBlock *last_tb;
+                    target_ulong page;
+
+                    last_tb = (TranslationBlock *)(next_tb & ~3);
+                    page = tb->pc & TARGET_PAGE_MASK;
+                    if (page == (last_tb->pc & TARGET_PAGE_MASK) ||
+                        page == ((last_tb->pc + last_tb->size - 1)
+                                 & TARGET_PAGE_MASK)) {
+                        tb_add_jump(last_tb, next_tb & 3, tb);
+                    }
+#if !defined(CONFIG_USER_ONLY)
+                    /* A jump to another page is only valid while the
+                       mapping seen by this CPU stays the same, so it
+                       cannot be shared between CPUs.  */
+                    else if (first_cpu->next_cpu == NULL) {
+                        tb_add_xpage_jump(last_tb, next_tb & 3, tb);
+                    }
+#endif
                 }
                 }
+                tb_gen_unlock();
                 spin_unlock(&tb_lock);
                 env->current_tb = tb;
 
@@ -654,6 +677,10 @@ int cpu_exec(CPUState *env1)
             } /* for(;;) */
         } else {
             env_to_regs();
+            /* an exception may have been raised while translating or
+               accessing a device */
+            tb_gen_lock_reset();
+            qemu_global_lock_reset();
         }
     } /* for(;;) */
 
@@ -95,3 +95,128 @@ time_t mktimegm(struct tm *tm)
     t += 3600 * tm->tm_hour + 60 * tm->tm_min + tm->tm_sec;
     return t;
 }
+
+/*
+ * Scatter/gather lists
+ *
+ * A QEMUIOVector either owns its iovec array (qemu_iovec_init) and grows
+ * it as segments are added, or wraps an array provided by the caller
+ * (qemu_iovec_init_external), which can then not be added to.
+ */
+
+void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint)
+{
+    if (alloc_hint < 1)
+        alloc_hint = 1;
+    qiov->iov = qemu_malloc(alloc_hint * sizeof(struct iovec));
+    qiov->niov = 0;
+    qiov->nalloc = alloc_hint;
+    qiov->size = 0;
+}
+
+void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov, int niov)
+{
+    int i;
+
+    qiov->iov = iov;
+    qiov->niov = niov;
+    qiov->nalloc = -1;
+    qiov->size = 0;
+    for (i = 0; i < niov; i++)
+        qiov->size += iov[i].iov_len;
+}
+
+void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
+{
+    struct iovec *iov;
+
+    if (qiov->niov == qiov->nalloc) {
+        iov = qemu_realloc(qiov->iov, 2 * qiov->nalloc * sizeof(struct iovec));
+        if (!iov)
+            abort();
+        qiov->iov = iov;
+        qiov->nalloc *= 2;
+    }
+    qiov->iov[qiov->niov].iov_base = base;
+    qiov->iov[qiov->niov].iov_len = len;
+    qiov->niov++;
+    qiov->size += len;
+}
+
+/* append the size bytes of src starting at byte skip to dst */
+void qemu_iovec_copy(QEMUIOVector *dst, QEMUIOVector *src, size_t skip,
+                     size_t size)
+{
+    size_t len;
+    int i;
+
+    for (i = 0; i < src->niov && size > 0; i++) {
+        if (skip >= src->iov[i].iov_len) {
+            skip -= src->iov[i].iov_len;
+            continue;
+        }
+        len = src->iov[i].iov_len - skip;
+        if (len > size)
+            len = size;
+        qemu_iovec_add(dst, (uint8_t *)src->iov[i].iov_base + skip, len);
+        skip = 0;
+        size -= len;
+    }
+}
+
+void qemu_iovec_destroy(QEMUIOVector *qiov)
+{
+    if (qiov->nalloc > 0)
+        qemu_free(qiov->iov);
+    qiov->iov = NULL;
+    qiov->niov = 0;
+    qiov->nalloc = 0;
+    qiov->size = 0;
+}
+
+void qemu_iovec_reset(QEMUIOVector *qiov)
+{
+    qiov->niov = 0;
+    qiov->size = 0;
+}
+
+void qemu_iovec_to_buffer(QEMUIOVector *qiov, void *buf)
+{
+    uint8_t *p = buf;
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        memcpy(p, qiov->iov[i].iov_base, qiov->iov[i].iov_len);
+        p += qiov->iov[i].iov_len;
+    }
+}
+
+void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count)
+{
+    const uint8_t *p = buf;
+    size_t len;
+    int i;
+
+    for (i = 0; i < qiov->niov && count > 0; i++) {
+        len = qiov->iov[i].iov_len;
+        if (len > count)
+            len = count;
+        memcpy(qiov->iov[i].iov_base, p, len);
+        p += len;
+        count -= len;
+    }
+}
+
+void qemu_iovec_memset(QEMUIOVector *qiov, int c, size_t count)
+{
+    size_t len;
+    int i;
+
+    for (i = 0; i < qiov->niov && count > 0; i++) {
+        len = qiov->iov[i].iov_len;
+        if (len > count)
+            len = count;
+        memset(qiov->iov[i].iov_base, c, len);
+        count -= len;
+    }
+}
@@ -53,6 +53,9 @@ extern uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
 extern uint16_t gen_opc_icount[OPC_BUF_SIZE];
 extern target_ulong gen_opc_jump_pc[2];
 extern uint32_t gen_opc_hflags[OPC_BUF_SIZE];
+/* static branch targets of the block being translated */
+extern target_ulong gen_tb_succ[2];
+extern int gen_tb_nb_succ;
 
 typedef void (GenOpFunc)(void);
 typedef void (GenOpFunc1)(long);
@@ -88,6 +91,7 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
 void tb_invalidate_page_range(target_ulong start, target_ulong end);
 void tlb_flush_page(CPUState *env, target_ulong addr);
 void tlb_flush(CPUState *env, int flush_global);
+void tlb_flush_masked(CPUState *env, uint8_t mask[][CPU_TLB_SIZE]);
 int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
                       target_phys_addr_t paddr, int prot,
                       int mmu_idx, int is_softmmu);
@@ -155,6 +159,10 @@ struct TranslationBlock {
        jmp_first */
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
+    /* next TB in the cross page jump hash and nonzero if this TB is in it
+       (i.e. may be the target of direct jumps from other pages) */
+    struct TranslationBlock *xpage_next;
+    uint8_t xpage_linked;
     uint32_t icount;
 };
 
@@ -256,6 +264,10 @@ static inline void tb_add_jump(TranslationBlock *tb, int n,
     }
 }
 
+#if !defined(CONFIG_USER_ONLY)
+void tb_add_xpage_jump(TranslationBlock *tb, int n, TranslationBlock *tb_next);
+#endif
+
 TranslationBlock *tb_find_pc(unsigned long pc_ptr);
 
 #if defined(_WIN32)
@@ -280,7 +292,32 @@ extern void *io_mem_opaque[IO_MEM_NB_ENTRIES];
 
 extern spinlock_t tb_lock;
 
+/* serializes code generation when blocks are also translated on
+   helper threads */
+#ifdef USE_TB_THREADS
+void tb_gen_lock(void);
+void tb_gen_unlock(void);
+void tb_gen_lock_reset(void);
+void tb_gen_lock_init(void);
+#else
+static inline void tb_gen_lock(void)
+{
+}
+
+static inline void tb_gen_unlock(void)
+{
+}
+
+static inline void tb_gen_lock_reset(void)
+{
+}
+#endif
+
+#ifdef USE_CPU_THREADS
+extern __thread int tb_invalidated_flag;
+#else
 extern int tb_invalidated_flag;
+#endif
 
 #if !defined(CONFIG_USER_ONLY)
 
@@ -43,6 +43,10 @@
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #endif
+#ifdef USE_TB_THREADS
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -122,7 +126,11 @@ static ram_addr_t phys_ram_alloc_offset = 0;
 CPUState *first_cpu;
 /* current CPU in the current thread. It is only valid inside
    cpu_exec() */
+#ifdef USE_TB_THREADS
+__thread CPUState *cpu_single_env;
+#else
 CPUState *cpu_single_env;
+#endif
 /* 0 = Do not count executed instructions.
    1 = Precise instruction counting.
    2 = Adaptive rate instruction counting.  */
@@ -195,6 +203,22 @@ static int tlb_flush_count;
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
 
+#if !defined(CONFIG_USER_ONLY)
+/* TBs that are the target of direct jumps from other virtual pages,
+   hashed by the virtual page of their pc.  Such jumps bypass the TLB, so
+   they must be unlinked whenever the mapping of the target page is
+   flushed.  */
+#define TB_XPAGE_HASH_BITS 8
+#define TB_XPAGE_HASH_SIZE (1 << TB_XPAGE_HASH_BITS)
+static TranslationBlock *tb_xpage_hash[TB_XPAGE_HASH_SIZE];
+static int tb_xpage_count;
+
+static inline unsigned int tb_xpage_hash_func(target_ulong pc)
+{
+    return (pc >> TARGET_PAGE_BITS) & (TB_XPAGE_HASH_SIZE - 1);
+}
+#endif
+
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     target_phys_addr_t base;
@@ -375,9 +399,28 @@ static PhysPageDesc *phys_page_find_alloc(target_phys_addr_t index, int alloc)
     return ((PhysPageDesc *)pd) + (index & (L2_SIZE - 1));
 }
 
+/* Last second level table hit by phys_page_find.  Tables are never
+   freed, so only the lookup key needs to be checked.  */
+#ifdef USE_CPU_THREADS
+static __thread target_phys_addr_t phys_map_last_key = -1;
+static __thread PhysPageDesc *phys_map_last_table;
+#else
+static target_phys_addr_t phys_map_last_key = -1;
+static PhysPageDesc *phys_map_last_table;
+#endif
+
 static inline PhysPageDesc *phys_page_find(target_phys_addr_t index)
 {
-    return phys_page_find_alloc(index, 0);
+    PhysPageDesc *pd;
+
+    if ((index >> L2_BITS) == phys_map_last_key)
+        return phys_map_last_table + (index & (L2_SIZE - 1));
+    pd = phys_page_find_alloc(index, 0);
+    if (pd) {
+        phys_map_last_key = index >> L2_BITS;
+        phys_map_last_table = pd - (index & (L2_SIZE - 1));
+    }
+    return pd;
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -577,33 +620,383 @@ static void page_flush_tb(void)
     }
 }
 
+#ifdef USE_TB_THREADS
+/* Translation of successor blocks on helper threads.  When a block is
+   translated, the targets of its direct branches are queued and
+   translated ahead of time by a worker working on a snapshot of the
+   CPU state.  The TCG context and the code buffer are shared, so all
+   code generation is serialized by tb_gen_mutex; the gain comes from
+   the CPU thread running guest code while a worker translates.  A
+   speculative block is kept out of the physical hash table until the
+   CPU looks for it and the guest code it was made from is still the
+   same.  */
+
+#define TB_SPEC_QUEUE_SIZE 64
+#define TB_SPEC_HASH_BITS 10
+#define TB_SPEC_HASH_SIZE (1 << TB_SPEC_HASH_BITS)
+
+typedef struct TBSpecRequest {
+    target_ulong pc;
+    int flags; /* flags of the block branching to 'pc' */
+} TBSpecRequest;
+
+typedef struct TBSpec {
+    TranslationBlock *tb;
+    target_ulong phys_pc;
+    uint8_t *code; /* guest code the block was translated from */
+    target_ulong succ[2];
+    int nb_succ;
+    struct TBSpec *next;
+} TBSpec;
+
+static int tb_spec_nb_threads;
+/* nonzero once code may be generated or run by more than one thread */
+static int tb_gen_lock_enabled;
+static pthread_mutex_t tb_gen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int tb_gen_lock_count;
+
+static pthread_mutex_t tb_spec_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tb_spec_queue_cond = PTHREAD_COND_INITIALIZER;
+static TBSpecRequest tb_spec_queue[TB_SPEC_QUEUE_SIZE];
+static int tb_spec_queue_head;
+static int tb_spec_queue_count;
+/* CPU state the queued blocks are translated with */
+static CPUState *tb_spec_env;
+static int tb_spec_env_gen;
+
+/* finished blocks, indexed by physical pc */
+static TBSpec *tb_spec_hash[TB_SPEC_HASH_SIZE];
+
+static inline unsigned int tb_spec_hash_func(target_ulong phys_pc)
+{
+    return (phys_pc >> 2) & (TB_SPEC_HASH_SIZE - 1);
+}
+
+void tb_gen_lock(void)
+{
+    if (tb_gen_lock_enabled && tb_gen_lock_count++ == 0)
+        pthread_mutex_lock(&tb_gen_mutex);
+}
+
+void tb_gen_unlock(void)
+{
+    if (tb_gen_lock_enabled && --tb_gen_lock_count == 0)
+        pthread_mutex_unlock(&tb_gen_mutex);
+}
+
+/* release the lock however many times it was taken by this thread, and
+   return that count for tb_gen_lock_restore() */
+static int tb_gen_lock_drop(void)
+{
+    int count;
+
+    count = tb_gen_lock_count;
+    if (count > 0) {
+        tb_gen_lock_count = 0;
+        pthread_mutex_unlock(&tb_gen_mutex);
+    }
+    return count;
+}
+
+static void tb_gen_lock_restore(int count)
+{
+    if (count > 0) {
+        pthread_mutex_lock(&tb_gen_mutex);
+        tb_gen_lock_count = count;
+    }
+}
+
+/* release the lock if a guest exception was raised while generating
+   code */
+void tb_gen_lock_reset(void)
+{
+    tb_gen_lock_drop();
+}
+
+/* enable the lock before starting to run code on several threads */
+void tb_gen_lock_init(void)
+{
+    tb_gen_lock_enabled = 1;
+}
+
+/* queue the branch targets 'succ' of 'tb' for translation. Called
+   with the code generation lock held. */
+static void tb_spec_enqueue(CPUState *env, TranslationBlock *tb,
+                            const target_ulong *succ, int nb_succ)
+{
+    TranslationBlock *tb1;
+    int i, n;
+
+    if (!TAILQ_EMPTY(&env->breakpoints) || env->singlestep_enabled ||
+        use_icount)
+        return;
+    pthread_mutex_lock(&tb_spec_queue_lock);
+    for(i = 0; i < nb_succ; i++) {
+        tb1 = env->tb_jmp_cache[tb_jmp_cache_hash_func(succ[i])];
+        if (tb1 && tb1->pc == succ[i])
+            continue;
+        if (tb_spec_queue_count == TB_SPEC_QUEUE_SIZE)
+            break;
+        /* refresh the snapshot once the workers are done with it */
+        if (tb_spec_queue_count == 0) {
+            memcpy(tb_spec_env, env, sizeof(CPUState));
+            TAILQ_INIT(&tb_spec_env->breakpoints);
+            TAILQ_INIT(&tb_spec_env->watchpoints);
+            tb_spec_env_gen++;
+        }
+        n = (tb_spec_queue_head + tb_spec_queue_count) % TB_SPEC_QUEUE_SIZE;
+        tb_spec_queue[n].pc = succ[i];
+        tb_spec_queue[n].flags = tb->flags;
+        tb_spec_queue_count++;
+        pthread_cond_signal(&tb_spec_queue_cond);
+    }
+    pthread_mutex_unlock(&tb_spec_queue_lock);
+}
+
+/* take the speculative block matching the given CPU state, if any,
+   and link it. Called with the code generation lock held. */
+static TranslationBlock *tb_spec_claim(CPUState *env, target_ulong pc,
+                                       target_ulong cs_base, int flags,
+                                       target_ulong phys_pc)
+{
+    TBSpec *spec, **pspec;
+    TranslationBlock *tb;
+
+    pspec = &tb_spec_hash[tb_spec_hash_func(phys_pc)];
+    for(;;) {
+        spec = *pspec;
+        if (!spec)
+            return NULL;
+        tb = spec->tb;
+        if (spec->phys_pc == phys_pc && tb->pc == pc &&
+            tb->cs_base == cs_base && tb->flags == flags)
+            break;
+        pspec = &spec->next;
+    }
+    *pspec = spec->next;
+    if (memcmp(spec->code, phys_ram_base + phys_pc, tb->size) == 0) {
+        tb_link_phys(tb, phys_pc, -1);
+        tb_spec_enqueue(env, tb, spec->succ, spec->nb_succ);
+    } else {
+        /* the guest code changed since: the block is lost until the
+           next flush */
+        tb = NULL;
+    }
+    qemu_free(spec->code);
+    qemu_free(spec);
+    return tb;
+}
+
+/* drop all speculative blocks and requests. Called with the code
+   generation lock held. */
+static void tb_spec_flush(void)
+{
+    TBSpec *spec, *next;
+    int i;
+
+    if (!tb_spec_nb_threads)
+        return;
+    pthread_mutex_lock(&tb_spec_queue_lock);
+    tb_spec_queue_count = 0;
+    pthread_mutex_unlock(&tb_spec_queue_lock);
+    for(i = 0; i < TB_SPEC_HASH_SIZE; i++) {
+        for(spec = tb_spec_hash[i]; spec != NULL; spec = next) {
+            next = spec->next;
+            qemu_free(spec->code);
+            qemu_free(spec);
+        }
+        tb_spec_hash[i] = NULL;
+    }
+}
+
+/* translate the block at the current pc of 'env1', a private copy of
+   the CPU state. Nothing is done if the code cannot be fetched without
+   a guest exception or is not in RAM or ROM. */
+static void tb_spec_translate(CPUState *env1)
+{
+    TranslationBlock * volatile tb;
+    TBSpec *spec;
+    target_ulong pc, cs_base, phys_pc;
+    int flags, mmu_idx, page_index, pd, code_gen_size, code_len;
+    unsigned int h;
+    uint8_t code[TARGET_PAGE_SIZE];
+
+    cpu_get_tb_cpu_state(env1, &pc, &cs_base, &flags);
+    tb = NULL;
+    tb_gen_lock();
+    if (setjmp(env1->jmp_env) == 0) {
+        page_index = (pc >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+        mmu_idx = cpu_mmu_index(env1);
+        if (env1->tlb_table[mmu_idx][page_index].addr_code !=
+            (pc & TARGET_PAGE_MASK))
+            ldub_code(pc);
+        pd = env1->tlb_table[mmu_idx][page_index].addr_code &
+            ~TARGET_PAGE_MASK;
+        if (pd > IO_MEM_ROM && !(pd & IO_MEM_ROMD))
+            goto done;
+        phys_pc = pc + env1->tlb_table[mmu_idx][page_index].addend -
+            (unsigned long)phys_ram_base;
+
+        h = tb_spec_hash_func(phys_pc);
+        for(spec = tb_spec_hash[h]; spec != NULL; spec = spec->next) {
+            if (spec->phys_pc == phys_pc && spec->tb->pc == pc &&
+                spec->tb->flags == flags)
+                goto done;
+        }
+
+        /* the block is checked against the code as it was before the
+           translation, since the guest may modify it meanwhile */
+        code_len = TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK);
+        memcpy(code, phys_ram_base + phys_pc, code_len);
+
+        /* a full buffer is left for the CPU thread to flush */
+        tb = tb_alloc(pc);
+        if (!tb)
+            goto done;
+        tb->tc_ptr = code_gen_ptr;
+        tb->cs_base = cs_base;
+        tb->flags = flags;
+        tb->cflags = 0;
+        cpu_gen_code(env1, tb, &code_gen_size);
+        code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+        if ((pc & TARGET_PAGE_MASK) != ((pc + tb->size - 1) & TARGET_PAGE_MASK) ||
+            memcmp(code, phys_ram_base + phys_pc, tb->size) != 0) {
+            tb_free(tb);
+            goto done;
+        }
+
+        spec = qemu_malloc(sizeof(TBSpec));
+        spec->tb = tb;
+        spec->phys_pc = phys_pc;
+        spec->code = qemu_malloc(tb->size);
+        memcpy(spec->code, code, tb->size);
+        memcpy(spec->succ, gen_tb_succ, sizeof(spec->succ));
+        spec->nb_succ = gen_tb_nb_succ;
+        spec->next = tb_spec_hash[h];
+        tb_spec_hash[h] = spec;
+    } else {
+        /* guest exception while fetching the code */
+        if (tb)
+            tb_free(tb);
+    }
+ done:
+    tb_gen_lock_reset();
+}
+
+static void *tb_spec_thread(void *opaque)
+{
+    CPUState *env1;
+    TBSpecRequest req;
+    sigset_t set;
+    int gen;
+
+    /* leave the signals to the CPU thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    env1 = qemu_mallocz(sizeof(CPUState));
+    cpu_single_env = env1;
+    gen = -1;
+    for(;;) {
+        pthread_mutex_lock(&tb_spec_queue_lock);
+        while (tb_spec_queue_count == 0)
+            pthread_cond_wait(&tb_spec_queue_cond, &tb_spec_queue_lock);
+        req = tb_spec_queue[tb_spec_queue_head];
+        tb_spec_queue_head = (tb_spec_queue_head + 1) % TB_SPEC_QUEUE_SIZE;
+        tb_spec_queue_count--;
+        if (gen != tb_spec_env_gen) {
+            memcpy(env1, tb_spec_env, sizeof(CPUState));
+            gen = tb_spec_env_gen;
+        }
+        pthread_mutex_unlock(&tb_spec_queue_lock);
+
+        cpu_set_tb_succ_state(env1, req.pc, req.flags);
+        tb_spec_translate(env1);
+    }
+    return NULL;
+}
+#endif
+
+/* Start 'nb_threads' threads translating likely successors of the
+   blocks the CPU translates. */
+void tb_threads_init(int nb_threads)
+{
+#ifdef USE_TB_THREADS
+    pthread_t thread;
+    int i;
+
+    if (nb_threads <= 0)
+        return;
+    tb_spec_env = qemu_mallocz(sizeof(CPUState));
+    tb_spec_nb_threads = nb_threads;
+    tb_gen_lock_init();
+    for(i = 0; i < nb_threads; i++) {
+        if (pthread_create(&thread, NULL, tb_spec_thread, NULL) != 0) {
+            fprintf(stderr, "qemu: could not create translation thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+#else
+    if (nb_threads > 0)
+        fprintf(stderr, "qemu: translation threads not supported, ignored\n");
+#endif
+}
+
 /* flush all the translation blocks */
 /* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+#ifdef USE_CPU_THREADS
+    int lock_count;
+#endif
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(code_gen_ptr - code_gen_buffer),
            nb_tbs, nb_tbs > 0 ?
            ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
 #endif
+#ifdef USE_CPU_THREADS
+    /* no other CPU may run generated code during the flush. They may
+       be waiting for the code generation lock on their way out. */
+    lock_count = 0;
+    if (cpu_threads_enabled) {
+        lock_count = tb_gen_lock_drop();
+        start_exclusive();
+    }
+#endif
+    tb_gen_lock();
     if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
         cpu_abort(env1, "Internal error: code buffer overflow\n");
 
     nb_tbs = 0;
+#ifdef USE_TB_THREADS
+    tb_spec_flush();
+#endif
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
     }
 
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
+#if !defined(CONFIG_USER_ONLY)
+    memset (tb_xpage_hash, 0, TB_XPAGE_HASH_SIZE * sizeof (void *));
+    tb_xpage_count = 0;
+#endif
     page_flush_tb();
 
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+    tb_gen_unlock();
+#ifdef USE_CPU_THREADS
+    if (cpu_threads_enabled) {
+        end_exclusive();
+        tb_gen_lock_restore(lock_count);
+    }
+#endif
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -739,6 +1132,7 @@ void tb_phys_invalidate(TranslationBlock *tb, target_ulong page_addr)
     target_phys_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    tb_gen_lock();
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_phys_hash_func(phys_pc);
@@ -759,6 +1153,15 @@ void tb_phys_invalidate(TranslationBlock *tb, target_ulong page_addr)
 
     tb_invalidated_flag = 1;
 
+#if !defined(CONFIG_USER_ONLY)
+    if (tb->xpage_linked) {
+        tb_remove(&tb_xpage_hash[tb_xpage_hash_func(tb->pc)], tb,
+                  offsetof(TranslationBlock, xpage_next));
+        tb->xpage_linked = 0;
+        tb_xpage_count--;
+    }
+#endif
+
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
@@ -785,6 +1188,7 @@ void tb_phys_invalidate(TranslationBlock *tb, target_ulong page_addr)
     tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
 
     tb_phys_invalidate_count++;
+    tb_gen_unlock();
 }
 
 static inline void set_bits(uint8_t *tab, int start, int len)
@@ -855,6 +1259,16 @@ TranslationBlock *tb_gen_code(CPUState *env,
 
     phys_pc = get_phys_addr_code(env, pc);
     //printf("pc %x phys_pc %x\n",pc,phys_pc);
+    tb_gen_lock();
+#ifdef USE_TB_THREADS
+    if (tb_spec_nb_threads && cflags == 0) {
+        tb = tb_spec_claim(env, pc, cs_base, flags, phys_pc);
+        if (tb) {
+            tb_gen_unlock();
+            return tb;
+        }
+    }
+#endif
     tb = tb_alloc(pc);
     if (!tb) {
         /* flush must be done */
@@ -879,6 +1293,11 @@ TranslationBlock *tb_gen_code(CPUState *env,
         phys_page2 = get_phys_addr_code(env, virt_page2);
     }
     tb_link_phys(tb, phys_pc, phys_page2);
+#ifdef USE_TB_THREADS
+    if (tb_spec_nb_threads && cflags == 0)
+        tb_spec_enqueue(env, tb, gen_tb_succ, gen_tb_nb_succ);
+#endif
+    tb_gen_unlock();
     return tb;
 }
 
@@ -907,6 +1326,7 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
         return;
+    tb_gen_lock();
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -991,6 +1411,7 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_gen_unlock();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1011,6 +1432,7 @@ static inline void tb_invalidate_phys_page_fast(target_phys_addr_t start, int le
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p)
         return;
+    tb_gen_lock();
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
@@ -1020,6 +1442,7 @@ static inline void tb_invalidate_phys_page_fast(target_phys_addr_t start, int le
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tb_gen_unlock();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1158,10 +1581,12 @@ void tb_free(TranslationBlock *tb)
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
+    tb_gen_lock();
     if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
         code_gen_ptr = tb->tc_ptr;
         nb_tbs--;
     }
+    tb_gen_unlock();
 }
 
 /* add a new TB and link it to the physical page tables. phys_page2 is
@@ -1191,6 +1616,7 @@ void tb_link_phys(TranslationBlock *tb,
     tb->jmp_first = (TranslationBlock *)((long)tb | 2);
     tb->jmp_next[0] = NULL;
     tb->jmp_next[1] = NULL;
+    tb->xpage_linked = 0;
 
     /* init original jump addresses */
     if (tb->tb_next_offset[0] != 0xffff)
@@ -1204,6 +1630,82 @@ void tb_link_phys(TranslationBlock *tb,
     mmap_unlock();
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* chain 'tb' to 'tb_next' when 'tb_next' starts on a virtual page that
+   'tb' does not cover. The jump is undone by tb_xpage_flush() when the
+   mapping of that page goes away. */
+void tb_add_xpage_jump(TranslationBlock *tb, int n, TranslationBlock *tb_next)
+{
+    TranslationBlock **ptb;
+
+    if (tb->jmp_next[n])
+        return;
+    tb_add_jump(tb, n, tb_next);
+    if (!tb_next->xpage_linked) {
+        ptb = &tb_xpage_hash[tb_xpage_hash_func(tb_next->pc)];
+        tb_next->xpage_next = *ptb;
+        *ptb = tb_next;
+        tb_next->xpage_linked = 1;
+        tb_xpage_count++;
+    }
+}
+
+/* reset the jumps to 'tb' coming from TBs on other virtual pages */
+static void tb_xpage_unlink(TranslationBlock *tb)
+{
+    TranslationBlock *tb1, **ptb;
+    unsigned int n1;
+
+    ptb = &tb->jmp_first;
+    for(;;) {
+        tb1 = *ptb;
+        n1 = (long)tb1 & 3;
+        if (n1 == 2)
+            break;
+        tb1 = (TranslationBlock *)((long)tb1 & ~3);
+        if ((tb1->pc ^ tb->pc) & TARGET_PAGE_MASK) {
+            *ptb = tb1->jmp_next[n1];
+            tb_reset_jump(tb1, n1);
+            tb1->jmp_next[n1] = NULL;
+        } else {
+            ptb = &tb1->jmp_next[n1];
+        }
+    }
+}
+
+/* unlink the cross page jumps into the virtual page 'addr', or into any
+   page if 'addr' is -1 */
+static void tb_xpage_flush(target_ulong addr)
+{
+    TranslationBlock *tb, **ptb;
+    unsigned int h, h_end;
+
+    if (tb_xpage_count == 0)
+        return;
+    if (addr == (target_ulong)-1) {
+        h = 0;
+        h_end = TB_XPAGE_HASH_SIZE;
+    } else {
+        h = tb_xpage_hash_func(addr);
+        h_end = h + 1;
+    }
+    for(; h < h_end; h++) {
+        ptb = &tb_xpage_hash[h];
+        while ((tb = *ptb) != NULL) {
+            if (addr == (target_ulong)-1 ||
+                (tb->pc & TARGET_PAGE_MASK) == addr) {
+                tb_xpage_unlink(tb);
+                *ptb = tb->xpage_next;
+                tb->xpage_linked = 0;
+                tb_xpage_count--;
+            } else {
+                ptb = &tb->xpage_next;
+            }
+        }
+    }
+}
+#endif
+
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
 TranslationBlock *tb_find_pc(unsigned long tc_ptr)
@@ -1212,11 +1714,13 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
     unsigned long v;
     TranslationBlock *tb;
 
+    tb_gen_lock();
+    tb = NULL;
     if (nb_tbs <= 0)
-        return NULL;
+        goto done;
     if (tc_ptr < (unsigned long)code_gen_buffer ||
         tc_ptr >= (unsigned long)code_gen_ptr)
-        return NULL;
+        goto done;
     /* binary search (cf Knuth) */
     m_min = 0;
     m_max = nb_tbs - 1;
@@ -1225,14 +1729,17 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
         tb = &tbs[m];
         v = (unsigned long)tb->tc_ptr;
         if (v == tc_ptr)
-            return tb;
+            goto done;
         else if (tc_ptr < v) {
             m_max = m - 1;
         } else {
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    tb = &tbs[m_max];
+ done:
+    tb_gen_unlock();
+    return tb;
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1498,6 +2005,24 @@ void cpu_set_log_filename(const char *filename)
     cpu_set_log(loglevel);
 }
 
+#ifdef USE_CPU_THREADS
+/* unchain the current TB of 'env' so that its thread looks at
+   interrupt_request.  Only takes the translation lock, so it may be
+   called with it held. */
+static void cpu_exit_tb(CPUState *env)
+{
+    TranslationBlock *tb;
+
+    tb_gen_lock();
+    tb = env->current_tb;
+    if (tb) {
+        env->current_tb = NULL;
+        tb_reset_jump_recursive(tb);
+    }
+    tb_gen_unlock();
+}
+#endif
+
 /* mask must never be zero, except for A20 change call */
 void cpu_interrupt(CPUState *env, int mask)
 {
@@ -1508,6 +2033,15 @@ void cpu_interrupt(CPUState *env, int mask)
     int old_mask;
 
     old_mask = env->interrupt_request;
+#ifdef USE_CPU_THREADS
+    if (cpu_threads_enabled) {
+        /* the CPU thread and the devices update it concurrently */
+        __sync_fetch_and_or(&env->interrupt_request, mask);
+        cpu_exit_tb(env);
+        qemu_cpu_kick(env);
+        return;
+    }
+#endif
     /* FIXME: This is probably not threadsafe.  A different thread could
        be in the middle of a read-modify-write operation.  */
     env->interrupt_request |= mask;
@@ -1542,6 +2076,12 @@ void cpu_interrupt(CPUState *env, int mask)
 
 void cpu_reset_interrupt(CPUState *env, int mask)
 {
+#ifdef USE_CPU_THREADS
+    if (cpu_threads_enabled) {
+        __sync_fetch_and_and(&env->interrupt_request, ~mask);
+        return;
+    }
+#endif
     env->interrupt_request &= ~mask;
 }
 
@@ -1676,6 +2216,18 @@ static inline void tlb_flush_jmp_cache(CPUState *env, target_ulong addr)
 	    TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
 }
 
+#ifdef USE_CPU_THREADS
+static void tlb_flush_work(CPUState *env, target_ulong flush_global)
+{
+    tlb_flush(env, flush_global);
+}
+
+static void tlb_flush_page_work(CPUState *env, target_ulong addr)
+{
+    tlb_flush_page(env, addr);
+}
+#endif
+
 /* NOTE: if flush_global is true, also flush global entries (not
    implemented yet) */
 void tlb_flush(CPUState *env, int flush_global)
@@ -1684,6 +2236,13 @@ void tlb_flush(CPUState *env, int flush_global)
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
+#endif
+#ifdef USE_CPU_THREADS
+    /* the TLB of a running CPU is only modified by its own thread */
+    if (cpu_threads_enabled && env != cpu_single_env) {
+        async_run_on_cpu(env, tlb_flush_work, flush_global);
+        return;
+    }
 #endif
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
@@ -1709,6 +2268,7 @@ void tlb_flush(CPUState *env, int flush_global)
     }
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    tb_xpage_flush(-1);
 
 #ifdef USE_KQEMU
     if (env->kqemu_enabled) {
@@ -1738,6 +2298,12 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
+#endif
+#ifdef USE_CPU_THREADS
+    if (cpu_threads_enabled && env != cpu_single_env) {
+        async_run_on_cpu(env, tlb_flush_page_work, addr);
+        return;
+    }
 #endif
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
@@ -1755,6 +2321,7 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 #endif
 
     tlb_flush_jmp_cache(env, addr);
+    tb_xpage_flush(addr);
 
 #ifdef USE_KQEMU
     if (env->kqemu_enabled) {
@@ -1763,13 +2330,43 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 #endif
 }
 
-/* update the TLBs so that writes to code in the virtual page 'addr'
-   can be detected */
-static void tlb_protect_code(ram_addr_t ram_addr)
+/* Invalidate the TLB entries whose byte is set in 'mask' (indexed by
+   MMU mode and TLB index) and clear those bytes.  Other entries stay
+   valid, so targets with tagged TLBs can drop one address space without
+   a full flush.  */
+void tlb_flush_masked(CPUState *env, uint8_t mask[][CPU_TLB_SIZE])
 {
-    cpu_physical_memory_reset_dirty(ram_addr,
-                                    ram_addr + TARGET_PAGE_SIZE,
-                                    CODE_DIRTY_FLAG);
+    int mmu_idx, i;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_masked:\n");
+#endif
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    env->current_tb = NULL;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            if (mask[mmu_idx][i]) {
+                env->tlb_table[mmu_idx][i].addr_read = -1;
+                env->tlb_table[mmu_idx][i].addr_write = -1;
+                env->tlb_table[mmu_idx][i].addr_code = -1;
+                mask[mmu_idx][i] = 0;
+            }
+        }
+    }
+
+    /* The jump cache may still reference TBs on pages that were evicted
+       from the TLB earlier, so it cannot be cleared selectively.  */
+    memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    tb_xpage_flush(-1);
+
+#ifdef USE_KQEMU
+    if (env->kqemu_enabled) {
+        kqemu_flush(env, 0);
+    }
+#endif
+    tlb_flush_count++;
 }
 
 /* update the TLB so that writes in physical page 'phys_addr' are no longer
@@ -1792,11 +2389,86 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
     }
 }
 
+/* we modify the TLB cache so that the dirty bit will be set again
+   when accessing the range */
+static void tlb_reset_dirty_env(CPUState *env, ram_addr_t start,
+                                unsigned long length)
+{
+    unsigned long start1;
+    int i;
+
+    start1 = start + (unsigned long)phys_ram_base;
+    for(i = 0; i < CPU_TLB_SIZE; i++)
+        tlb_reset_dirty_range(&env->tlb_table[0][i], start1, length);
+    for(i = 0; i < CPU_TLB_SIZE; i++)
+        tlb_reset_dirty_range(&env->tlb_table[1][i], start1, length);
+#if (NB_MMU_MODES >= 3)
+    for(i = 0; i < CPU_TLB_SIZE; i++)
+        tlb_reset_dirty_range(&env->tlb_table[2][i], start1, length);
+#if (NB_MMU_MODES == 4)
+    for(i = 0; i < CPU_TLB_SIZE; i++)
+        tlb_reset_dirty_range(&env->tlb_table[3][i], start1, length);
+#endif
+#endif
+}
+
+static void tlb_reset_dirty_all(ram_addr_t start, unsigned long length)
+{
+    CPUState *env;
+
+#ifdef USE_CPU_THREADS
+    /* the TLB of a running CPU is only modified by its own thread */
+    if (cpu_threads_enabled)
+        start_exclusive();
+#endif
+    for(env = first_cpu; env != NULL; env = env->next_cpu)
+        tlb_reset_dirty_env(env, start, length);
+#ifdef USE_CPU_THREADS
+    if (cpu_threads_enabled)
+        end_exclusive();
+#endif
+}
+
+/* update the TLBs so that writes to code in the virtual page 'addr'
+   can be detected */
+static void tlb_protect_code(ram_addr_t ram_addr)
+{
+#ifdef USE_CPU_THREADS
+    CPUState *env;
+
+    /* The translation lock is held, so the other CPUs cannot be
+       stopped, and the global lock must not be taken.  They are made to
+       leave their current TB and update their TLB from the dirty bits
+       before they run more code.  Their writes to the page meanwhile
+       raced with the translation anyway, which read the code before. */
+    if (cpu_threads_enabled) {
+        __sync_fetch_and_and(&phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS],
+                             ~CODE_DIRTY_FLAG);
+        for(env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (env == cpu_single_env) {
+                tlb_reset_dirty_env(env, ram_addr, TARGET_PAGE_SIZE);
+            } else {
+                __sync_lock_test_and_set(&env->tlb_resync, 1);
+                __sync_fetch_and_or(&env->interrupt_request,
+                                    CPU_INTERRUPT_EXIT);
+                cpu_exit_tb(env);
+            }
+        }
+        return;
+    }
+#endif
+    cpu_physical_memory_reset_dirty(ram_addr,
+                                    ram_addr + TARGET_PAGE_SIZE,
+                                    CODE_DIRTY_FLAG);
+}
+
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
 {
+#ifdef USE_KQEMU
     CPUState *env;
-    unsigned long length, start1;
+#endif
+    unsigned long length;
     int i, mask, len;
     uint8_t *p;
 
@@ -1824,23 +2496,47 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     for(i = 0; i < len; i++)
         p[i] &= mask;
 
-    /* we modify the TLB cache so that the dirty bit will be set again
-       when accessing the range */
-    start1 = start + (unsigned long)phys_ram_base;
-    for(env = first_cpu; env != NULL; env = env->next_cpu) {
-        for(i = 0; i < CPU_TLB_SIZE; i++)
-            tlb_reset_dirty_range(&env->tlb_table[0][i], start1, length);
-        for(i = 0; i < CPU_TLB_SIZE; i++)
-            tlb_reset_dirty_range(&env->tlb_table[1][i], start1, length);
-#if (NB_MMU_MODES >= 3)
-        for(i = 0; i < CPU_TLB_SIZE; i++)
-            tlb_reset_dirty_range(&env->tlb_table[2][i], start1, length);
-#if (NB_MMU_MODES == 4)
-        for(i = 0; i < CPU_TLB_SIZE; i++)
-            tlb_reset_dirty_range(&env->tlb_table[3][i], start1, length);
-#endif
+    tlb_reset_dirty_all(start, length);
+}
+
+/* Move the 'dirty_flag' bit of every RAM page into 'bitmap', which
+   holds one bit per page, 64 pages per word.  phys_ram_dirty is
+   scanned 8 pages at a time and the TLBs are only walked once, over
+   the span of pages that were found dirty.  Returns the number of
+   bits newly set in 'bitmap'.  */
+ram_addr_t cpu_physical_memory_collect_dirty(uint64_t *bitmap, int dirty_flag)
+{
+    ram_addr_t nb_pages = phys_ram_size >> TARGET_PAGE_BITS;
+    uint64_t mask = 0x0101010101010101ULL * (uint8_t)dirty_flag;
+    ram_addr_t page, first = nb_pages, last = 0, count = 0;
+    ram_addr_t i;
+    uint8_t *p;
+
+    for (i = 0; i < nb_pages; i += 8) {
+        p = phys_ram_dirty + i;
+        if (i + 8 <= nb_pages && !(*(uint64_t *)p & mask))
+            continue;
+        for (page = i; page < i + 8 && page < nb_pages; page++, p++) {
+            if (!(*p & dirty_flag))
+                continue;
+            *p &= ~dirty_flag;
+            if (!(bitmap[page >> 6] & (1ULL << (page & 63)))) {
+                bitmap[page >> 6] |= 1ULL << (page & 63);
+                count++;
+            }
+#ifdef USE_KQEMU
+            if (first_cpu->kqemu_enabled)
+                kqemu_set_notdirty(first_cpu, page << TARGET_PAGE_BITS);
 #endif
+            if (page < first)
+                first = page;
+            last = page;
+        }
     }
+    if (first <= last)
+        tlb_reset_dirty_all(first << TARGET_PAGE_BITS,
+                            (last + 1 - first) << TARGET_PAGE_BITS);
+    return count;
 }
 
 int cpu_physical_memory_set_dirty_tracking(int enable)
@@ -2023,6 +2719,10 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 {
 }
 
+void tlb_flush_masked(CPUState *env, uint8_t mask[][CPU_TLB_SIZE])
+{
+}
+
 int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
                       target_phys_addr_t paddr, int prot,
                       int mmu_idx, int is_softmmu)
@@ -2893,6 +3593,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
                 /* XXX: could force cpu_single_env to NULL to avoid
                    potential bugs */
+                qemu_global_lock();
                 if (l >= 4 && ((addr & 3) == 0)) {
                     /* 32 bit write access */
                     val = ldl_p(buf);
@@ -2909,6 +3610,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     io_mem_write[io_index][0](io_mem_opaque[io_index], addr, val);
                     l = 1;
                 }
+                qemu_global_unlock();
             } else {
                 unsigned long addr1;
                 addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
@@ -2928,6 +3630,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                 !(pd & IO_MEM_ROMD)) {
                 /* I/O case */
                 io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
+                qemu_global_lock();
                 if (l >= 4 && ((addr & 3) == 0)) {
                     /* 32 bit read access */
                     val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
@@ -2944,6 +3647,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
                     stb_p(buf, val);
                     l = 1;
                 }
+                qemu_global_unlock();
             } else {
                 /* RAM case */
                 ptr = phys_ram_base + (pd & TARGET_PAGE_MASK) +
@@ -2957,6 +3661,108 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
     }
 }
 
+/* Bounce buffer used to map memory that is not RAM.  Only one such
+   mapping can be in flight at a time.  */
+static struct {
+    uint8_t *buffer;
+    target_phys_addr_t addr;
+    target_phys_addr_t len;
+} bounce;
+
+/* Map a physical memory region into a host virtual address.
+   May map a subset of the requested range, given by and returned in *plen.
+   May return NULL if resources needed to perform the mapping are exhausted.
+   Use only for reads OR writes - not for read-modify-write operations.  */
+void *cpu_physical_memory_map(target_phys_addr_t addr,
+                              target_phys_addr_t *plen,
+                              int is_write)
+{
+    target_phys_addr_t len = *plen;
+    target_phys_addr_t done = 0;
+    int l;
+    uint8_t *ret = NULL;
+    uint8_t *ptr;
+    target_phys_addr_t page;
+    unsigned long pd;
+    PhysPageDesc *p;
+    unsigned long addr1;
+
+    while (len > 0) {
+        page = addr & TARGET_PAGE_MASK;
+        l = (page + TARGET_PAGE_SIZE) - addr;
+        if (l > len)
+            l = len;
+        p = phys_page_find(page >> TARGET_PAGE_BITS);
+        if (!p) {
+            pd = IO_MEM_UNASSIGNED;
+        } else {
+            pd = p->phys_offset;
+        }
+
+        if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
+            if (done || bounce.buffer) {
+                break;
+            }
+            bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+            bounce.addr = addr;
+            bounce.len = l;
+            if (!is_write) {
+                cpu_physical_memory_rw(addr, bounce.buffer, l, 0);
+            }
+            ptr = bounce.buffer;
+        } else {
+            addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
+            ptr = phys_ram_base + addr1;
+        }
+        if (!done) {
+            ret = ptr;
+        } else if (ret + done != ptr) {
+            /* the next page is not contiguous in host memory */
+            break;
+        }
+
+        len -= l;
+        addr += l;
+        done += l;
+    }
+    *plen = done;
+    return ret;
+}
+
+/* Unmaps a memory region previously mapped by cpu_physical_memory_map().
+   Will also mark the memory as dirty if is_write == 1.  access_len gives
+   the amount of memory that was actually read or written by the caller.  */
+void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
+                               int is_write, target_phys_addr_t access_len)
+{
+    if (buffer != bounce.buffer) {
+        if (is_write) {
+            unsigned long addr1 = (uint8_t *)buffer - phys_ram_base;
+            while (access_len) {
+                unsigned l;
+                l = TARGET_PAGE_SIZE - (addr1 & ~TARGET_PAGE_MASK);
+                if (l > access_len)
+                    l = access_len;
+                if (!cpu_physical_memory_is_dirty(addr1)) {
+                    /* invalidate code */
+                    tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
+                    /* set dirty bit */
+                    phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
+                        (0xff & ~CODE_DIRTY_FLAG);
+                }
+                addr1 += l;
+                access_len -= l;
+            }
+        }
+        return;
+    }
+    if (is_write) {
+        cpu_physical_memory_rw(bounce.addr, bounce.buffer, access_len, 1);
+    }
+    qemu_vfree(bounce.buffer);
+    bounce.buffer = NULL;
+}
+
 /* used for ROM loading : can write in RAM and ROM */
 void cpu_physical_memory_write_rom(target_phys_addr_t addr,
                                    const uint8_t *buf, int len)
@@ -3017,7 +3823,9 @@ uint32_t ldl_phys(target_phys_addr_t addr)
         !(pd & IO_MEM_ROMD)) {
         /* I/O case */
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
+        qemu_global_lock();
         val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
+        qemu_global_unlock();
     } else {
         /* RAM case */
         ptr = phys_ram_base + (pd & TARGET_PAGE_MASK) +
@@ -3047,6 +3855,7 @@ uint64_t ldq_phys(target_phys_addr_t addr)
         !(pd & IO_MEM_ROMD)) {
         /* I/O case */
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
+        qemu_global_lock();
 #ifdef TARGET_WORDS_BIGENDIAN
         val = (uint64_t)io_mem_read[io_index][2](io_mem_opaque[io_index], addr) << 32;
         val |= io_mem_read[io_index][2](io_mem_opaque[io_index], addr + 4);
@@ -3054,6 +3863,7 @@ uint64_t ldq_phys(target_phys_addr_t addr)
         val = io_mem_read[io_index][2](io_mem_opaque[io_index], addr);
         val |= (uint64_t)io_mem_read[io_index][2](io_mem_opaque[io_index], addr + 4) << 32;
 #endif
+        qemu_global_unlock();
     } else {
         /* RAM case */
         ptr = phys_ram_base + (pd & TARGET_PAGE_MASK) +
@@ -3098,7 +3908,9 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
 
     if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
+        qemu_global_lock();
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
+        qemu_global_unlock();
     } else {
         unsigned long addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
         ptr = phys_ram_base + addr1;
@@ -3132,6 +3944,7 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
 
     if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
+        qemu_global_lock();
 #ifdef TARGET_WORDS_BIGENDIAN
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val >> 32);
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val);
@@ -3139,6 +3952,7 @@ void stq_phys_notdirty(target_phys_addr_t addr, uint64_t val)
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr + 4, val >> 32);
 #endif
+        qemu_global_unlock();
     } else {
         ptr = phys_ram_base + (pd & TARGET_PAGE_MASK) +
             (addr & ~TARGET_PAGE_MASK);
@@ -3163,7 +3977,9 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
 
     if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM) {
         io_index = (pd >> IO_MEM_SHIFT) & (IO_MEM_NB_ENTRIES - 1);
+        qemu_global_lock();
         io_mem_write[io_index][2](io_mem_opaque[io_index], addr, val);
+        qemu_global_unlock();
     } else {
         unsigned long addr1;
         addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
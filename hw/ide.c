@@ -486,6 +486,8 @@ typedef struct BMDMAState {
     IDEState *ide_if;
     BlockDriverCompletionFunc *dma_cb;
     BlockDriverAIOCB *aiocb;
+    /* guest memory mapped for the transfer in progress */
+    QEMUIOVector qiov;
 } BMDMAState;
 
 typedef struct PCIIDEState {
@@ -917,13 +919,95 @@ static int dma_buf_rw(BMDMAState *bm, int is_write)
     return 1;
 }
 
+/* Map the guest buffers of the next io_buffer_size bytes of the PRD
+   table into bm->qiov, so that the transfer needs no copy.  Return 0,
+   with the table position unchanged, if the buffers cannot all be
+   mapped or the table is too short; dma_buf_rw is used then.  */
+static int dma_buf_map(BMDMAState *bm, int is_write)
+{
+    IDEState *s = bm->ide_if;
+    struct {
+        uint32_t addr;
+        uint32_t size;
+    } prd;
+    uint32_t cur_addr, cur_prd_last, cur_prd_addr, cur_prd_len;
+    target_phys_addr_t plen;
+    void *mem;
+    int i, l, len;
+
+    if (!bm->qiov.nalloc)
+        qemu_iovec_init(&bm->qiov, 16);
+    cur_addr = bm->cur_addr;
+    cur_prd_last = bm->cur_prd_last;
+    cur_prd_addr = bm->cur_prd_addr;
+    cur_prd_len = bm->cur_prd_len;
+    len = s->io_buffer_size;
+    while (len > 0) {
+        if (bm->cur_prd_len == 0) {
+            /* end of table (with a fail safe of one page) */
+            if (bm->cur_prd_last ||
+                (bm->cur_addr - bm->addr) >= 4096)
+                goto fail;
+            cpu_physical_memory_read(bm->cur_addr, (uint8_t *)&prd, 8);
+            bm->cur_addr += 8;
+            prd.addr = le32_to_cpu(prd.addr);
+            prd.size = le32_to_cpu(prd.size);
+            l = prd.size & 0xfffe;
+            if (l == 0)
+                l = 0x10000;
+            bm->cur_prd_len = l;
+            bm->cur_prd_addr = prd.addr;
+            bm->cur_prd_last = (prd.size & 0x80000000);
+        }
+        l = len;
+        if (l > bm->cur_prd_len)
+            l = bm->cur_prd_len;
+        plen = l;
+        mem = cpu_physical_memory_map(bm->cur_prd_addr, &plen, is_write);
+        if (!mem)
+            goto fail;
+        qemu_iovec_add(&bm->qiov, mem, plen);
+        bm->cur_prd_addr += plen;
+        bm->cur_prd_len -= plen;
+        len -= plen;
+    }
+    return 1;
+
+ fail:
+    for (i = 0; i < bm->qiov.niov; i++)
+        cpu_physical_memory_unmap(bm->qiov.iov[i].iov_base,
+                                  bm->qiov.iov[i].iov_len, is_write, 0);
+    qemu_iovec_reset(&bm->qiov);
+    bm->cur_addr = cur_addr;
+    bm->cur_prd_last = cur_prd_last;
+    bm->cur_prd_addr = cur_prd_addr;
+    bm->cur_prd_len = cur_prd_len;
+    return 0;
+}
+
+/* return 1 if guest memory was mapped for the transfer */
+static int dma_buf_unmap(BMDMAState *bm, int is_write)
+{
+    int i;
+
+    if (!bm->qiov.niov)
+        return 0;
+    for (i = 0; i < bm->qiov.niov; i++)
+        cpu_physical_memory_unmap(bm->qiov.iov[i].iov_base,
+                                  bm->qiov.iov[i].iov_len, is_write,
+                                  bm->qiov.iov[i].iov_len);
+    qemu_iovec_reset(&bm->qiov);
+    return 1;
+}
+
 static void ide_read_dma_cb(void *opaque, int ret)
 {
     BMDMAState *bm = opaque;
     IDEState *s = bm->ide_if;
-    int n;
+    int n, mapped;
     int64_t sector_num;
 
+    mapped = dma_buf_unmap(bm, 1);
     if (ret < 0) {
 	ide_dma_error(s);
 	return;
@@ -935,7 +1019,7 @@ static void ide_read_dma_cb(void *opaque, int ret)
         sector_num += n;
         ide_set_sector(s, sector_num);
         s->nsector -= n;
-        if (dma_buf_rw(bm, 1) == 0)
+        if (!mapped && dma_buf_rw(bm, 1) == 0)
             goto eot;
     }
 
@@ -961,8 +1045,12 @@ static void ide_read_dma_cb(void *opaque, int ret)
 #ifdef DEBUG_AIO
     printf("aio_read: sector_num=%lld n=%d\n", sector_num, n);
 #endif
-    bm->aiocb = bdrv_aio_read(s->bs, sector_num, s->io_buffer, n,
-                              ide_read_dma_cb, bm);
+    if (dma_buf_map(bm, 1))
+        bm->aiocb = bdrv_aio_readv(s->bs, sector_num, &bm->qiov, n,
+                                   ide_read_dma_cb, bm);
+    else
+        bm->aiocb = bdrv_aio_read(s->bs, sector_num, s->io_buffer, n,
+                                  ide_read_dma_cb, bm);
     ide_dma_submit_check(s, ide_read_dma_cb, bm);
 }
 
@@ -1035,6 +1123,7 @@ static void ide_write_dma_cb(void *opaque, int ret)
     int n;
     int64_t sector_num;
 
+    dma_buf_unmap(bm, 0);
     if (ret < 0) {
 	ide_dma_error(s);
 	return;
@@ -1068,13 +1157,18 @@ static void ide_write_dma_cb(void *opaque, int ret)
     s->io_buffer_index = 0;
     s->io_buffer_size = n * 512;
 
-    if (dma_buf_rw(bm, 0) == 0)
-        goto eot;
 #ifdef DEBUG_AIO
     printf("aio_write: sector_num=%lld n=%d\n", sector_num, n);
 #endif
-    bm->aiocb = bdrv_aio_write(s->bs, sector_num, s->io_buffer, n,
-                               ide_write_dma_cb, bm);
+    if (dma_buf_map(bm, 0)) {
+        bm->aiocb = bdrv_aio_writev(s->bs, sector_num, &bm->qiov, n,
+                                    ide_write_dma_cb, bm);
+    } else {
+        if (dma_buf_rw(bm, 0) == 0)
+            goto eot;
+        bm->aiocb = bdrv_aio_write(s->bs, sector_num, s->io_buffer, n,
+                                   ide_write_dma_cb, bm);
+    }
     ide_dma_submit_check(s, ide_write_dma_cb, bm);
 }
 
@@ -2847,6 +2941,9 @@ static void ide_dma_start(IDEState *s, BlockDriverCompletionFunc *dma_cb)
 
 static void ide_dma_cancel(BMDMAState *bm)
 {
+    /* only disk writes leave guest memory untouched */
+    int is_write = bm->dma_cb != ide_write_dma_cb;
+
     if (bm->status & BM_STATUS_DMAING) {
         bm->status &= ~BM_STATUS_DMAING;
         /* cancel DMA request */
@@ -2859,6 +2956,8 @@ static void ide_dma_cancel(BMDMAState *bm)
             bdrv_aio_cancel(bm->aiocb);
             bm->aiocb = NULL;
         }
+        /* what the request had transferred stays in guest memory */
+        dma_buf_unmap(bm, is_write);
     }
 }
 
@@ -827,12 +827,23 @@ static void lsi_memcpy(LSIState *s, uint32_t dest, uint32_t src, int count)
 {
     int n;
     uint8_t buf[TARGET_PAGE_SIZE];
+    uint8_t *ptr;
+    target_phys_addr_t len;
 
     DPRINTF("memcpy dest 0x%08x src 0x%08x count %d\n", dest, src, count);
     while (count) {
         n = (count > TARGET_PAGE_SIZE) ? TARGET_PAGE_SIZE : count;
-        cpu_physical_memory_read(src, buf, n);
-        cpu_physical_memory_write(dest, buf, n);
+        /* Copy straight out of guest RAM where possible.  */
+        len = n;
+        ptr = cpu_physical_memory_map(src, &len, 0);
+        if (ptr) {
+            n = len;
+            cpu_physical_memory_write(dest, ptr, n);
+            cpu_physical_memory_unmap(ptr, len, 0, len);
+        } else {
+            cpu_physical_memory_read(src, buf, n);
+            cpu_physical_memory_write(dest, buf, n);
+        }
         src += n;
         dest += n;
         count -= n;
@@ -366,6 +366,51 @@ static void omap_dma_process_request(struct omap_dma_s *s, int request)
         omap_dma_interrupts_update(s);
 }
 
+#ifndef MULTI_REQ
+static inline int omap_dma_is_ram(target_phys_addr_t addr)
+{
+    return (cpu_get_physical_page_desc(addr) & ~TARGET_PAGE_MASK) ==
+            IO_MEM_RAM;
+}
+
+/* Copy at once the elements of the frame that are contiguous in guest
+   RAM on both sides, except the last one of the frame and of the
+   transfer, which are left to the element loop.  Device memory is also
+   left to it, so that it is accessed with the element width.  Return
+   the number of bytes copied.  */
+static int omap_dma_transfer_run(struct omap_dma_channel_s *ch, int bytes)
+{
+    struct omap_dma_reg_set_s *a = &ch->active_set;
+    target_phys_addr_t len, dlen;
+    uint8_t *src, *dest;
+    int n;
+
+    if (ch->constant_fill || ch->transparent_copy ||
+                    a->elem_delta[0] != ch->data_type ||
+                    a->elem_delta[1] != ch->data_type)
+        return 0;
+
+    n = MIN(a->elements - a->element, bytes / ch->data_type) - 1;
+    if (n <= 0 || !omap_dma_is_ram(a->src) || !omap_dma_is_ram(a->dest))
+        return 0;
+
+    /* both stop at the first page that is not RAM */
+    len = n * ch->data_type;
+    src = cpu_physical_memory_map(a->src, &len, 0);
+    dlen = len;
+    dest = cpu_physical_memory_map(a->dest, &dlen, 1);
+    n = dlen - dlen % ch->data_type;
+    memmove(dest, src, n);
+    cpu_physical_memory_unmap(dest, dlen, 1, n);
+    cpu_physical_memory_unmap(src, len, 0, n);
+
+    a->src += n;
+    a->dest += n;
+    a->element += n / ch->data_type;
+    return n;
+}
+#endif
+
 static void omap_dma_transfer_generic(struct soc_dma_ch_s *dma)
 {
     uint8_t value[4];
@@ -377,6 +422,10 @@ static void omap_dma_transfer_generic(struct soc_dma_ch_s *dma)
 #endif
 
     do {
+#ifndef MULTI_REQ
+        bytes -= omap_dma_transfer_run(ch, bytes);
+#endif
+
         /* Transfer a single element */
         /* FIXME: check the endianness */
         if (!ch->constant_fill)
@@ -27,7 +27,6 @@
 #include "cpu-all.h"
 
 #define VERBOSE 1
-extern CPUState *cpu_single_env;
 
 struct twl4030_i2c_s
 {
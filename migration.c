@@ -34,6 +34,11 @@ static uint32_t max_throttle = (32 << 20);
 
 static MigrationState *current_migration;
 
+/* Page encodings used by the RAM section, MIGRATE_COMPRESS_* */
+int migrate_compression;
+int64_t migrate_cache_size = (64 << 20);
+int migrate_compress_threads;
+
 void qemu_start_incoming_migration(const char *uri)
 {
     const char *p;
@@ -100,6 +105,66 @@ void do_migrate_set_speed(const char *value)
     max_throttle = (uint32_t)d;
 }
 
+void do_migrate_set_compression(const char *value)
+{
+    const char *p = value;
+    int flags = 0;
+
+    while (*p) {
+        if (strstart(p, "xbzrle", &p)) {
+            flags |= MIGRATE_COMPRESS_XBZRLE;
+        } else if (strstart(p, "zlib", &p)) {
+            flags |= MIGRATE_COMPRESS_ZLIB;
+        } else if (strstart(p, "none", &p)) {
+            flags = 0;
+        } else {
+            term_printf("invalid compression: %s\n", value);
+            return;
+        }
+        if (*p == ',')
+            p++;
+    }
+    migrate_compression = flags;
+}
+
+void do_migrate_set_compress_threads(int value)
+{
+#ifdef _WIN32
+    term_printf("compression threads not supported\n");
+#else
+    if (value < 0 || value > 64) {
+        term_printf("invalid number of threads: %d\n", value);
+        return;
+    }
+    migrate_compress_threads = value;
+#endif
+}
+
+void do_migrate_set_cache_size(const char *value)
+{
+    double d;
+    char *ptr;
+
+    d = strtod(value, &ptr);
+    switch (*ptr) {
+    case 'G': case 'g':
+        d *= 1024;
+    case 'M': case 'm':
+        d *= 1024;
+    case 'K': case 'k':
+        d *= 1024;
+    default:
+        break;
+    }
+
+    /* the cache never needs to be larger than the guest RAM */
+    if (ptr == value || d < 0 || d > ram_bytes_total()) {
+        term_printf("invalid cache size: %s\n", value);
+        return;
+    }
+    migrate_cache_size = (int64_t)d;
+}
+
 void do_info_migrate(void)
 {
     MigrationState *s = current_migration;
@@ -53,6 +53,22 @@ void do_migrate_cancel(void);
 
 void do_migrate_set_speed(const char *value);
 
+/* encode pages as a delta against a cache of previously sent ones */
+#define MIGRATE_COMPRESS_XBZRLE 0x01
+/* deflate pages that do not encode as a delta */
+#define MIGRATE_COMPRESS_ZLIB   0x02
+
+extern int migrate_compression;
+extern int64_t migrate_cache_size;
+/* threads deflating pages, 0 to deflate them inline */
+extern int migrate_compress_threads;
+
+void do_migrate_set_compression(const char *value);
+
+void do_migrate_set_cache_size(const char *value);
+
+void do_migrate_set_compress_threads(int value);
+
 void do_info_migrate(void);
 
 int exec_start_incoming_migration(const char *host_port);
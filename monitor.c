@@ -1415,6 +1415,10 @@ static const term_cmd_t term_cmds[] = {
       "tag|id", "restore a VM snapshot from its tag or id" },
     { "delvm", "s", do_delvm,
       "tag|id", "delete a VM snapshot from its tag or id" },
+#ifndef _WIN32
+    { "save_template", "F", do_save_template,
+      "filename", "save the VM as a template to start new instances from (-template)" },
+#endif
     { "stop", "", do_stop,
       "", "stop emulation", },
     { "c|cont", "", do_cont,
@@ -1475,6 +1479,12 @@ static const term_cmd_t term_cmds[] = {
       "", "cancel the current VM migration" },
     { "migrate_set_speed", "s", do_migrate_set_speed,
       "value", "set maximum speed (in bytes) for migrations" },
+    { "migrate_set_compression", "s", do_migrate_set_compression,
+      "none|xbzrle[,zlib]|zlib", "set the page encodings used by migrations and savevm" },
+    { "migrate_set_cache_size", "s", do_migrate_set_cache_size,
+      "value", "set the size (in bytes) of the xbzrle page cache" },
+    { "migrate_set_compress_threads", "i", do_migrate_set_compress_threads,
+      "n", "deflate pages on 'n' threads (0 deflates them inline)" },
     { NULL, NULL, },
 };
 
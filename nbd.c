@@ -31,6 +31,10 @@
 #include <inttypes.h>
 
 #include "qemu_socket.h"
+#include "sys-queue.h"
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 //#define DEBUG_NBD
 
@@ -268,10 +272,10 @@ int unix_socket_outgoing(const char *path)
                   Request (type == 2)
 */
 
-int nbd_negotiate(int csock, off_t size)
-{
-	char buf[8 + 8 + 8 + 128];
+#define NBD_NEGOTIATE_SIZE (8 + 8 + 8 + 128)
 
+static void nbd_negotiate_fill(uint8_t *buf, off_t size)
+{
 	/* Negotiate
 	   [ 0 ..   7]   passwd   ("NBDMAGIC")
 	   [ 8 ..  15]   magic    (0x00420281861253)
@@ -279,11 +283,18 @@ int nbd_negotiate(int csock, off_t size)
 	   [24 .. 151]   reserved (0)
 	 */
 
-	TRACE("Beginning negotiation.");
 	memcpy(buf, "NBDMAGIC", 8);
 	cpu_to_be64w((uint64_t*)(buf + 8), 0x00420281861253LL);
 	cpu_to_be64w((uint64_t*)(buf + 16), size);
 	memset(buf + 24, 0, 128);
+}
+
+int nbd_negotiate(int csock, off_t size)
+{
+	uint8_t buf[NBD_NEGOTIATE_SIZE];
+
+	TRACE("Beginning negotiation.");
+	nbd_negotiate_fill(buf, size);
 
 	if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
 		LOG("write failed");
@@ -456,43 +467,6 @@ int nbd_send_request(int csock, struct nbd_request *request)
 }
 
 
-static int nbd_receive_request(int csock, struct nbd_request *request)
-{
-	uint8_t buf[4 + 4 + 8 + 8 + 4];
-	uint32_t magic;
-
-	if (read_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-		LOG("read failed");
-		errno = EINVAL;
-		return -1;
-	}
-
-	/* Request
-	   [ 0 ..  3]   magic   (NBD_REQUEST_MAGIC)
-	   [ 4 ..  7]   type    (0 == READ, 1 == WRITE)
-	   [ 8 .. 15]   handle
-	   [16 .. 23]   from
-	   [24 .. 27]   len
-	 */
-
-	magic = be32_to_cpup((uint32_t*)buf);
-	request->type  = be32_to_cpup((uint32_t*)(buf + 4));
-	request->handle = be64_to_cpup((uint64_t*)(buf + 8));
-	request->from  = be64_to_cpup((uint64_t*)(buf + 16));
-	request->len   = be32_to_cpup((uint32_t*)(buf + 24));
-
-	TRACE("Got request: "
-	      "{ magic = 0x%x, .type = %d, from = %" PRIu64" , len = %u }",
-	      magic, request->type, request->from, request->len);
-
-	if (magic != NBD_REQUEST_MAGIC) {
-		LOG("invalid magic (got 0x%x)", magic);
-		errno = EINVAL;
-		return -1;
-	}
-	return 0;
-}
-
 int nbd_receive_reply(int csock, struct nbd_reply *reply)
 {
 	uint8_t buf[4 + 4 + 8];
@@ -528,134 +502,445 @@ int nbd_receive_reply(int csock, struct nbd_reply *reply)
 	return 0;
 }
 
-static int nbd_send_reply(int csock, struct nbd_reply *reply)
+/*
+ * Asynchronous server
+ *
+ * Each client socket is non-blocking and served from the AIO handlers of
+ * aio.c, so that one process serves many clients, with several requests
+ * of each one in flight.  Requests are read as their bytes arrive, the
+ * image is accessed with bdrv_aio_read/bdrv_aio_write, and replies are
+ * queued and sent as the socket accepts them, in completion order.  Reads
+ * of a raw image are sent from the file with sendfile() when possible.
+ */
+
+#define NBD_MAX_REQUESTS 16             /* in flight per client */
+#define NBD_MAX_LEN      (1024 * 1024)  /* largest request */
+
+typedef struct NBDRequest NBDRequest;
+typedef struct NBDClient NBDClient;
+
+struct NBDExport {
+    BlockDriverState *bs;
+    off_t dev_offset;
+    off_t size;
+    bool readonly;
+    int data_fd;                /* image file to send reads from, or -1 */
+    int nb_clients;
+};
+
+struct NBDRequest {
+    NBDClient *client;
+    struct nbd_request request;
+    uint8_t reply[4 + 4 + 8];
+    uint8_t *data;
+    size_t data_len;            /* bytes sent after the reply */
+    bool use_sendfile;
+    size_t sent;
+    TAILQ_ENTRY(NBDRequest) link;
+};
+
+struct NBDClient {
+    NBDExport *exp;
+    int sock;
+    bool closing;
+    int refcount;
+    int nb_requests;            /* received and not replied to */
+    /* request being received */
+    uint8_t buf[4 + 4 + 8 + 8 + 4];
+    size_t buf_len;
+    NBDRequest *recv_req;       /* write waiting for its data */
+    size_t recv_len;
+    TAILQ_HEAD(, NBDRequest) send_queue;
+};
+
+static void nbd_client_read(void *opaque);
+static void nbd_client_write(void *opaque);
+
+static int nbd_client_flush(void *opaque)
 {
-	uint8_t buf[4 + 4 + 8];
+    /* clients are always waited for */
+    return 1;
+}
 
-	/* Reply
-	   [ 0 ..  3]    magic   (NBD_REPLY_MAGIC)
-	   [ 4 ..  7]    error   (0 == no error)
-	   [ 7 .. 15]    handle
-	 */
-	cpu_to_be32w((uint32_t*)buf, NBD_REPLY_MAGIC);
-	cpu_to_be32w((uint32_t*)(buf + 4), reply->error);
-	cpu_to_be64w((uint64_t*)(buf + 8), reply->handle);
+static void nbd_client_update_handlers(NBDClient *client)
+{
+    IOHandler *io_read = NULL, *io_write = NULL;
+
+    if (client->closing)
+        return;
+    if (client->nb_requests < NBD_MAX_REQUESTS || client->recv_req)
+        io_read = nbd_client_read;
+    if (!TAILQ_EMPTY(&client->send_queue))
+        io_write = nbd_client_write;
+    qemu_aio_set_fd_handler(client->sock, io_read, io_write,
+                            nbd_client_flush, client);
+}
 
-	TRACE("Sending response to client");
+/* the socket, the requests and the handlers running hold references */
+static void nbd_client_put(NBDClient *client)
+{
+    if (--client->refcount == 0) {
+        client->exp->nb_clients--;
+        qemu_free(client);
+    }
+}
 
-	if (write_sync(csock, buf, sizeof(buf)) != sizeof(buf)) {
-		LOG("writing to socket failed");
-		errno = EINVAL;
-		return -1;
-	}
-	return 0;
+static void nbd_request_free(NBDRequest *req)
+{
+    NBDClient *client = req->client;
+
+    qemu_free(req->data);
+    qemu_free(req);
+    client->nb_requests--;
+    nbd_client_put(client);
 }
 
-int nbd_trip(BlockDriverState *bs, int csock, off_t size, uint64_t dev_offset,
-             off_t *offset, bool readonly, uint8_t *data, int data_size)
+static void nbd_client_close(NBDClient *client)
 {
-	struct nbd_request request;
-	struct nbd_reply reply;
+    NBDRequest *req;
+
+    if (client->closing)
+        return;
+    TRACE("Closing client %d", client->sock);
+    client->closing = true;
+    qemu_aio_set_fd_handler(client->sock, NULL, NULL, NULL, NULL);
+    closesocket(client->sock);
+    if (client->recv_req)
+        nbd_request_free(client->recv_req);
+    while ((req = TAILQ_FIRST(&client->send_queue)) != NULL) {
+        TAILQ_REMOVE(&client->send_queue, req, link);
+        nbd_request_free(req);
+    }
+    /* the requests in flight free the client when they complete */
+    nbd_client_put(client);
+}
 
-	TRACE("Reading request.");
+/* return the number of bytes transferred, 0 if the socket is not ready,
+   or -1 if the client has to be closed */
+static ssize_t nbd_client_io(NBDClient *client, void *buf, size_t size,
+                             bool do_read, int flags)
+{
+    ssize_t len;
 
-	if (nbd_receive_request(csock, &request) == -1)
-		return -1;
+    for (;;) {
+        if (do_read)
+            len = recv(client->sock, buf, size, flags);
+        else
+            len = send(client->sock, buf, size, flags);
+        if (len == -1)
+            errno = socket_error();
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (len == -1) {
+            LOG("%s failed: %s", do_read ? "recv" : "send", strerror(errno));
+            return -1;
+        }
+        if (len == 0) {
+            /* eof */
+            return -1;
+        }
+        return len;
+    }
+}
 
-	if (request.len > data_size) {
-		LOG("len (%u) is larger than max len (%u)",
-		    request.len, data_size);
-		errno = EINVAL;
-		return -1;
-	}
+/* return true if req is completely sent */
+static int nbd_request_send(NBDRequest *req)
+{
+    NBDClient *client = req->client;
+    size_t total = sizeof(req->reply) + req->data_len;
+    ssize_t len;
+    int flags;
+
+    while (req->sent < total) {
+        if (req->sent < sizeof(req->reply)) {
+            flags = 0;
+#ifdef MSG_MORE
+            if (req->data_len)
+                flags = MSG_MORE;
+#endif
+            len = nbd_client_io(client, req->reply + req->sent,
+                                sizeof(req->reply) - req->sent, false, flags);
+#ifdef __linux__
+        } else if (req->use_sendfile) {
+            off_t offset = req->request.from + client->exp->dev_offset +
+                           req->sent - sizeof(req->reply);
+            len = sendfile(client->sock, client->exp->data_fd, &offset,
+                           total - req->sent);
+            if (len == -1 && errno == EINTR)
+                continue;
+            if (len == -1 && errno == EAGAIN)
+                return 0;
+            if (len <= 0) {
+                LOG("sendfile failed");
+                return -1;
+            }
+#endif
+        } else {
+            len = nbd_client_io(client,
+                                req->data + req->sent - sizeof(req->reply),
+                                total - req->sent, false, 0);
+        }
+        if (len <= 0)
+            return len;
+        req->sent += len;
+    }
+    return 1;
+}
 
-	if ((request.from + request.len) < request.from) {
-		LOG("integer overflow detected! "
-		    "you're probably being attacked");
-		errno = EINVAL;
-		return -1;
-	}
+static void nbd_client_write(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDRequest *req;
+    int ret;
+
+    client->refcount++;
+    while ((req = TAILQ_FIRST(&client->send_queue)) != NULL) {
+        ret = nbd_request_send(req);
+        if (ret < 0) {
+            nbd_client_close(client);
+            break;
+        }
+        if (ret == 0)
+            break;
+        TAILQ_REMOVE(&client->send_queue, req, link);
+        nbd_request_free(req);
+    }
+    nbd_client_update_handlers(client);
+    nbd_client_put(client);
+}
 
-	if ((request.from + request.len) > size) {
-	        LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
-		    ", Offset: %" PRIu64 "\n",
-		     request.from, request.len, size, dev_offset);
-		LOG("requested operation past EOF--bad client?");
-		errno = EINVAL;
-		return -1;
-	}
+static void nbd_request_reply(NBDRequest *req, uint32_t error)
+{
+    NBDClient *client = req->client;
 
-	TRACE("Decoding type");
-
-	reply.handle = request.handle;
-	reply.error = 0;
-
-	switch (request.type) {
-	case NBD_CMD_READ:
-		TRACE("Request type is READ");
-
-		if (bdrv_read(bs, (request.from + dev_offset) / 512, data,
-			      request.len / 512) == -1) {
-			LOG("reading from file failed");
-			errno = EINVAL;
-			return -1;
-		}
-		*offset += request.len;
-
-		TRACE("Read %u byte(s)", request.len);
-
-		if (nbd_send_reply(csock, &reply) == -1)
-			return -1;
-
-		TRACE("Sending data to client");
-
-		if (write_sync(csock, data, request.len) != request.len) {
-			LOG("writing to socket failed");
-			errno = EINVAL;
-			return -1;
-		}
-		break;
-	case NBD_CMD_WRITE:
-		TRACE("Request type is WRITE");
-
-		TRACE("Reading %u byte(s)", request.len);
-
-		if (read_sync(csock, data, request.len) != request.len) {
-			LOG("reading from socket failed");
-			errno = EINVAL;
-			return -1;
-		}
-
-		if (readonly) {
-			TRACE("Server is read-only, return error");
-			reply.error = 1;
-		} else {
-			TRACE("Writing to device");
-
-			if (bdrv_write(bs, (request.from + dev_offset) / 512,
-				       data, request.len / 512) == -1) {
-				LOG("writing to file failed");
-				errno = EINVAL;
-				return -1;
-			}
-
-			*offset += request.len;
-		}
-
-		if (nbd_send_reply(csock, &reply) == -1)
-			return -1;
-		break;
-	case NBD_CMD_DISC:
-		TRACE("Request type is DISCONNECT");
-		errno = 0;
-		return 1;
-	default:
-		LOG("invalid request type (%u) received", request.type);
-		errno = EINVAL;
-		return -1;
-	}
+    if (client->closing) {
+        nbd_request_free(req);
+        return;
+    }
 
-	TRACE("Request/Reply complete");
+    cpu_to_be32w((uint32_t*)req->reply, NBD_REPLY_MAGIC);
+    cpu_to_be32w((uint32_t*)(req->reply + 4), error);
+    cpu_to_be64w((uint64_t*)(req->reply + 8), req->request.handle);
+    if (error) {
+        req->data_len = 0;
+        req->use_sendfile = false;
+    }
+    req->sent = 0;
 
-	return 0;
+    TRACE("Queueing reply for handle %" PRIu64, req->request.handle);
+    TAILQ_INSERT_TAIL(&client->send_queue, req, link);
+    /* the socket is usually ready */
+    nbd_client_write(client);
+}
+
+static void nbd_request_cb(void *opaque, int ret)
+{
+    NBDRequest *req = opaque;
+
+    if (ret < 0)
+        LOG("%s failed", req->request.type == NBD_CMD_READ ? "read" : "write");
+    nbd_request_reply(req, ret < 0 ? EIO : 0);
+}
+
+static void nbd_request_submit(NBDRequest *req)
+{
+    NBDExport *exp = req->client->exp;
+    int64_t sector_num = (req->request.from + exp->dev_offset) / 512;
+    int nb_sectors = req->request.len / 512;
+    BlockDriverAIOCB *acb;
+
+    if (req->request.type == NBD_CMD_READ) {
+        req->data_len = req->request.len;
+        if (exp->data_fd != -1) {
+            req->use_sendfile = true;
+            nbd_request_reply(req, 0);
+            return;
+        }
+        acb = bdrv_aio_read(exp->bs, sector_num, req->data, nb_sectors,
+                            nbd_request_cb, req);
+    } else {
+        if (exp->readonly) {
+            TRACE("Server is read-only, return error");
+            nbd_request_reply(req, 1);
+            return;
+        }
+        acb = bdrv_aio_write(exp->bs, sector_num, req->data, nb_sectors,
+                             nbd_request_cb, req);
+    }
+    if (acb == NULL)
+        nbd_request_reply(req, EIO);
+}
+
+/* decode the request in client->buf; return -1 if the client has to be
+   closed */
+static int nbd_request_start(NBDClient *client)
+{
+    NBDExport *exp = client->exp;
+    NBDRequest *req;
+    uint32_t magic;
+
+    req = qemu_mallocz(sizeof(NBDRequest));
+    req->client = client;
+    magic = be32_to_cpup((uint32_t*)client->buf);
+    req->request.type = be32_to_cpup((uint32_t*)(client->buf + 4));
+    req->request.handle = be64_to_cpup((uint64_t*)(client->buf + 8));
+    req->request.from = be64_to_cpup((uint64_t*)(client->buf + 16));
+    req->request.len = be32_to_cpup((uint32_t*)(client->buf + 24));
+    client->nb_requests++;
+    client->refcount++;
+
+    TRACE("Got request: "
+          "{ magic = 0x%x, .type = %d, from = %" PRIu64" , len = %u }",
+          magic, req->request.type, req->request.from, req->request.len);
+
+    if (magic != NBD_REQUEST_MAGIC) {
+        LOG("invalid magic (got 0x%x)", magic);
+        goto fail;
+    }
+    if (req->request.type == NBD_CMD_DISC) {
+        TRACE("Request type is DISCONNECT");
+        goto fail;
+    }
+    if (req->request.type != NBD_CMD_READ &&
+        req->request.type != NBD_CMD_WRITE) {
+        LOG("invalid request type (%u) received", req->request.type);
+        goto fail;
+    }
+    if (req->request.len > NBD_MAX_LEN) {
+        LOG("len (%u) is larger than max len (%u)",
+            req->request.len, NBD_MAX_LEN);
+        goto fail;
+    }
+    if ((req->request.from + req->request.len) < req->request.from) {
+        LOG("integer overflow detected! "
+            "you're probably being attacked");
+        goto fail;
+    }
+    if ((req->request.from + req->request.len) > exp->size) {
+        LOG("From: %" PRIu64 ", Len: %u, Size: %" PRIu64
+            ", Offset: %" PRIu64 "\n",
+            req->request.from, req->request.len, (uint64_t)exp->size,
+            (uint64_t)exp->dev_offset);
+        LOG("requested operation past EOF--bad client?");
+        goto fail;
+    }
+
+    if (req->request.type == NBD_CMD_WRITE || exp->data_fd == -1)
+        req->data = qemu_memalign(512, req->request.len);
+    if (req->request.type == NBD_CMD_WRITE && req->request.len) {
+        /* submitted when the data is received */
+        client->recv_req = req;
+        client->recv_len = 0;
+        return 0;
+    }
+    nbd_request_submit(req);
+    return 0;
+
+ fail:
+    nbd_request_free(req);
+    return -1;
+}
+
+static void nbd_client_read(void *opaque)
+{
+    NBDClient *client = opaque;
+    NBDRequest *req;
+    ssize_t len;
+
+    client->refcount++;
+    while (!client->closing) {
+        req = client->recv_req;
+        if (req) {
+            len = nbd_client_io(client, req->data + client->recv_len,
+                                req->request.len - client->recv_len, true, 0);
+            if (len < 0)
+                goto fail;
+            client->recv_len += len;
+            if (client->recv_len < req->request.len)
+                break;
+            client->recv_req = NULL;
+            nbd_request_submit(req);
+        } else {
+            if (client->nb_requests >= NBD_MAX_REQUESTS)
+                break;
+            len = nbd_client_io(client, client->buf + client->buf_len,
+                                sizeof(client->buf) - client->buf_len,
+                                true, 0);
+            if (len < 0)
+                goto fail;
+            client->buf_len += len;
+            if (client->buf_len < sizeof(client->buf))
+                break;
+            client->buf_len = 0;
+            if (nbd_request_start(client) < 0)
+                goto fail;
+        }
+    }
+    nbd_client_update_handlers(client);
+    nbd_client_put(client);
+    return;
+
+ fail:
+    nbd_client_close(client);
+    nbd_client_put(client);
+}
+
+NBDExport *nbd_export_new(BlockDriverState *bs, off_t dev_offset, off_t size,
+                          bool readonly, int data_fd)
+{
+    NBDExport *exp;
+
+    exp = qemu_mallocz(sizeof(NBDExport));
+    exp->bs = bs;
+    exp->dev_offset = dev_offset;
+    exp->size = size;
+    exp->readonly = readonly;
+#ifdef __linux__
+    exp->data_fd = data_fd;
+#else
+    exp->data_fd = -1;
+#endif
+    return exp;
+}
+
+void nbd_export_close(NBDExport *exp)
+{
+    qemu_free(exp);
+}
+
+int nbd_export_nb_clients(NBDExport *exp)
+{
+    return exp->nb_clients;
+}
+
+void nbd_export_add_client(NBDExport *exp, int csock)
+{
+    NBDClient *client;
+    NBDRequest *req;
+
+    client = qemu_mallocz(sizeof(NBDClient));
+    client->exp = exp;
+    client->sock = csock;
+    client->refcount = 1;
+    TAILQ_INIT(&client->send_queue);
+    socket_set_nonblock(csock);
+    exp->nb_clients++;
+
+    /* the handshake goes first in the send queue, as the data of a
+       reply whose header is already sent */
+    TRACE("Queueing negotiation for client %d", csock);
+    req = qemu_mallocz(sizeof(NBDRequest));
+    req->client = client;
+    req->data = qemu_malloc(NBD_NEGOTIATE_SIZE);
+    nbd_negotiate_fill(req->data, exp->size);
+    req->data_len = NBD_NEGOTIATE_SIZE;
+    req->sent = sizeof(req->reply);
+    client->nb_requests++;
+    client->refcount++;
+    TAILQ_INSERT_TAIL(&client->send_queue, req, link);
+
+    /* on failure, this closes the socket */
+    nbd_client_write(client);
 }
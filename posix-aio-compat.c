@@ -0,0 +1,332 @@
+/*
+ * QEMU posix-aio emulation with a pool of worker threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include "qemu-common.h"
+#include "posix-aio-compat.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* requests that are adjacent on disk are done in one system call, as
+   long as the combined vector has at most PAIO_MAX_IOV segments */
+#define PAIO_MAX_MERGE 32
+#define PAIO_MAX_IOV   1024
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static pthread_attr_t attr;
+static int max_threads = 64;
+static int cur_threads = 0;
+static int idle_threads = 0;
+static int idle_time = 10;
+static int notify_fd = -1;
+static int notify_signo;
+static volatile int *notify_busy;
+static pthread_t notify_thread;
+static TAILQ_HEAD(, qemu_paiocb) request_list;
+
+static void die2(int err, const char *what)
+{
+    fprintf(stderr, "%s failed: %s\n", what, strerror(err));
+    abort();
+}
+
+static void mutex_lock(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_lock(mutex);
+    if (ret) die2(ret, "pthread_mutex_lock");
+}
+
+static void mutex_unlock(pthread_mutex_t *mutex)
+{
+    int ret = pthread_mutex_unlock(mutex);
+    if (ret) die2(ret, "pthread_mutex_unlock");
+}
+
+static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                          struct timespec *ts)
+{
+    int ret = pthread_cond_timedwait(cond, mutex, ts);
+    if (ret && ret != ETIMEDOUT) die2(ret, "pthread_cond_timedwait");
+    return ret;
+}
+
+static void cond_signal(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_signal(cond);
+    if (ret) die2(ret, "pthread_cond_signal");
+}
+
+/* take the first queued request and the ones that continue it on disk */
+static int paio_take_batch(struct qemu_paiocb **batch, int *pniov)
+{
+    struct qemu_paiocb *aiocb, *next;
+    off_t end;
+    int nb, niov;
+
+    aiocb = TAILQ_FIRST(&request_list);
+    TAILQ_REMOVE(&request_list, aiocb, node);
+    aiocb->active = 1;
+    batch[0] = aiocb;
+    nb = 1;
+    niov = aiocb->aio_niov;
+    if (aiocb->aio_type == QEMU_PAIO_FSYNC)
+        goto out;
+
+    end = aiocb->aio_offset + aiocb->aio_nbytes;
+    while (nb < PAIO_MAX_MERGE) {
+        TAILQ_FOREACH(next, &request_list, node) {
+            if (next->aio_fildes == aiocb->aio_fildes &&
+                next->aio_type == aiocb->aio_type &&
+                next->aio_offset == end &&
+                niov + next->aio_niov <= PAIO_MAX_IOV)
+                break;
+        }
+        if (!next)
+            break;
+        TAILQ_REMOVE(&request_list, next, node);
+        next->active = 1;
+        batch[nb++] = next;
+        niov += next->aio_niov;
+        end += next->aio_nbytes;
+    }
+ out:
+    *pniov = niov;
+    return nb;
+}
+
+/* transfer nbytes at offset; return the number of bytes done, which is
+   less than nbytes only at the end of the file, or -errno.  iov is
+   modified. */
+static ssize_t paio_rw(int fd, int type, struct iovec *iov, int niov,
+                       off_t offset, size_t nbytes)
+{
+    size_t done = 0;
+    ssize_t len;
+
+    while (done < nbytes && niov > 0) {
+#ifdef CONFIG_PREADV
+        if (type == QEMU_PAIO_READ)
+            len = preadv(fd, iov, niov < IOV_MAX ? niov : IOV_MAX,
+                         offset + done);
+        else
+            len = pwritev(fd, iov, niov < IOV_MAX ? niov : IOV_MAX,
+                          offset + done);
+#else
+        if (type == QEMU_PAIO_READ)
+            len = pread(fd, iov->iov_base, iov->iov_len, offset + done);
+        else
+            len = pwrite(fd, iov->iov_base, iov->iov_len, offset + done);
+#endif
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1)
+            return -errno;
+        if (len == 0)
+            break;
+        done += len;
+        /* skip what was transferred */
+        while (niov > 0 && len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (len > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+    return done;
+}
+
+static ssize_t paio_do_batch(struct qemu_paiocb **batch, int nb, int niov)
+{
+    struct qemu_paiocb *aiocb = batch[0];
+    struct iovec iov_buf[PAIO_MAX_IOV], *iov;
+    size_t nbytes;
+    ssize_t ret;
+    int i, n;
+
+    if (aiocb->aio_type == QEMU_PAIO_FSYNC) {
+        ret = fsync(aiocb->aio_fildes);
+        return ret == -1 ? -errno : 0;
+    }
+
+    iov = iov_buf;
+    if (niov > PAIO_MAX_IOV) {
+        /* only a single request can be that large */
+        iov = malloc(niov * sizeof(struct iovec));
+        if (!iov)
+            return -ENOMEM;
+    }
+    nbytes = 0;
+    n = 0;
+    for (i = 0; i < nb; i++) {
+        memcpy(iov + n, batch[i]->aio_iov,
+               batch[i]->aio_niov * sizeof(struct iovec));
+        n += batch[i]->aio_niov;
+        nbytes += batch[i]->aio_nbytes;
+    }
+    ret = paio_rw(aiocb->aio_fildes, aiocb->aio_type, iov, niov,
+                  aiocb->aio_offset, nbytes);
+    if (iov != iov_buf)
+        free(iov);
+    return ret;
+}
+
+static void *aio_thread(void *unused)
+{
+    struct qemu_paiocb *batch[PAIO_MAX_MERGE];
+    struct timespec ts;
+    ssize_t ret, len;
+    char byte = 0;
+    int i, nb, niov;
+
+    for (;;) {
+        mutex_lock(&lock);
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += idle_time;
+        ret = 0;
+        while (TAILQ_EMPTY(&request_list) && ret != ETIMEDOUT)
+            ret = cond_timedwait(&cond, &lock, &ts);
+        if (TAILQ_EMPTY(&request_list))
+            break;
+        nb = paio_take_batch(batch, &niov);
+        idle_threads--;
+        mutex_unlock(&lock);
+
+        ret = paio_do_batch(batch, nb, niov);
+
+        mutex_lock(&lock);
+        for (i = 0; i < nb; i++) {
+            if (ret < 0) {
+                batch[i]->ret = ret;
+            } else {
+                len = ret;
+                if (len > batch[i]->aio_nbytes)
+                    len = batch[i]->aio_nbytes;
+                batch[i]->ret = len;
+                ret -= len;
+            }
+        }
+        idle_threads++;
+        mutex_unlock(&lock);
+
+        /* wake up the main loop; if the pipe is full, it will look
+           at this request anyway */
+        while (write(notify_fd, &byte, sizeof(byte)) == -1 &&
+               errno == EINTR);
+        /* and interrupt it if it is running guest code */
+        if (notify_signo && *notify_busy)
+            pthread_kill(notify_thread, notify_signo);
+    }
+
+    idle_threads--;
+    cur_threads--;
+    mutex_unlock(&lock);
+
+    return NULL;
+}
+
+static void spawn_thread(void)
+{
+    pthread_t thread_id;
+    sigset_t set, oldset;
+    int ret;
+
+    cur_threads++;
+    idle_threads++;
+
+    /* the workers must not take the signals meant for the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    ret = pthread_create(&thread_id, &attr, aio_thread, NULL);
+    if (ret) die2(ret, "pthread_create");
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+int qemu_paio_init(struct qemu_paioinit *aioinit)
+{
+    int ret;
+
+    ret = pthread_attr_init(&attr);
+    if (ret) die2(ret, "pthread_attr_init");
+
+    ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (ret) die2(ret, "pthread_attr_setdetachstate");
+
+    TAILQ_INIT(&request_list);
+
+    if (aioinit->aio_threads > 0)
+        max_threads = aioinit->aio_threads;
+    if (aioinit->aio_idle_time > 0)
+        idle_time = aioinit->aio_idle_time;
+    notify_fd = aioinit->aio_notify_fd;
+    notify_signo = aioinit->aio_notify_signo;
+    notify_busy = aioinit->aio_notify_busy;
+    notify_thread = pthread_self();
+
+    return 0;
+}
+
+int qemu_paio_submit(struct qemu_paiocb *aiocb)
+{
+    aiocb->ret = -EINPROGRESS;
+    aiocb->active = 0;
+    mutex_lock(&lock);
+    if (idle_threads == 0 && cur_threads < max_threads)
+        spawn_thread();
+    TAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    mutex_unlock(&lock);
+    cond_signal(&cond);
+
+    return 0;
+}
+
+ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
+{
+    ssize_t ret;
+
+    mutex_lock(&lock);
+    ret = aiocb->ret;
+    mutex_unlock(&lock);
+
+    return ret;
+}
+
+int qemu_paio_error(struct qemu_paiocb *aiocb)
+{
+    ssize_t ret = qemu_paio_return(aiocb);
+
+    if (ret < 0)
+        ret = -ret;
+    else
+        ret = 0;
+
+    return ret;
+}
+
+int qemu_paio_cancel(int fd, struct qemu_paiocb *aiocb)
+{
+    int ret;
+
+    mutex_lock(&lock);
+    if (!aiocb->active && aiocb->ret == -EINPROGRESS) {
+        TAILQ_REMOVE(&request_list, aiocb, node);
+        aiocb->ret = -ECANCELED;
+        ret = QEMU_PAIO_CANCELED;
+    } else if (aiocb->ret == -EINPROGRESS)
+        ret = QEMU_PAIO_NOTCANCELED;
+    else
+        ret = QEMU_PAIO_ALLDONE;
+    mutex_unlock(&lock);
+
+    return ret;
+}
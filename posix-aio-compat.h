@@ -0,0 +1,54 @@
+/*
+ * QEMU posix-aio emulation with a pool of worker threads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_POSIX_AIO_COMPAT_H
+#define QEMU_POSIX_AIO_COMPAT_H
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "sys-queue.h"
+
+#define QEMU_PAIO_CANCELED     0x01
+#define QEMU_PAIO_NOTCANCELED  0x02
+#define QEMU_PAIO_ALLDONE      0x03
+
+#define QEMU_PAIO_READ         0x01
+#define QEMU_PAIO_WRITE        0x02
+#define QEMU_PAIO_FSYNC        0x03
+
+struct qemu_paiocb
+{
+    int aio_fildes;
+    int aio_type;
+    struct iovec *aio_iov;
+    int aio_niov;
+    size_t aio_nbytes;
+    off_t aio_offset;
+
+    /* private */
+    TAILQ_ENTRY(qemu_paiocb) node;
+    int active;
+    ssize_t ret;
+};
+
+struct qemu_paioinit
+{
+    unsigned int aio_threads;
+    unsigned int aio_idle_time;   /* seconds */
+    int aio_notify_fd;
+    int aio_notify_signo;         /* sent to the thread calling init */
+    volatile int *aio_notify_busy; /* ... only while this is nonzero */
+};
+
+int qemu_paio_init(struct qemu_paioinit *aioinit);
+int qemu_paio_submit(struct qemu_paiocb *aiocb);
+int qemu_paio_error(struct qemu_paiocb *aiocb);
+ssize_t qemu_paio_return(struct qemu_paiocb *aiocb);
+int qemu_paio_cancel(int fd, struct qemu_paiocb *aiocb);
+
+#endif
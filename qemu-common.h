@@ -49,6 +49,13 @@ static inline char *realpath(const char *path, char *resolved_path)
 #define PRIx64 "I64x"
 #define PRIu64 "I64u"
 #define PRIo64 "I64o"
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
 #endif
 
 /* FIXME: Remove NEED_CPU_H.  */
@@ -108,6 +115,25 @@ time_t mktimegm(struct tm *tm);
 #define qemu_isxdigit(c)	isxdigit((unsigned char)(c))
 #define qemu_tolower(c)		tolower((unsigned char)(c))
 #define qemu_toupper(c)		toupper((unsigned char)(c))
+
+/* scatter/gather I/O */
+typedef struct QEMUIOVector {
+    struct iovec *iov;
+    int niov;
+    int nalloc;
+    size_t size;
+} QEMUIOVector;
+
+void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint);
+void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov, int niov);
+void qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len);
+void qemu_iovec_copy(QEMUIOVector *dst, QEMUIOVector *src, size_t skip,
+                     size_t size);
+void qemu_iovec_destroy(QEMUIOVector *qiov);
+void qemu_iovec_reset(QEMUIOVector *qiov);
+void qemu_iovec_to_buffer(QEMUIOVector *qiov, void *buf);
+void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count);
+void qemu_iovec_memset(QEMUIOVector *qiov, int c, size_t count);
 #define qemu_isascii(c)		isascii((unsigned char)(c))
 #define qemu_toascii(c)		toascii((unsigned char)(c))
 
@@ -168,4 +194,7 @@ int cpu_load(QEMUFile *f, void *opaque, int version_id);
 /* Force QEMU to stop what it's doing and service IO */
 void qemu_service_io(void);
 
+/* nonzero while the main loop is inside cpu_exec() */
+extern volatile int qemu_in_cpu_exec;
+
 #endif
@@ -28,8 +28,14 @@
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <signal.h>
 #endif
 
+/* exit status of error() and help(); compare uses 1 for "images differ" */
+static int error_status = 1;
+
 static void __attribute__((noreturn)) error(const char *fmt, ...)
 {
     va_list ap;
@@ -37,7 +43,7 @@ static void __attribute__((noreturn)) error(const char *fmt, ...)
     fprintf(stderr, "qemu-img: ");
     vfprintf(stderr, fmt, ap);
     fprintf(stderr, "\n");
-    exit(1);
+    exit(error_status);
     va_end(ap);
 }
 
@@ -53,10 +59,12 @@ static void help(void)
            "QEMU disk image utility\n"
            "\n"
            "Command syntax:\n"
-           "  create [-e] [-6] [-b base_image] [-f fmt] filename [size]\n"
+           "  create [-e] [-6] [-p] [-b base_image] [-f fmt] filename [size]\n"
            "  commit [-f fmt] filename\n"
-           "  convert [-c] [-e] [-6] [-f fmt] [-O output_fmt] [-B output_base_image] filename [filename2 [...]] output_filename\n"
+           "  convert [-c] [-e] [-6] [-f fmt] [-O output_fmt] [-B output_base_image] [-s buf_size] [-m requests] filename [filename2 [...]] output_filename\n"
            "  info [-f fmt] filename\n"
+           "  compare [-f fmt] [-F fmt2] [-s] filename filename2\n"
+           "  map [-f fmt] filename\n"
            "\n"
            "Command parameters:\n"
            "  'filename' is a disk image filename\n"
@@ -67,6 +75,7 @@ static void help(void)
            "    content as the input's base image, however the path, image format, etc may\n"
            "    differ\n"
            "  'fmt' is the disk image format. It is guessed automatically in most cases\n"
+           "  'fmt2' is the disk image format of 'filename2' for compare\n"
            "  'size' is the disk image size in kilobytes. Optional suffixes 'M' (megabyte)\n"
            "    and 'G' (gigabyte) are supported\n"
            "  'output_filename' is the destination disk image filename\n"
@@ -74,11 +83,18 @@ static void help(void)
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
            "  '-e' indicates that the target image must be encrypted (qcow format only)\n"
            "  '-6' indicates that the target image must use compatibility level 6 (vmdk format only)\n"
+           "  '-p' indicates that the L2 tables and clusters of the target image must be\n"
+           "       allocated in advance (qcow2 format only)\n"
+           "  'buf_size' is the size of the buffer of each request of convert, in kilobytes\n"
+           "    unless a 'M' suffix is given (default 1M)\n"
+           "  'requests' is the number of requests convert keeps in flight (default 8)\n"
+           "  '-s' with compare indicates that images of different sizes differ, even if\n"
+           "       the end of the larger one reads as zeros\n"
            );
     printf("\nSupported format:");
     bdrv_iterate_format(format_print, NULL);
     printf("\n");
-    exit(1);
+    exit(error_status);
 }
 
 #if defined(WIN32)
@@ -211,7 +227,7 @@ static int img_create(int argc, char **argv)
 
     flags = 0;
     for(;;) {
-        c = getopt(argc, argv, "b:f:he6");
+        c = getopt(argc, argv, "b:f:he6p");
         if (c == -1)
             break;
         switch(c) {
@@ -230,6 +246,9 @@ static int img_create(int argc, char **argv)
         case '6':
             flags |= BLOCK_FLAG_COMPAT6;
             break;
+        case 'p':
+            flags |= BLOCK_FLAG_PREALLOC;
+            break;
         }
     }
     if (optind >= argc)
@@ -260,12 +279,16 @@ static int img_create(int argc, char **argv)
     drv = bdrv_find_format(fmt);
     if (!drv)
         error("Unknown file format '%s'", fmt);
+    if (flags & BLOCK_FLAG_PREALLOC && drv != &bdrv_qcow2)
+        error("Preallocation not supported for this file format");
     printf("Formatting '%s', fmt=%s",
            filename, fmt);
     if (flags & BLOCK_FLAG_ENCRYPT)
         printf(", encrypted");
     if (flags & BLOCK_FLAG_COMPAT6)
         printf(", compatibility level=6");
+    if (flags & BLOCK_FLAG_PREALLOC)
+        printf(", preallocated");
     if (base_filename) {
         printf(", backing_file=%s",
                base_filename);
@@ -343,12 +366,19 @@ static int img_commit(int argc, char **argv)
     return 0;
 }
 
+/* Scan whole words; the first one usually decides for data sectors. */
 static int is_not_zero(const uint8_t *sector, int len)
 {
+    const unsigned long *p = (const unsigned long *)sector;
     int i;
-    len >>= 2;
-    for(i = 0;i < len; i++) {
-        if (((uint32_t *)sector)[i] != 0)
+
+    len /= sizeof(unsigned long);
+    for(i = 0; i + 4 <= len; i += 4) {
+        if (p[i] | p[i + 1] | p[i + 2] | p[i + 3])
+            return 1;
+    }
+    for(; i < len; i++) {
+        if (p[i] != 0)
             return 1;
     }
     return 0;
@@ -379,26 +409,393 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
     return v;
 }
 
-#define IO_BUF_SIZE 65536
+/*
+ * convert keeps several requests in flight: each one reads a buffer from
+ * the input with AIO and then writes its non-zero runs to the output, so
+ * that reads and writes of different requests overlap.  When compressing,
+ * the clusters are read in order and deflated on worker threads, and the
+ * main thread writes them in order as they become ready.
+ */
+
+#define CONVERT_BUF_SIZE  (1024 * 1024)
+#define CONVERT_DEPTH     8
+#define CONVERT_MAX_DEPTH 64
+
+typedef struct ConvertState ConvertState;
+
+typedef struct ConvertReq {
+    ConvertState *s;
+    uint8_t *buf;
+    int busy;
+    int64_t sector_num;         /* in the output image */
+    int nb_sectors;
+    int done;                   /* sectors of buf written so far */
+    int cur;                    /* sectors of the write in flight */
+    /* compression */
+    uint8_t *cbuf;
+    int clen;
+    int zero;
+    int ready;
+    struct ConvertReq *next_job;
+} ConvertReq;
+
+struct ConvertState {
+    BlockDriverState **bs;
+    uint64_t *bs_sectors;
+    int bs_n;
+    BlockDriverState *out_bs;
+    int copy_zeros;
+    int cluster_sectors;        /* of the output image, 0 if unknown */
+    int depth;
+    int nb_busy;
+    ConvertReq reqs[CONVERT_MAX_DEPTH];
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;
+    pthread_cond_t ready_cond;
+    ConvertReq *jobs, **jobs_tail;
+    int quit;
+#endif
+};
+
+/* find the input image and offset of an output sector; return the number
+   of sectors left in that input image */
+static int64_t convert_find_input(ConvertState *s, int64_t sector_num,
+                                  int *pbs_i, int64_t *pbs_num)
+{
+    int bs_i;
+
+    for (bs_i = 0; sector_num >= s->bs_sectors[bs_i]; bs_i++) {
+        sector_num -= s->bs_sectors[bs_i];
+        assert(bs_i + 1 < s->bs_n);
+    }
+    *pbs_i = bs_i;
+    *pbs_num = sector_num;
+    return s->bs_sectors[bs_i] - sector_num;
+}
+
+static void convert_read(ConvertState *s, int64_t sector_num,
+                         uint8_t *buf, int n)
+{
+    int64_t bs_num, left;
+    int bs_i, nlow;
+
+    while (n > 0) {
+        left = convert_find_input(s, sector_num, &bs_i, &bs_num);
+        nlow = n > left ? left : n;
+        if (bdrv_read(s->bs[bs_i], bs_num, buf, nlow) < 0)
+            error("error while reading");
+        sector_num += nlow;
+        buf += nlow * 512;
+        n -= nlow;
+    }
+}
+
+static void convert_write_next(ConvertReq *req);
+
+static void convert_write_cb(void *opaque, int ret)
+{
+    ConvertReq *req = opaque;
+
+    if (ret < 0)
+        error("error while writing");
+    req->done += req->cur;
+    convert_write_next(req);
+}
+
+/* write the next non-zero run of the buffer, or finish the request */
+static void convert_write_next(ConvertReq *req)
+{
+    ConvertState *s = req->s;
+    uint8_t *buf;
+    int n, n1;
+
+    while (req->done < req->nb_sectors) {
+        buf = req->buf + req->done * 512;
+        n = req->nb_sectors - req->done;
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image. */
+        if (s->copy_zeros) {
+            n1 = n;
+        } else if (!is_allocated_sectors(buf, n, &n1)) {
+            req->done += n1;
+            continue;
+        }
+        req->cur = n1;
+        if (!bdrv_aio_write(s->out_bs, req->sector_num + req->done, buf, n1,
+                            convert_write_cb, req))
+            error("error while writing");
+        return;
+    }
+    req->busy = 0;
+    s->nb_busy--;
+}
+
+static void convert_read_cb(void *opaque, int ret)
+{
+    ConvertReq *req = opaque;
+
+    if (ret < 0)
+        error("error while reading");
+    req->done = 0;
+    convert_write_next(req);
+}
+
+/* requests that write to the same output cluster must not run at the same
+   time, or both could allocate it */
+static int convert_overlaps(ConvertState *s, int64_t sector_num, int n)
+{
+    ConvertReq *req;
+    int64_t first, last;
+    int i;
+
+    if (!s->cluster_sectors)
+        return 0;
+    first = sector_num / s->cluster_sectors;
+    last = (sector_num + n - 1) / s->cluster_sectors;
+    for (i = 0; i < s->depth; i++) {
+        req = &s->reqs[i];
+        if (req->busy &&
+            req->sector_num / s->cluster_sectors <= last &&
+            (req->sector_num + req->nb_sectors - 1) / s->cluster_sectors >= first)
+            return 1;
+    }
+    return 0;
+}
+
+static void convert_copy(ConvertState *s, int64_t total_sectors,
+                         int buf_sectors)
+{
+    ConvertReq *req;
+    int64_t sector_num, bs_num, left, end;
+    int bs_i, i, n, n1;
+
+    sector_num = 0; // total number of sectors converted so far
+    while (sector_num < total_sectors || s->nb_busy > 0) {
+        req = NULL;
+        if (sector_num < total_sectors) {
+            for (i = 0; i < s->depth; i++) {
+                if (!s->reqs[i].busy) {
+                    req = &s->reqs[i];
+                    break;
+                }
+            }
+        }
+        if (!req) {
+            qemu_aio_wait();
+            continue;
+        }
+
+        left = convert_find_input(s, sector_num, &bs_i, &bs_num);
+        n = buf_sectors;
+        if (n > left)
+            n = left;
+
+        /* If the output image is being created as a copy on write image,
+           assume that sectors which are unallocated in the input image
+           are present in both the output's and input's base images (no
+           need to copy them). */
+        if (s->copy_zeros) {
+            if (!bdrv_is_allocated(s->bs[bs_i], bs_num, n, &n1)) {
+                sector_num += n1;
+                continue;
+            }
+            /* The next 'n1' sectors are allocated in the input image. Copy
+               only those as they may be followed by unallocated sectors. */
+            n = n1;
+        }
+
+        /* end on a cluster boundary when possible */
+        if (s->cluster_sectors) {
+            end = (sector_num + n) / s->cluster_sectors * s->cluster_sectors;
+            if (end > sector_num)
+                n = end - sector_num;
+        }
+        if (convert_overlaps(s, sector_num, n)) {
+            qemu_aio_wait();
+            continue;
+        }
+
+        req->busy = 1;
+        s->nb_busy++;
+        req->sector_num = sector_num;
+        req->nb_sectors = n;
+        sector_num += n;
+        if (!bdrv_aio_read(s->bs[bs_i], bs_num, req->buf, n,
+                           convert_read_cb, req))
+            error("error while reading");
+    }
+}
+
+#ifndef _WIN32
+static void *convert_compress_thread(void *opaque)
+{
+    ConvertState *s = opaque;
+    ConvertReq *req;
+    int cluster_size = s->cluster_sectors * 512;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        while (!s->jobs && !s->quit)
+            pthread_cond_wait(&s->job_cond, &s->lock);
+        req = s->jobs;
+        if (!req) {
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+        s->jobs = req->next_job;
+        if (!s->jobs)
+            s->jobs_tail = &s->jobs;
+        pthread_mutex_unlock(&s->lock);
+
+        req->clen = bdrv_compress_cluster(req->cbuf, req->buf, cluster_size);
+
+        pthread_mutex_lock(&s->lock);
+        req->ready = 1;
+        pthread_cond_broadcast(&s->ready_cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    return NULL;
+}
+#endif
+
+static void convert_compress_start(ConvertState *s, ConvertReq *req)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&s->lock);
+    req->ready = 0;
+    req->next_job = NULL;
+    *s->jobs_tail = req;
+    s->jobs_tail = &req->next_job;
+    pthread_cond_signal(&s->job_cond);
+    pthread_mutex_unlock(&s->lock);
+#else
+    req->clen = bdrv_compress_cluster(req->cbuf, req->buf,
+                                      s->cluster_sectors * 512);
+    req->ready = 1;
+#endif
+}
+
+static void convert_compress_wait(ConvertState *s, ConvertReq *req)
+{
+#ifndef _WIN32
+    pthread_mutex_lock(&s->lock);
+    while (!req->ready)
+        pthread_cond_wait(&s->ready_cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+#endif
+}
+
+static void convert_compress(ConvertState *s, int64_t total_sectors)
+{
+    ConvertReq *req;
+    int64_t sector_num;
+    int cluster_sectors = s->cluster_sectors;
+    int cluster_size = cluster_sectors * 512;
+    int i, n, head, count, nb_threads;
+#ifndef _WIN32
+    pthread_t *threads;
+    sigset_t set, oldset;
+
+    nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_threads < 1)
+        nb_threads = 1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->job_cond, NULL);
+    pthread_cond_init(&s->ready_cond, NULL);
+    s->jobs = NULL;
+    s->jobs_tail = &s->jobs;
+    s->quit = 0;
+    threads = qemu_malloc(nb_threads * sizeof(pthread_t));
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 0; i < nb_threads; i++) {
+        if (pthread_create(&threads[i], NULL, convert_compress_thread, s))
+            error("could not create thread");
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+#else
+    nb_threads = 1;
+#endif
+
+    /* keep every thread busy while the oldest cluster is written */
+    if (s->depth < 2 * nb_threads)
+        s->depth = MIN(2 * nb_threads, CONVERT_MAX_DEPTH);
+    for (i = 0; i < s->depth; i++) {
+        s->reqs[i].buf = qemu_malloc(cluster_size);
+        s->reqs[i].cbuf = qemu_malloc(cluster_size);
+    }
+
+    sector_num = 0;
+    head = 0;
+    count = 0;
+    while (sector_num < total_sectors || count > 0) {
+        if (sector_num < total_sectors && count < s->depth) {
+            req = &s->reqs[(head + count) % s->depth];
+            count++;
+            n = MIN(cluster_sectors, total_sectors - sector_num);
+            convert_read(s, sector_num, req->buf, n);
+            if (n < cluster_sectors)
+                memset(req->buf + n * 512, 0, cluster_size - n * 512);
+            req->sector_num = sector_num;
+            sector_num += n;
+            req->zero = !is_not_zero(req->buf, cluster_size);
+            if (!req->zero)
+                convert_compress_start(s, req);
+            continue;
+        }
+
+        req = &s->reqs[head];
+        if (!req->zero) {
+            convert_compress_wait(s, req);
+            if (bdrv_write_precompressed(s->out_bs, req->sector_num, req->buf,
+                                         cluster_sectors, req->cbuf,
+                                         req->clen) != 0)
+                error("error while compressing sector %" PRId64,
+                      req->sector_num);
+        }
+        head = (head + 1) % s->depth;
+        count--;
+    }
+    /* signal EOF to align */
+    bdrv_write_compressed(s->out_bs, 0, NULL, 0);
+
+#ifndef _WIN32
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_broadcast(&s->job_cond);
+    pthread_mutex_unlock(&s->lock);
+    for (i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+    qemu_free(threads);
+#endif
+    for (i = 0; i < s->depth; i++) {
+        qemu_free(s->reqs[i].buf);
+        qemu_free(s->reqs[i].cbuf);
+    }
+}
 
 static int img_convert(int argc, char **argv)
 {
-    int c, ret, n, n1, bs_n, bs_i, flags, cluster_size, cluster_sectors;
+    int c, ret, bs_n, bs_i, flags, buf_size, i;
     const char *fmt, *out_fmt, *out_baseimg, *out_filename;
     BlockDriver *drv;
-    BlockDriverState **bs, *out_bs;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t buf[IO_BUF_SIZE];
-    const uint8_t *buf1;
+    BlockDriverState *out_bs;
+    int64_t total_sectors;
     BlockDriverInfo bdi;
+    ConvertState s1, *s = &s1;
+    char *p;
 
     fmt = NULL;
     out_fmt = "raw";
     out_baseimg = NULL;
     flags = 0;
+    buf_size = CONVERT_BUF_SIZE;
+    memset(s, 0, sizeof(*s));
+    s->depth = CONVERT_DEPTH;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:hce6");
+        c = getopt(argc, argv, "f:O:B:hce6s:m:");
         if (c == -1)
             break;
         switch(c) {
@@ -423,6 +820,24 @@ static int img_convert(int argc, char **argv)
         case '6':
             flags |= BLOCK_FLAG_COMPAT6;
             break;
+        case 's':
+            buf_size = strtoul(optarg, &p, 0);
+            if (*p == 'M')
+                buf_size *= 1024 * 1024;
+            else if (*p == 'k' || *p == 'K' || *p == '\0')
+                buf_size *= 1024;
+            else
+                help();
+            if (buf_size < 512 || buf_size > 64 * 1024 * 1024)
+                error("Invalid buffer size");
+            buf_size &= ~511;
+            break;
+        case 'm':
+            s->depth = strtoul(optarg, NULL, 0);
+            if (s->depth < 1 || s->depth > CONVERT_MAX_DEPTH)
+                error("The number of requests must be between 1 and %d",
+                      CONVERT_MAX_DEPTH);
+            break;
         }
     }
 
@@ -434,17 +849,19 @@ static int img_convert(int argc, char **argv)
     if (bs_n > 1 && out_baseimg)
         error("-B makes no sense when concatenating multiple input images");
         
-    bs = calloc(bs_n, sizeof(BlockDriverState *));
-    if (!bs)
+    s->bs = calloc(bs_n, sizeof(BlockDriverState *));
+    s->bs_sectors = calloc(bs_n, sizeof(uint64_t));
+    if (!s->bs || !s->bs_sectors)
         error("Out of memory");
+    s->bs_n = bs_n;
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
-        bs[bs_i] = bdrv_new_open(argv[optind + bs_i], fmt);
-        if (!bs[bs_i])
+        s->bs[bs_i] = bdrv_new_open(argv[optind + bs_i], fmt);
+        if (!s->bs[bs_i])
             error("Could not open '%s'", argv[optind + bs_i]);
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(s->bs[bs_i], &s->bs_sectors[bs_i]);
+        total_sectors += s->bs_sectors[bs_i];
     }
 
     drv = bdrv_find_format(out_fmt);
@@ -469,136 +886,29 @@ static int img_convert(int argc, char **argv)
     }
 
     out_bs = bdrv_new_open(out_filename, out_fmt);
-
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
+    s->out_bs = out_bs;
+    s->copy_zeros = out_baseimg != NULL;
+    if (bdrv_get_info(out_bs, &bdi) >= 0 && bdi.cluster_size > 0)
+        s->cluster_sectors = bdi.cluster_size >> 9;
 
     if (flags & BLOCK_FLAG_COMPRESS) {
-        if (bdrv_get_info(out_bs, &bdi) < 0)
-            error("could not get block driver info");
-        cluster_size = bdi.cluster_size;
-        if (cluster_size <= 0 || cluster_size > IO_BUF_SIZE)
+        if (s->cluster_sectors <= 0)
             error("invalid cluster size");
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%lld, "
-                       "bs_i=%d, bs_offset=%lld, bs_sectors=%lld\n",
-                       sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                if (bdrv_read(bs[bs_i], bs_num, buf2, nlow) < 0) 
-                    error("error while reading");
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (n < cluster_sectors)
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            if (is_not_zero(buf, cluster_size)) {
-                if (bdrv_write_compressed(out_bs, sector_num, buf,
-                                          cluster_sectors) != 0)
-                    error("error while compressing sector %" PRId64,
-                          sector_num);
-            }
-            sector_num += n;
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
+        convert_compress(s, total_sectors);
     } else {
-        sector_num = 0; // total number of sectors converted so far
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= (IO_BUF_SIZE / 512))
-                n = (IO_BUF_SIZE / 512);
-            else
-                n = nb_sectors;
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%lld, bs_i=%d, "
-                  "bs_offset=%lld, bs_sectors=%lld\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num)
-                n = bs_offset + bs_sectors - sector_num;
-
-            /* If the output image is being created as a copy on write image,
-               assume that sectors which are unallocated in the input image
-               are present in both the output's and input's base images (no
-               need to copy them). */
-            if (out_baseimg) {
-               if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset, n, &n1)) {
-                  sector_num += n1;
-                  continue;
-               }
-               /* The next 'n1' sectors are allocated in the input image. Copy
-                  only those as they may be followed by unallocated sectors. */
-               n = n1;
-            }
-
-            if (bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n) < 0) 
-                error("error while reading");
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image. */
-                if (out_baseimg || is_allocated_sectors(buf1, n, &n1)) {
-                    if (bdrv_write(out_bs, sector_num, buf1, n1) < 0)
-                        error("error while writing");
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
+        for (i = 0; i < s->depth; i++) {
+            s->reqs[i].s = s;
+            s->reqs[i].buf = qemu_memalign(512, buf_size);
         }
+        convert_copy(s, total_sectors, buf_size >> 9);
+        for (i = 0; i < s->depth; i++)
+            qemu_vfree(s->reqs[i].buf);
     }
     bdrv_delete(out_bs);
     for (bs_i = 0; bs_i < bs_n; bs_i++)
-        bdrv_delete(bs[bs_i]);
-    free(bs);
+        bdrv_delete(s->bs[bs_i]);
+    free(s->bs);
+    free(s->bs_sectors);
     return 0;
 }
 
@@ -729,9 +1039,264 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+/*
+ * compare and map look at the allocation of the images first, and only
+ * read the sectors whose content cannot be told from it.
+ */
+
+#define IMG_MAP_SECTORS     (1 << 21)   /* per allocation query */
+#define COMPARE_BUF_SECTORS 2048
+
+/* find the image of the backing chain of bs from which the sectors at
+   sector_num are read, or NULL if none has them allocated and they read
+   as zeros.  Return the number of sectors, up to nb_sectors, read from
+   the same image. */
+static int get_allocated_image(BlockDriverState *bs, int64_t sector_num,
+                               int nb_sectors, BlockDriverState **pbs)
+{
+    uint64_t total_sectors;
+    int n;
+
+    while (bs != NULL) {
+        bdrv_get_geometry(bs, &total_sectors);
+        if (sector_num >= total_sectors)
+            break;
+        if (nb_sectors > total_sectors - sector_num)
+            nb_sectors = total_sectors - sector_num;
+        if (bdrv_is_allocated(bs, sector_num, nb_sectors, &n)) {
+            *pbs = bs;
+            return n;
+        }
+        if (n > 0)
+            nb_sectors = n;
+        bs = bs->backing_hd;
+    }
+    *pbs = NULL;
+    return nb_sectors;
+}
+
+/* return true if bs1 and bs2 are the same image file */
+static int is_same_image(BlockDriverState *bs1, BlockDriverState *bs2)
+{
+#ifdef _WIN32
+    return !strcmp(bs1->filename, bs2->filename);
+#else
+    struct stat st1, st2;
+
+    if (stat(bs1->filename, &st1) < 0 || stat(bs2->filename, &st2) < 0)
+        return 0;
+    return st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+#endif
+}
+
+/* return the index of the first non-zero sector of buf, or n */
+static int find_nonzero_sector(const uint8_t *buf, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (is_not_zero(buf + i * 512, 512))
+            break;
+    }
+    return i;
+}
+
+/* return the index of the first sector that differs in buf1 and buf2,
+   or n */
+static int find_different_sector(const uint8_t *buf1, const uint8_t *buf2,
+                                 int n)
+{
+    int i;
+
+    if (!memcmp(buf1, buf2, n * 512))
+        return n;
+    for (i = 0; i < n; i++) {
+        if (memcmp(buf1 + i * 512, buf2 + i * 512, 512))
+            break;
+    }
+    return i;
+}
+
+/* check that the sectors of bs from sector_num to total_sectors read as
+   zeros; return the first one that does not, or -1 */
+static int64_t compare_zero(BlockDriverState *bs, int64_t sector_num,
+                            int64_t total_sectors, uint8_t *buf)
+{
+    BlockDriverState *src;
+    int n, i;
+
+    for (; sector_num < total_sectors; sector_num += n) {
+        n = MIN(total_sectors - sector_num, IMG_MAP_SECTORS);
+        n = get_allocated_image(bs, sector_num, n, &src);
+        if (!src)
+            continue;
+        n = MIN(n, COMPARE_BUF_SECTORS);
+        if (bdrv_read(bs, sector_num, buf, n) < 0)
+            error("error while reading");
+        i = find_nonzero_sector(buf, n);
+        if (i < n)
+            return sector_num + i;
+    }
+    return -1;
+}
+
+static int img_compare(int argc, char **argv)
+{
+    int c, strict, n, n1, i;
+    const char *filename1, *filename2, *fmt1, *fmt2;
+    BlockDriverState *bs1, *bs2, *src1, *src2;
+    uint64_t total_sectors1, total_sectors2;
+    int64_t total_sectors, sector_num, diff;
+    uint8_t *buf1, *buf2;
+
+    error_status = 2;
+    fmt1 = NULL;
+    fmt2 = NULL;
+    strict = 0;
+    for(;;) {
+        c = getopt(argc, argv, "f:F:hs");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt1 = optarg;
+            break;
+        case 'F':
+            fmt2 = optarg;
+            break;
+        case 's':
+            strict = 1;
+            break;
+        }
+    }
+    if (optind + 2 != argc)
+        help();
+    filename1 = argv[optind++];
+    filename2 = argv[optind++];
+
+    bs1 = bdrv_new_open(filename1, fmt1);
+    bs2 = bdrv_new_open(filename2, fmt2);
+    bdrv_get_geometry(bs1, &total_sectors1);
+    bdrv_get_geometry(bs2, &total_sectors2);
+    buf1 = qemu_malloc(COMPARE_BUF_SECTORS * 512);
+    buf2 = qemu_malloc(COMPARE_BUF_SECTORS * 512);
+
+    diff = -1;
+    total_sectors = MIN(total_sectors1, total_sectors2);
+    for (sector_num = 0; sector_num < total_sectors; sector_num += n) {
+        n = MIN(total_sectors - sector_num, IMG_MAP_SECTORS);
+        n1 = get_allocated_image(bs1, sector_num, n, &src1);
+        n = get_allocated_image(bs2, sector_num, n1, &src2);
+        /* zeros on both sides, or the same data of a common base image */
+        if (!src1 && !src2)
+            continue;
+        if (src1 && src2 && is_same_image(src1, src2))
+            continue;
+
+        n = MIN(n, COMPARE_BUF_SECTORS);
+        if (src1 && bdrv_read(bs1, sector_num, buf1, n) < 0)
+            error("error while reading '%s'", filename1);
+        if (src2 && bdrv_read(bs2, sector_num, buf2, n) < 0)
+            error("error while reading '%s'", filename2);
+        if (!src1)
+            i = find_nonzero_sector(buf2, n);
+        else if (!src2)
+            i = find_nonzero_sector(buf1, n);
+        else
+            i = find_different_sector(buf1, buf2, n);
+        if (i < n) {
+            diff = sector_num + i;
+            break;
+        }
+    }
+
+    /* the end of the larger image must read as zeros */
+    if (diff < 0 && total_sectors1 != total_sectors2) {
+        printf("Warning: image size mismatch\n");
+        if (strict)
+            diff = total_sectors;
+        else if (total_sectors1 > total_sectors)
+            diff = compare_zero(bs1, total_sectors, total_sectors1, buf1);
+        else
+            diff = compare_zero(bs2, total_sectors, total_sectors2, buf2);
+    }
+
+    if (diff < 0)
+        printf("Images are identical.\n");
+    else
+        printf("Content mismatch at offset %" PRId64 "\n", diff * 512);
+
+    qemu_free(buf1);
+    qemu_free(buf2);
+    bdrv_delete(bs1);
+    bdrv_delete(bs2);
+    return diff < 0 ? 0 : 1;
+}
+
+static void dump_map_entry(int64_t sector_num, int64_t nb_sectors,
+                           BlockDriverState *bs)
+{
+    printf("%#-16" PRIx64 " %#-16" PRIx64 " %s\n",
+           sector_num * 512, nb_sectors * 512, bs->filename);
+}
+
+static int img_map(int argc, char **argv)
+{
+    int c, n;
+    const char *filename, *fmt;
+    BlockDriverState *bs, *src, *cur;
+    uint64_t total_sectors;
+    int64_t sector_num, start;
+
+    fmt = NULL;
+    for(;;) {
+        c = getopt(argc, argv, "f:h");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        }
+    }
+    if (optind >= argc)
+        help();
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt);
+    bdrv_get_geometry(bs, &total_sectors);
+
+    printf("%-16s %-16s %s\n", "Offset", "Length", "File");
+    /* merge the extents read from the same image */
+    cur = NULL;
+    start = 0;
+    for (sector_num = 0; sector_num < total_sectors; sector_num += n) {
+        n = MIN(total_sectors - sector_num, IMG_MAP_SECTORS);
+        n = get_allocated_image(bs, sector_num, n, &src);
+        if (src == cur)
+            continue;
+        if (cur)
+            dump_map_entry(start, sector_num - start, cur);
+        cur = src;
+        start = sector_num;
+    }
+    if (cur)
+        dump_map_entry(start, sector_num - start, cur);
+
+    bdrv_delete(bs);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     const char *cmd;
+    int ret = 0;
 
     bdrv_init();
     if (argc < 2)
@@ -746,8 +1311,12 @@ int main(int argc, char **argv)
         img_convert(argc, argv);
     } else if (!strcmp(cmd, "info")) {
         img_info(argc, argv);
+    } else if (!strcmp(cmd, "compare")) {
+        ret = img_compare(argc, argv);
+    } else if (!strcmp(cmd, "map")) {
+        img_map(argc, argv);
     } else {
         help();
     }
-    return 0;
+    return ret;
 }
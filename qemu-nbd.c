@@ -34,9 +34,10 @@
 
 #define SOCKET_PATH    "/var/lock/qemu-nbd-%s"
 
-#define NBD_BUFFER_SIZE (1024*1024)
-
 static int verbose;
+static int shared = 1;
+static int server_fd;
+static NBDExport *export;
 
 static void usage(const char *name)
 {
@@ -175,17 +176,31 @@ static void show_parts(const char *device)
     }
 }
 
+static int nbd_can_accept(void *opaque)
+{
+    return nbd_export_nb_clients(export) < shared;
+}
+
+static void nbd_accept(void *opaque)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd;
+
+    fd = accept(server_fd, (struct sockaddr *)&addr, &addr_len);
+    if (fd == -1)
+        return;
+    nbd_export_add_client(export, fd);
+}
+
 int main(int argc, char **argv)
 {
     BlockDriverState *bs;
     off_t dev_offset = 0;
-    off_t offset = 0;
     bool readonly = false;
     bool disconnect = false;
     const char *bindto = "0.0.0.0";
     int port = 1024;
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
     off_t fd_size;
     char *device = NULL;
     char *socket = NULL;
@@ -216,14 +231,9 @@ int main(int argc, char **argv)
     int flags = 0;
     int partition = -1;
     int ret;
-    int shared = 1;
-    uint8_t *data;
-    fd_set fds;
-    int *sharing_fds;
     int fd;
-    int i;
-    int nb_fds = 0;
-    int max_fd;
+    int data_fd;
+    char fmt_name[32];
     int persistent = 0;
 
     while ((ch = getopt_long(argc, argv, sopt, lopt, &opt_ind)) != -1) {
@@ -408,69 +418,35 @@ int main(int argc, char **argv)
         /* children */
     }
 
-    sharing_fds = qemu_malloc((shared + 1) * sizeof(int));
-    if (sharing_fds == NULL)
-        errx(ENOMEM, "Cannot allocate sharing fds");
-
-    if (socket) {
-        sharing_fds[0] = unix_socket_incoming(socket);
-    } else {
-        sharing_fds[0] = tcp_socket_incoming(bindto, port);
-    }
-
-    if (sharing_fds[0] == -1)
+    server_fd = socket ? unix_socket_incoming(socket) :
+                         tcp_socket_incoming(bindto, port);
+    if (server_fd == -1)
         return 1;
-    max_fd = sharing_fds[0];
-    nb_fds++;
 
-    data = qemu_memalign(512, NBD_BUFFER_SIZE);
-    if (data == NULL)
-        errx(ENOMEM, "Cannot allocate data buffer");
+    /* reads of a raw image are sent from the file, unless the host cache
+       is to be bypassed */
+    data_fd = -1;
+    bdrv_get_format(bs, fmt_name, sizeof(fmt_name));
+    if (!strcmp(fmt_name, "raw") && !(flags & BDRV_O_NOCACHE))
+        data_fd = open(bs->filename, O_RDONLY | O_BINARY);
 
-    do {
-
-        FD_ZERO(&fds);
-        for (i = 0; i < nb_fds; i++)
-            FD_SET(sharing_fds[i], &fds);
-
-        ret = select(max_fd + 1, &fds, NULL, NULL, NULL);
-        if (ret == -1)
-            break;
+    export = nbd_export_new(bs, dev_offset, fd_size, readonly, data_fd);
 
-        if (FD_ISSET(sharing_fds[0], &fds))
-            ret--;
-        for (i = 1; i < nb_fds && ret; i++) {
-            if (FD_ISSET(sharing_fds[i], &fds)) {
-                if (nbd_trip(bs, sharing_fds[i], fd_size, dev_offset,
-                    &offset, readonly, data, NBD_BUFFER_SIZE) != 0) {
-                    close(sharing_fds[i]);
-                    nb_fds--;
-                    sharing_fds[i] = sharing_fds[nb_fds];
-                    i--;
-                }
-                ret--;
-            }
-        }
-        /* new connection ? */
-        if (FD_ISSET(sharing_fds[0], &fds)) {
-            if (nb_fds < shared + 1) {
-                sharing_fds[nb_fds] = accept(sharing_fds[0],
-                                             (struct sockaddr *)&addr,
-                                             &addr_len);
-                if (sharing_fds[nb_fds] != -1 &&
-                    nbd_negotiate(sharing_fds[nb_fds], fd_size) != -1) {
-                        if (sharing_fds[nb_fds] > max_fd)
-                            max_fd = sharing_fds[nb_fds];
-                        nb_fds++;
-                }
-            }
-        }
-    } while (persistent || nb_fds > 1);
-    qemu_free(data);
+    /* a client that goes away must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
 
-    close(sharing_fds[0]);
+    qemu_aio_set_fd_handler(server_fd, nbd_accept, NULL, nbd_can_accept,
+                            NULL);
+    do {
+        qemu_aio_wait();
+    } while (persistent || nbd_export_nb_clients(export) > 0);
+
+    qemu_aio_set_fd_handler(server_fd, NULL, NULL, NULL, NULL);
+    close(server_fd);
+    nbd_export_close(export);
+    if (data_fd != -1)
+        close(data_fd);
     bdrv_close(bs);
-    qemu_free(sharing_fds);
     if (socket)
         unlink(socket);
 
@@ -26,6 +26,8 @@ struct QEMUBH
     void *opaque;
 };
 
+volatile int qemu_in_cpu_exec;
+
 void qemu_service_io(void)
 {
 }
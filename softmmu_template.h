@@ -65,6 +65,9 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr,
     }
 
     env->mem_io_vaddr = addr;
+    /* device state is protected by the global lock */
+    if (index > (IO_MEM_NOTDIRTY >> IO_MEM_SHIFT))
+        qemu_global_lock();
 #if SHIFT <= 2
     res = io_mem_read[index][SHIFT](io_mem_opaque[index], physaddr);
 #else
@@ -76,6 +79,8 @@ static inline DATA_TYPE glue(io_read, SUFFIX)(target_phys_addr_t physaddr,
     res |= (uint64_t)io_mem_read[index][2](io_mem_opaque[index], physaddr + 4) << 32;
 #endif
 #endif /* SHIFT > 2 */
+    if (index > (IO_MEM_NOTDIRTY >> IO_MEM_SHIFT))
+        qemu_global_unlock();
 #ifdef USE_KQEMU
     env->last_io_time = cpu_get_time_fast();
 #endif
@@ -210,6 +215,8 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr,
 
     env->mem_io_vaddr = addr;
     env->mem_io_pc = (unsigned long)retaddr;
+    if (index > (IO_MEM_NOTDIRTY >> IO_MEM_SHIFT))
+        qemu_global_lock();
 #if SHIFT <= 2
     io_mem_write[index][SHIFT](io_mem_opaque[index], physaddr, val);
 #else
@@ -221,6 +228,8 @@ static inline void glue(io_write, SUFFIX)(target_phys_addr_t physaddr,
     io_mem_write[index][2](io_mem_opaque[index], physaddr + 4, val >> 32);
 #endif
 #endif /* SHIFT > 2 */
+    if (index > (IO_MEM_NOTDIRTY >> IO_MEM_SHIFT))
+        qemu_global_unlock();
 #ifdef USE_KQEMU
     env->last_io_time = cpu_get_time_fast();
 #endif
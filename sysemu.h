@@ -47,8 +47,10 @@ void do_savevm(const char *name);
 void do_loadvm(const char *name);
 void do_delvm(const char *name);
 void do_info_snapshots(void);
+void do_save_template(const char *filename);
 
 void qemu_announce_self(void);
+uint64_t ram_bytes_total(void);
 
 void main_loop_wait(int timeout);
 
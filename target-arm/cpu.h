@@ -177,6 +177,18 @@ typedef struct CPUARMState {
 #else
     uint32_t mmon_addr;
 #endif
+    /* value read by the last load exclusive */
+    uint32_t mmon_val[2];
+
+#if !defined(CONFIG_USER_ONLY)
+    /* Nonzero for TLB entries filled from not-global (ASID specific)
+       translations.  Only these are dropped when the ASID changes.  */
+    uint8_t tlb_ng[NB_MMU_MODES][CPU_TLB_SIZE];
+    /* Region covering every TLB entry filled from a page or section
+       larger than 4k.  tlb_large_addr is -1 when there are none.  */
+    uint32_t tlb_large_addr;
+    uint32_t tlb_large_mask;
+#endif
 
     /* iwMMXt coprocessor state.  */
     struct {
@@ -437,4 +449,14 @@ static inline void cpu_get_tb_cpu_state(CPUState *env, target_ulong *pc,
         *flags |= (1 << 7);
 }
 
+/* Set up 'env' to translate the block at 'pc' reached by a direct
+   branch from a block translated with 'flags'.  */
+static inline void cpu_set_tb_succ_state(CPUState *env, target_ulong pc,
+                                         int flags)
+{
+    env->regs[15] = pc;
+    env->thumb = flags & 1;
+    env->condexec_bits = 0;
+}
+
 #endif
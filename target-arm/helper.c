@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
+#include <math.h>
 
 #include "cpu.h"
 #include "exec-all.h"
@@ -170,6 +172,7 @@ void cpu_reset(CPUARMState *env)
         env->uncached_cpsr &= ~CPSR_I;
     env->vfp.xregs[ARM_VFP_FPEXC] = 0;
     env->cp15.c2_base_mask = 0xffffc000u;
+    env->tlb_large_addr = -1;
 #endif
     env->regs[15] = 0;
     tlb_flush(env, 1);
@@ -928,7 +931,8 @@ static uint32_t get_level1_table_address(CPUState *env, uint32_t address)
 }
 
 static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
-			    int is_user, uint32_t *phys_ptr, int *prot)
+			    int is_user, uint32_t *phys_ptr, int *prot,
+                            uint32_t *page_size, int *ng)
 {
     int code;
     uint32_t table;
@@ -961,6 +965,7 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
         phys_addr = (desc & 0xfff00000) | (address & 0x000fffff);
         ap = (desc >> 10) & 3;
         code = 13;
+        *page_size = 1024 * 1024;
     } else {
         /* Lookup l2 entry.  */
 	if (type == 1) {
@@ -978,15 +983,18 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
         case 1: /* 64k page.  */
             phys_addr = (desc & 0xffff0000) | (address & 0xffff);
             ap = (desc >> (4 + ((address >> 13) & 6))) & 3;
+            *page_size = 0x10000;
             break;
         case 2: /* 4k page.  */
             phys_addr = (desc & 0xfffff000) | (address & 0xfff);
             ap = (desc >> (4 + ((address >> 13) & 6))) & 3;
+            *page_size = 0x1000;
             break;
         case 3: /* 1k page.  */
 	    if (type == 1) {
 		if (arm_feature(env, ARM_FEATURE_XSCALE)) {
 		    phys_addr = (desc & 0xfffff000) | (address & 0xfff);
+		    *page_size = 0x1000;
 		} else {
 		    /* Page translation fault.  */
 		    code = 7;
@@ -994,6 +1002,7 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
 		}
 	    } else {
 		phys_addr = (desc & 0xfffffc00) | (address & 0x3ff);
+		*page_size = 0x400;
 	    }
             ap = (desc >> 4) & 3;
             break;
@@ -1009,13 +1018,15 @@ static int get_phys_addr_v5(CPUState *env, uint32_t address, int access_type,
         goto do_fault;
     }
     *phys_ptr = phys_addr;
+    *ng = 0;
     return 0;
 do_fault:
     return code | (domain << 4);
 }
 
 static int get_phys_addr_v6(CPUState *env, uint32_t address, int access_type,
-			    int is_user, uint32_t *phys_ptr, int *prot)
+			    int is_user, uint32_t *phys_ptr, int *prot,
+                            uint32_t *page_size, int *ng)
 {
     int code;
     uint32_t table;
@@ -1055,12 +1066,15 @@ static int get_phys_addr_v6(CPUState *env, uint32_t address, int access_type,
         if (desc & (1 << 18)) {
             /* Supersection.  */
             phys_addr = (desc & 0xff000000) | (address & 0x00ffffff);
+            *page_size = 0x1000000;
         } else {
             /* Section.  */
             phys_addr = (desc & 0xfff00000) | (address & 0x000fffff);
+            *page_size = 0x100000;
         }
         ap = ((desc >> 10) & 3) | ((desc >> 13) & 4);
         xn = desc & (1 << 4);
+        *ng = (desc >> 17) & 1;
         code = 13;
     } else {
         /* Lookup l2 entry.  */
@@ -1074,15 +1088,18 @@ static int get_phys_addr_v6(CPUState *env, uint32_t address, int access_type,
         case 1: /* 64k page.  */
             phys_addr = (desc & 0xffff0000) | (address & 0xffff);
             xn = desc & (1 << 15);
+            *page_size = 0x10000;
             break;
         case 2: case 3: /* 4k page.  */
             phys_addr = (desc & 0xfffff000) | (address & 0xfff);
             xn = desc & 1;
+            *page_size = 0x1000;
             break;
         default:
             /* Never happens, but compiler isn't smart enough to tell.  */
             abort();
         }
+        *ng = (desc >> 11) & 1;
         code = 15;
     }
     if (xn && access_type == 2)
@@ -1101,13 +1118,16 @@ do_fault:
 }
 
 static int get_phys_addr_mpu(CPUState *env, uint32_t address, int access_type,
-			     int is_user, uint32_t *phys_ptr, int *prot)
+			     int is_user, uint32_t *phys_ptr, int *prot,
+                             uint32_t *page_size, int *ng)
 {
     int n;
     uint32_t mask;
     uint32_t base;
 
     *phys_ptr = address;
+    *page_size = TARGET_PAGE_SIZE;
+    *ng = 0;
     for (n = 7; n >= 0; n--) {
 	base = env->cp15.c6_region[n];
 	if ((base & 1) == 0)
@@ -1159,9 +1179,13 @@ static int get_phys_addr_mpu(CPUState *env, uint32_t address, int access_type,
     return 0;
 }
 
+/* Translate a virtual address.  On success *page_size is set to the size
+   of the mapping the address belongs to and *ng to nonzero if that
+   mapping is specific to the current ASID.  */
 static inline int get_phys_addr(CPUState *env, uint32_t address,
                                 int access_type, int is_user,
-                                uint32_t *phys_ptr, int *prot)
+                                uint32_t *phys_ptr, int *prot,
+                                uint32_t *page_size, int *ng)
 {
     /* Fast Context Switch Extension.  */
     if (address < 0x02000000)
@@ -1171,33 +1195,87 @@ static inline int get_phys_addr(CPUState *env, uint32_t address,
         /* MMU/MPU disabled.  */
         *phys_ptr = address;
         *prot = PAGE_READ | PAGE_WRITE;
+        *page_size = TARGET_PAGE_SIZE;
+        *ng = 0;
         //printf("MMU Disabled. *phys_ptr %x\n",*phys_ptr);
         return 0;
     } else if (arm_feature(env, ARM_FEATURE_MPU)) {
 	return get_phys_addr_mpu(env, address, access_type, is_user, phys_ptr,
-				 prot);
+				 prot, page_size, ng);
     } else if (env->cp15.c1_sys & (1 << 23)) {
         return get_phys_addr_v6(env, address, access_type, is_user, phys_ptr,
-                                prot);
+                                prot, page_size, ng);
     } else {
         return get_phys_addr_v5(env, address, access_type, is_user, phys_ptr,
-                                prot);
+                                prot, page_size, ng);
     }
 }
 
+/* Record that the TLB holds an entry from a mapping larger than 4k at
+   'vaddr', growing the tracked region as needed.  */
+static void arm_tlb_add_large_page(CPUState *env, uint32_t vaddr,
+                                   uint32_t size)
+{
+    uint32_t mask = ~(size - 1);
+
+    if (env->tlb_large_addr == (uint32_t)-1) {
+        env->tlb_large_addr = vaddr & mask;
+        env->tlb_large_mask = mask;
+        return;
+    }
+    /* Extend the existing region to include the new page.  */
+    mask &= env->tlb_large_mask;
+    while (((env->tlb_large_addr ^ vaddr) & mask) != 0)
+        mask <<= 1;
+    env->tlb_large_addr &= mask;
+    env->tlb_large_mask = mask;
+}
+
+/* Flush the whole TLB, forgetting about any large pages.  */
+static void arm_tlb_flush(CPUState *env, int flush_global)
+{
+    env->tlb_large_addr = -1;
+    env->tlb_large_mask = 0;
+    tlb_flush(env, flush_global);
+}
+
+/* Invalidate the 4k page containing the modified virtual address 'mva'.
+   Entries are only 1k, so each of the subpages is flushed.  Entries
+   filled from larger mappings may cover 'mva' at other indices, in which
+   case the whole TLB goes.  */
+static void arm_tlb_flush_mva(CPUState *env, uint32_t mva)
+{
+    int i;
+
+    if (env->cp15.c13_fcse != 0
+        || (mva & env->tlb_large_mask) == env->tlb_large_addr) {
+        arm_tlb_flush(env, 1);
+        return;
+    }
+    mva &= 0xfffff000;
+    for (i = 0; i < 0x1000; i += TARGET_PAGE_SIZE)
+        tlb_flush_page(env, mva + i);
+}
+
 int cpu_arm_handle_mmu_fault (CPUState *env, target_ulong address,
                               int access_type, int mmu_idx, int is_softmmu)
 {
     uint32_t phys_addr;
+    uint32_t page_size;
     int prot;
-    int ret, is_user;
+    int ret, is_user, ng;
 
     is_user = mmu_idx == MMU_USER_IDX;
-    ret = get_phys_addr(env, address, access_type, is_user, &phys_addr, &prot);
+    ret = get_phys_addr(env, address, access_type, is_user, &phys_addr, &prot,
+                        &page_size, &ng);
     if (ret == 0) {
         /* Map a single [sub]page.  */
         phys_addr &= ~(uint32_t)0x3ff;
         address &= ~(uint32_t)0x3ff;
+        if (page_size > 0x1000)
+            arm_tlb_add_large_page(env, address, page_size);
+        env->tlb_ng[mmu_idx][(address >> TARGET_PAGE_BITS)
+                             & (CPU_TLB_SIZE - 1)] = ng;
         return tlb_set_page (env, address, phys_addr, prot, mmu_idx,
                              is_softmmu);
     }
@@ -1219,10 +1297,11 @@ int cpu_arm_handle_mmu_fault (CPUState *env, target_ulong address,
 target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr)
 {
     uint32_t phys_addr;
+    uint32_t page_size;
     int prot;
-    int ret;
+    int ret, ng;
 
-    ret = get_phys_addr(env, addr, 0, 0, &phys_addr, &prot);
+    ret = get_phys_addr(env, addr, 0, 0, &phys_addr, &prot, &page_size, &ng);
 
     if (ret != 0)
         return -1;
@@ -1230,8 +1309,9 @@ target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr)
     return phys_addr;
 }
 
-/* Not really implemented.  Need to figure out a sane way of doing this.
-   Maybe add generic watchpoint support and use that.  */
+/* The monitor only records the address.  Stores by other CPUs are
+   detected by the store exclusive, which compares the memory contents
+   with the value that was loaded (see op_helper.c).  */
 
 void HELPER(mark_exclusive)(CPUState *env, uint32_t addr)
 {
@@ -1333,7 +1413,7 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
                 env->cp15.c1_sys = val;
             /* ??? Lots of these bits are not implemented.  */
             /* This may enable/disable the MMU, so do a TLB flush.  */
-            tlb_flush(env, 1);
+            arm_tlb_flush(env, 1);
             break;
         case 1: /* Auxiliary cotrol register.  */
             if (arm_feature(env, ARM_FEATURE_XSCALE)) {
@@ -1388,7 +1468,7 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
         break;
     case 3: /* MMU Domain access control / MPU write buffer control.  */
         env->cp15.c3 = val;
-        tlb_flush(env, 1); /* Flush TLB as domain not tracked in TLB */
+        arm_tlb_flush(env, 1); /* Flush TLB as domain not tracked in TLB */
         break;
     case 4: /* Reserved.  */
         goto bad_reg;
@@ -1450,28 +1530,20 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
     case 8: /* MMU TLB control.  */
         switch (op2) {
         case 0: /* Invalidate all.  */
-            tlb_flush(env, 0);
+            arm_tlb_flush(env, 0);
             break;
         case 1: /* Invalidate single TLB entry.  */
-#if 0
-            /* ??? This is wrong for large pages and sections.  */
-            /* As an ugly hack to make linux work we always flush a 4K
-               pages.  */
-            val &= 0xfffff000;
-            tlb_flush_page(env, val);
-            tlb_flush_page(env, val + 0x400);
-            tlb_flush_page(env, val + 0x800);
-            tlb_flush_page(env, val + 0xc00);
-#else
-            tlb_flush(env, 1);
-#endif
+            /* Entries of other ASIDs are never held, so the ASID in the
+               low bits can be ignored.  */
+            arm_tlb_flush_mva(env, val);
             break;
         case 2: /* Invalidate on ASID.  */
-            tlb_flush(env, val == 0);
+            /* Only the current ASID has not-global entries in the TLB.  */
+            if (((val ^ env->cp15.c13_context) & 0xff) == 0)
+                tlb_flush_masked(env, env->tlb_ng);
             break;
         case 3: /* Invalidate single entry on MVA.  */
-            /* ??? This is like case 1, but ignores ASID.  */
-            tlb_flush(env, 1);
+            arm_tlb_flush_mva(env, val);
             break;
         default:
             goto bad_reg;
@@ -1521,14 +1593,19 @@ void HELPER(set_cp15)(CPUState *env, uint32_t insn, uint32_t val)
                not modified virtual addresses, so this causes a TLB flush.
              */
             if (env->cp15.c13_fcse != val)
-              tlb_flush(env, 1);
+              arm_tlb_flush(env, 1);
             env->cp15.c13_fcse = val;
             break;
         case 1:
-            /* This changes the ASID, so do a TLB flush.  */
-            if (env->cp15.c13_context != val
-                && !arm_feature(env, ARM_FEATURE_MPU))
-              tlb_flush(env, 0);
+            /* This changes the ASID.  On ARMv6 and later the TLB keeps the
+               global entries and drops those tagged with the old ASID.  */
+            if (arm_feature(env, ARM_FEATURE_V6)) {
+                if ((env->cp15.c13_context ^ val) & 0xff)
+                    tlb_flush_masked(env, env->tlb_ng);
+            } else if (env->cp15.c13_context != val
+                       && !arm_feature(env, ARM_FEATURE_MPU)) {
+                tlb_flush(env, 0);
+            }
             env->cp15.c13_context = val;
             break;
         case 2:
@@ -2319,7 +2396,100 @@ void HELPER(vfp_set_fpscr)(CPUState *env, uint32_t val)
 
 #define VFP_HELPER(name, p) HELPER(glue(glue(vfp_,name),p))
 
-#define VFP_BINOP(name) \
+/* Host FPU fast path.  Once the sticky inexact flag is set, an operation
+   in round-to-nearest mode on zero or normal operands that gives a normal
+   result cannot raise any new exception, and the host computes exactly
+   the same bits as softfloat.  Anything else (denormals, infinities, NaNs,
+   zero or tiny results, other rounding modes) is redone with softfloat.  This
+   needs a host that evaluates float and double in their own precision,
+   i.e. not the x87.  */
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define VFP_HOST_FP 1
+
+typedef union {
+    float f;
+    uint32_t i;
+} vfp_host_s;
+
+typedef union {
+    double f;
+    uint64_t i;
+} vfp_host_d;
+
+static inline int vfp_host_ok(CPUState *env)
+{
+    float_status *s = &env->vfp.fp_status;
+    return (get_float_exception_flags(s) & float_flag_inexact)
+           && s->float_rounding_mode == float_round_nearest_even;
+}
+
+static inline int vfp_host_normal_s(uint32_t x)
+{
+    uint32_t exp = (x >> 23) & 0xff;
+    return exp != 0 && exp != 0xff;
+}
+
+static inline int vfp_host_input_s(uint32_t x)
+{
+    return vfp_host_normal_s(x) || (x & 0x7fffffff) == 0;
+}
+
+static inline int vfp_host_normal_d(uint64_t x)
+{
+    uint32_t exp = (x >> 52) & 0x7ff;
+    return exp != 0 && exp != 0x7ff;
+}
+
+static inline int vfp_host_input_d(uint64_t x)
+{
+    return vfp_host_normal_d(x) || (x & ~(1ULL << 63)) == 0;
+}
+
+/* A result in the lowest normal binade may have been tiny before
+   rounding, which softfloat reports as underflow.  */
+static inline int vfp_host_result_s(uint32_t x)
+{
+    uint32_t exp = (x >> 23) & 0xff;
+    return exp > 1 && exp != 0xff;
+}
+
+static inline int vfp_host_result_d(uint64_t x)
+{
+    uint32_t exp = (x >> 52) & 0x7ff;
+    return exp > 1 && exp != 0x7ff;
+}
+#endif
+
+#ifdef VFP_HOST_FP
+#define VFP_BINOP(name, op) \
+float32 VFP_HELPER(name, s)(float32 a, float32 b, CPUState *env) \
+{ \
+    vfp_host_s ha, hb, hr; \
+    ha.i = float32_val(a); \
+    hb.i = float32_val(b); \
+    if (vfp_host_ok(env) && vfp_host_input_s(ha.i) \
+        && vfp_host_input_s(hb.i)) { \
+        hr.f = ha.f op hb.f; \
+        if (vfp_host_result_s(hr.i)) \
+            return make_float32(hr.i); \
+    } \
+    return float32_ ## name (a, b, &env->vfp.fp_status); \
+} \
+float64 VFP_HELPER(name, d)(float64 a, float64 b, CPUState *env) \
+{ \
+    vfp_host_d ha, hb, hr; \
+    ha.i = float64_val(a); \
+    hb.i = float64_val(b); \
+    if (vfp_host_ok(env) && vfp_host_input_d(ha.i) \
+        && vfp_host_input_d(hb.i)) { \
+        hr.f = ha.f op hb.f; \
+        if (vfp_host_result_d(hr.i)) \
+            return make_float64(hr.i); \
+    } \
+    return float64_ ## name (a, b, &env->vfp.fp_status); \
+}
+#else
+#define VFP_BINOP(name, op) \
 float32 VFP_HELPER(name, s)(float32 a, float32 b, CPUState *env) \
 { \
     return float32_ ## name (a, b, &env->vfp.fp_status); \
@@ -2328,10 +2498,11 @@ float64 VFP_HELPER(name, d)(float64 a, float64 b, CPUState *env) \
 { \
     return float64_ ## name (a, b, &env->vfp.fp_status); \
 }
-VFP_BINOP(add)
-VFP_BINOP(sub)
-VFP_BINOP(mul)
-VFP_BINOP(div)
+#endif
+VFP_BINOP(add, +)
+VFP_BINOP(sub, -)
+VFP_BINOP(mul, *)
+VFP_BINOP(div, /)
 #undef VFP_BINOP
 
 float32 VFP_HELPER(neg, s)(float32 a)
@@ -2356,11 +2527,28 @@ float64 VFP_HELPER(abs, d)(float64 a)
 
 float32 VFP_HELPER(sqrt, s)(float32 a, CPUState *env)
 {
+#ifdef VFP_HOST_FP
+    vfp_host_s h;
+    h.i = float32_val(a);
+    /* The root of a positive normal number is always normal.  */
+    if (vfp_host_ok(env) && vfp_host_normal_s(h.i) && !(h.i >> 31)) {
+        h.f = sqrtf(h.f);
+        return make_float32(h.i);
+    }
+#endif
     return float32_sqrt(a, &env->vfp.fp_status);
 }
 
 float64 VFP_HELPER(sqrt, d)(float64 a, CPUState *env)
 {
+#ifdef VFP_HOST_FP
+    vfp_host_d h;
+    h.i = float64_val(a);
+    if (vfp_host_ok(env) && vfp_host_normal_d(h.i) && !(h.i >> 63)) {
+        h.f = sqrt(h.f);
+        return make_float64(h.i);
+    }
+#endif
     return float64_sqrt(a, &env->vfp.fp_status);
 }
 
@@ -52,6 +52,7 @@ DEF_HELPER_1(logicq_cc, i32, i64)
 DEF_HELPER_3(sel_flags, i32, i32, i32, i32)
 DEF_HELPER_1(exception, void, i32)
 DEF_HELPER_0(wfi, void)
+DEF_HELPER_0(lookup_tb, ptr)
 
 DEF_HELPER_2(cpsr_write, void, i32, i32)
 DEF_HELPER_0(cpsr_read, i32)
@@ -70,6 +71,8 @@ DEF_HELPER_3(set_r13_banked, void, env, i32, i32)
 
 DEF_HELPER_2(mark_exclusive, void, env, i32)
 DEF_HELPER_2(test_exclusive, i32, env, i32)
+DEF_HELPER_3(store_exclusive, i32, i32, i32, i32)
+DEF_HELPER_3(store_exclusive64, i32, i32, i32, i32)
 DEF_HELPER_1(clrex, void, env)
 
 DEF_HELPER_1(get_user_reg, i32, i32)
@@ -356,6 +359,71 @@ DEF_HELPER_2(neon_cgt_f32, i32, i32, i32)
 DEF_HELPER_2(neon_acge_f32, i32, i32, i32)
 DEF_HELPER_2(neon_acgt_f32, i32, i32, i32)
 
+/* Whole register operations.  */
+DEF_HELPER_2(neon_add_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_add_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_add_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_sub_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_sub_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_sub_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_mul_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_mul_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_mul_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_mla_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_mla_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_mla_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_mls_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_mls_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_mls_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_tst_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_tst_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_tst_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_ceq_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_ceq_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_ceq_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_cgt_s8_vec, void, env, i32)
+DEF_HELPER_2(neon_cgt_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_cgt_s16_vec, void, env, i32)
+DEF_HELPER_2(neon_cgt_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_cgt_s32_vec, void, env, i32)
+DEF_HELPER_2(neon_cgt_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_cge_s8_vec, void, env, i32)
+DEF_HELPER_2(neon_cge_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_cge_s16_vec, void, env, i32)
+DEF_HELPER_2(neon_cge_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_cge_s32_vec, void, env, i32)
+DEF_HELPER_2(neon_cge_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_max_s8_vec, void, env, i32)
+DEF_HELPER_2(neon_max_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_max_s16_vec, void, env, i32)
+DEF_HELPER_2(neon_max_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_max_s32_vec, void, env, i32)
+DEF_HELPER_2(neon_max_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_min_s8_vec, void, env, i32)
+DEF_HELPER_2(neon_min_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_min_s16_vec, void, env, i32)
+DEF_HELPER_2(neon_min_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_min_s32_vec, void, env, i32)
+DEF_HELPER_2(neon_min_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_abd_s8_vec, void, env, i32)
+DEF_HELPER_2(neon_abd_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_abd_s16_vec, void, env, i32)
+DEF_HELPER_2(neon_abd_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_abd_s32_vec, void, env, i32)
+DEF_HELPER_2(neon_abd_u32_vec, void, env, i32)
+DEF_HELPER_2(neon_rhadd_s8_vec, void, env, i32)
+DEF_HELPER_2(neon_rhadd_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_rhadd_s16_vec, void, env, i32)
+DEF_HELPER_2(neon_rhadd_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_qadd_s8_vec, void, env, i32)
+DEF_HELPER_2(neon_qadd_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_qadd_s16_vec, void, env, i32)
+DEF_HELPER_2(neon_qadd_u16_vec, void, env, i32)
+DEF_HELPER_2(neon_qsub_s8_vec, void, env, i32)
+DEF_HELPER_2(neon_qsub_u8_vec, void, env, i32)
+DEF_HELPER_2(neon_qsub_s16_vec, void, env, i32)
+DEF_HELPER_2(neon_qsub_u16_vec, void, env, i32)
+
 /* iwmmxt_helper.c */
 DEF_HELPER_2(iwmmxt_maddsq, i64, i64, i64)
 DEF_HELPER_2(iwmmxt_madduq, i64, i64, i64)
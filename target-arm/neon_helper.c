@@ -1455,3 +1455,329 @@ uint32_t HELPER(neon_acgt_f32)(uint32_t a, uint32_t b)
     float32 f1 = float32_abs(vfp_itos(b));
     return (float32_compare_quiet(f0, f1, NFS) > 0) ? ~0 : 0;
 }
+
+/* Whole register operations.  These process every element of a D or Q
+   register in a single call, rather than one 32-bit chunk at a time, so
+   that the host can use its own vector unit where it has one.  DESC packs
+   the D register numbers of the destination and both operands, and
+   whether this is a Q register operation.  */
+
+#define NEON_VEC_DESC_RD(desc) ((desc) & 0x1f)
+#define NEON_VEC_DESC_RN(desc) (((desc) >> 5) & 0x1f)
+#define NEON_VEC_DESC_RM(desc) (((desc) >> 10) & 0x1f)
+#define NEON_VEC_DESC_Q(desc) (((desc) >> 15) & 1)
+
+/* Each D register is a host-endian 64-bit value, so on big-endian hosts
+   element I lives at the mirrored position within its doubleword.  */
+#ifdef WORDS_BIGENDIAN
+#define H1(x) ((x) ^ 7)
+#define H2(x) ((x) ^ 3)
+#define H4(x) ((x) ^ 1)
+#else
+#define H1(x) (x)
+#define H2(x) (x)
+#define H4(x) (x)
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define NEON_VEC_SSE2 1
+
+static inline __m128i neon_sse_load(const void *p, int q)
+{
+    if (q)
+        return _mm_loadu_si128((const __m128i *)p);
+    else
+        return _mm_loadl_epi64((const __m128i *)p);
+}
+
+static inline void neon_sse_store(void *p, __m128i v, int q)
+{
+    if (q)
+        _mm_storeu_si128((__m128i *)p, v);
+    else
+        _mm_storel_epi64((__m128i *)p, v);
+}
+
+#define SSE_ONES _mm_set1_epi32(-1)
+#define SSE_BIAS_s8 _mm_setzero_si128()
+#define SSE_BIAS_s16 _mm_setzero_si128()
+#define SSE_BIAS_s32 _mm_setzero_si128()
+#define SSE_BIAS_u8 _mm_set1_epi8((char)0x80)
+#define SSE_BIAS_u16 _mm_set1_epi16((short)0x8000)
+#define SSE_BIAS_u32 _mm_set1_epi32(0x80000000)
+
+static inline __m128i neon_sse_select(__m128i c, __m128i t, __m128i f)
+{
+    return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, f));
+}
+
+/* Comparisons, min and max for each element type.  SSE2 only has signed
+   compares, so unsigned elements are biased into the signed range.  */
+#define NEON_SSE_CMP(sfx, bits) \
+static inline __m128i neon_sse_gt_##sfx(__m128i a, __m128i b) \
+{ \
+    return _mm_cmpgt_epi##bits(_mm_xor_si128(a, SSE_BIAS_##sfx), \
+                               _mm_xor_si128(b, SSE_BIAS_##sfx)); \
+} \
+static inline __m128i neon_sse_ge_##sfx(__m128i a, __m128i b) \
+{ \
+    return _mm_xor_si128(neon_sse_gt_##sfx(b, a), SSE_ONES); \
+} \
+static inline __m128i neon_sse_max_##sfx(__m128i a, __m128i b) \
+{ \
+    return neon_sse_select(neon_sse_gt_##sfx(a, b), a, b); \
+} \
+static inline __m128i neon_sse_min_##sfx(__m128i a, __m128i b) \
+{ \
+    return neon_sse_select(neon_sse_gt_##sfx(a, b), b, a); \
+}
+NEON_SSE_CMP(s8, 8)
+NEON_SSE_CMP(u8, 8)
+NEON_SSE_CMP(s16, 16)
+NEON_SSE_CMP(u16, 16)
+NEON_SSE_CMP(s32, 32)
+NEON_SSE_CMP(u32, 32)
+#undef NEON_SSE_CMP
+
+static inline __m128i neon_sse_mul_u8(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mullo_epi16(a, b);
+    __m128i odd = _mm_mullo_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    return _mm_or_si128(_mm_and_si128(even, _mm_set1_epi16(0xff)),
+                        _mm_slli_epi16(odd, 8));
+}
+
+static inline __m128i neon_sse_mul_u32(__m128i a, __m128i b)
+{
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static inline __m128i neon_sse_rhadd_s8(__m128i a, __m128i b)
+{
+    __m128i bias = SSE_BIAS_u8;
+    return _mm_xor_si128(_mm_avg_epu8(_mm_xor_si128(a, bias),
+                                      _mm_xor_si128(b, bias)), bias);
+}
+
+static inline __m128i neon_sse_rhadd_s16(__m128i a, __m128i b)
+{
+    __m128i bias = SSE_BIAS_u16;
+    return _mm_xor_si128(_mm_avg_epu16(_mm_xor_si128(a, bias),
+                                       _mm_xor_si128(b, bias)), bias);
+}
+
+static inline __m128i neon_sse_tst(__m128i eq)
+{
+    return _mm_xor_si128(eq, SSE_ONES);
+}
+#endif
+
+/* OP(d, n, m) is the SSE2 expression for the new value of the whole
+   register, given the old destination D and the operands N and M.
+   FN(d, n, m) assigns one element of the result in the generic code.  */
+#ifdef NEON_VEC_SSE2
+#define NEON_VEC(name, type, H, OP, FN) \
+void HELPER(neon_##name##_vec)(CPUState *env, uint32_t desc) \
+{ \
+    int q = NEON_VEC_DESC_Q(desc); \
+    void *vd = &env->vfp.regs[NEON_VEC_DESC_RD(desc)]; \
+    __m128i d = neon_sse_load(vd, q); \
+    __m128i n = neon_sse_load(&env->vfp.regs[NEON_VEC_DESC_RN(desc)], q); \
+    __m128i m = neon_sse_load(&env->vfp.regs[NEON_VEC_DESC_RM(desc)], q); \
+    (void)d; \
+    neon_sse_store(vd, OP, q); \
+}
+#else
+#define NEON_VEC(name, type, H, OP, FN) \
+void HELPER(neon_##name##_vec)(CPUState *env, uint32_t desc) \
+{ \
+    type *vd = (type *)&env->vfp.regs[NEON_VEC_DESC_RD(desc)]; \
+    type *vn = (type *)&env->vfp.regs[NEON_VEC_DESC_RN(desc)]; \
+    type *vm = (type *)&env->vfp.regs[NEON_VEC_DESC_RM(desc)]; \
+    int i; \
+    int count = (NEON_VEC_DESC_Q(desc) ? 16 : 8) / sizeof(type); \
+    for (i = 0; i < count; i++) { \
+        type n = vn[H(i)]; \
+        type m = vm[H(i)]; \
+        FN(vd[H(i)], n, m); \
+    } \
+}
+#endif
+
+#define NEON_FN(d, n, m) d = n + m
+NEON_VEC(add_u8, uint8_t, H1, _mm_add_epi8(n, m), NEON_FN)
+NEON_VEC(add_u16, uint16_t, H2, _mm_add_epi16(n, m), NEON_FN)
+NEON_VEC(add_u32, uint32_t, H4, _mm_add_epi32(n, m), NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d = n - m
+NEON_VEC(sub_u8, uint8_t, H1, _mm_sub_epi8(n, m), NEON_FN)
+NEON_VEC(sub_u16, uint16_t, H2, _mm_sub_epi16(n, m), NEON_FN)
+NEON_VEC(sub_u32, uint32_t, H4, _mm_sub_epi32(n, m), NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d = (uint32_t)n * m
+NEON_VEC(mul_u8, uint8_t, H1, neon_sse_mul_u8(n, m), NEON_FN)
+NEON_VEC(mul_u16, uint16_t, H2, _mm_mullo_epi16(n, m), NEON_FN)
+NEON_VEC(mul_u32, uint32_t, H4, neon_sse_mul_u32(n, m), NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d += (uint32_t)n * m
+NEON_VEC(mla_u8, uint8_t, H1, _mm_add_epi8(d, neon_sse_mul_u8(n, m)), NEON_FN)
+NEON_VEC(mla_u16, uint16_t, H2, _mm_add_epi16(d, _mm_mullo_epi16(n, m)),
+         NEON_FN)
+NEON_VEC(mla_u32, uint32_t, H4, _mm_add_epi32(d, neon_sse_mul_u32(n, m)),
+         NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d -= (uint32_t)n * m
+NEON_VEC(mls_u8, uint8_t, H1, _mm_sub_epi8(d, neon_sse_mul_u8(n, m)), NEON_FN)
+NEON_VEC(mls_u16, uint16_t, H2, _mm_sub_epi16(d, _mm_mullo_epi16(n, m)),
+         NEON_FN)
+NEON_VEC(mls_u32, uint32_t, H4, _mm_sub_epi32(d, neon_sse_mul_u32(n, m)),
+         NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d = (n & m) ? ~0 : 0
+NEON_VEC(tst_u8, uint8_t, H1,
+         neon_sse_tst(_mm_cmpeq_epi8(_mm_and_si128(n, m), _mm_setzero_si128())),
+         NEON_FN)
+NEON_VEC(tst_u16, uint16_t, H2,
+         neon_sse_tst(_mm_cmpeq_epi16(_mm_and_si128(n, m), _mm_setzero_si128())),
+         NEON_FN)
+NEON_VEC(tst_u32, uint32_t, H4,
+         neon_sse_tst(_mm_cmpeq_epi32(_mm_and_si128(n, m), _mm_setzero_si128())),
+         NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d = (n == m) ? ~0 : 0
+NEON_VEC(ceq_u8, uint8_t, H1, _mm_cmpeq_epi8(n, m), NEON_FN)
+NEON_VEC(ceq_u16, uint16_t, H2, _mm_cmpeq_epi16(n, m), NEON_FN)
+NEON_VEC(ceq_u32, uint32_t, H4, _mm_cmpeq_epi32(n, m), NEON_FN)
+#undef NEON_FN
+
+/* Ops that exist for all six signed and unsigned element types.  */
+#define NEON_VEC_ALL(name, OP, FN) \
+NEON_VEC(name##_s8, int8_t, H1, OP(name, s8), FN) \
+NEON_VEC(name##_u8, uint8_t, H1, OP(name, u8), FN) \
+NEON_VEC(name##_s16, int16_t, H2, OP(name, s16), FN) \
+NEON_VEC(name##_u16, uint16_t, H2, OP(name, u16), FN) \
+NEON_VEC(name##_s32, int32_t, H4, OP(name, s32), FN) \
+NEON_VEC(name##_u32, uint32_t, H4, OP(name, u32), FN)
+
+#define NEON_OP(name, sfx) neon_sse_##name##_##sfx(n, m)
+
+#define NEON_FN(d, n, m) d = (n > m) ? ~0 : 0
+#define neon_sse_cgt_s8 neon_sse_gt_s8
+#define neon_sse_cgt_u8 neon_sse_gt_u8
+#define neon_sse_cgt_s16 neon_sse_gt_s16
+#define neon_sse_cgt_u16 neon_sse_gt_u16
+#define neon_sse_cgt_s32 neon_sse_gt_s32
+#define neon_sse_cgt_u32 neon_sse_gt_u32
+NEON_VEC_ALL(cgt, NEON_OP, NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d = (n >= m) ? ~0 : 0
+#define neon_sse_cge_s8 neon_sse_ge_s8
+#define neon_sse_cge_u8 neon_sse_ge_u8
+#define neon_sse_cge_s16 neon_sse_ge_s16
+#define neon_sse_cge_u16 neon_sse_ge_u16
+#define neon_sse_cge_s32 neon_sse_ge_s32
+#define neon_sse_cge_u32 neon_sse_ge_u32
+NEON_VEC_ALL(cge, NEON_OP, NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d = (n > m) ? n : m
+NEON_VEC_ALL(max, NEON_OP, NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(d, n, m) d = (n < m) ? n : m
+NEON_VEC_ALL(min, NEON_OP, NEON_FN)
+#undef NEON_FN
+#undef NEON_OP
+
+/* The absolute difference always fits in the unsigned element type, so
+   max - min with wraparound gives the right answer for both signs.  */
+#define NEON_OP(name, sfx) \
+    _mm_sub_epi##name(neon_sse_max_##sfx(n, m), neon_sse_min_##sfx(n, m))
+#define NEON_FN(d, n, m) d = (n > m) ? n - m : m - n
+NEON_VEC(abd_s8, int8_t, H1, NEON_OP(8, s8), NEON_FN)
+NEON_VEC(abd_u8, uint8_t, H1, NEON_OP(8, u8), NEON_FN)
+NEON_VEC(abd_s16, int16_t, H2, NEON_OP(16, s16), NEON_FN)
+NEON_VEC(abd_u16, uint16_t, H2, NEON_OP(16, u16), NEON_FN)
+NEON_VEC(abd_s32, int32_t, H4, NEON_OP(32, s32), NEON_FN)
+NEON_VEC(abd_u32, uint32_t, H4, NEON_OP(32, u32), NEON_FN)
+#undef NEON_FN
+#undef NEON_OP
+
+#define NEON_FN(d, n, m) d = ((int32_t)n + m + 1) >> 1
+NEON_VEC(rhadd_s8, int8_t, H1, neon_sse_rhadd_s8(n, m), NEON_FN)
+NEON_VEC(rhadd_u8, uint8_t, H1, _mm_avg_epu8(n, m), NEON_FN)
+NEON_VEC(rhadd_s16, int16_t, H2, neon_sse_rhadd_s16(n, m), NEON_FN)
+NEON_VEC(rhadd_u16, uint16_t, H2, _mm_avg_epu16(n, m), NEON_FN)
+#undef NEON_FN
+#undef NEON_VEC_ALL
+#undef NEON_VEC
+
+/* Saturating add and subtract also have to set the sticky QC flag.  */
+#ifdef NEON_VEC_SSE2
+#define NEON_VEC_SAT(name, type, H, wrap, sat, lo, hi, FN) \
+void HELPER(neon_##name##_vec)(CPUState *env, uint32_t desc) \
+{ \
+    int q = NEON_VEC_DESC_Q(desc); \
+    __m128i n = neon_sse_load(&env->vfp.regs[NEON_VEC_DESC_RN(desc)], q); \
+    __m128i m = neon_sse_load(&env->vfp.regs[NEON_VEC_DESC_RM(desc)], q); \
+    __m128i r = sat(n, m); \
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(r, wrap(n, m))) != 0xffff) \
+        SET_QC(); \
+    neon_sse_store(&env->vfp.regs[NEON_VEC_DESC_RD(desc)], r, q); \
+}
+#else
+#define NEON_VEC_SAT(name, type, H, wrap, sat, lo, hi, FN) \
+void HELPER(neon_##name##_vec)(CPUState *env, uint32_t desc) \
+{ \
+    type *vd = (type *)&env->vfp.regs[NEON_VEC_DESC_RD(desc)]; \
+    type *vn = (type *)&env->vfp.regs[NEON_VEC_DESC_RN(desc)]; \
+    type *vm = (type *)&env->vfp.regs[NEON_VEC_DESC_RM(desc)]; \
+    int i; \
+    int count = (NEON_VEC_DESC_Q(desc) ? 16 : 8) / sizeof(type); \
+    for (i = 0; i < count; i++) { \
+        int32_t r = FN((int32_t)vn[H(i)], (int32_t)vm[H(i)]); \
+        if (r < lo) { \
+            r = lo; \
+            SET_QC(); \
+        } else if (r > hi) { \
+            r = hi; \
+            SET_QC(); \
+        } \
+        vd[H(i)] = r; \
+    } \
+}
+#endif
+
+#define NEON_FN(n, m) (n + m)
+NEON_VEC_SAT(qadd_s8, int8_t, H1, _mm_add_epi8, _mm_adds_epi8,
+             -0x80, 0x7f, NEON_FN)
+NEON_VEC_SAT(qadd_u8, uint8_t, H1, _mm_add_epi8, _mm_adds_epu8,
+             0, 0xff, NEON_FN)
+NEON_VEC_SAT(qadd_s16, int16_t, H2, _mm_add_epi16, _mm_adds_epi16,
+             -0x8000, 0x7fff, NEON_FN)
+NEON_VEC_SAT(qadd_u16, uint16_t, H2, _mm_add_epi16, _mm_adds_epu16,
+             0, 0xffff, NEON_FN)
+#undef NEON_FN
+
+#define NEON_FN(n, m) (n - m)
+NEON_VEC_SAT(qsub_s8, int8_t, H1, _mm_sub_epi8, _mm_subs_epi8,
+             -0x80, 0x7f, NEON_FN)
+NEON_VEC_SAT(qsub_u8, uint8_t, H1, _mm_sub_epi8, _mm_subs_epu8,
+             0, 0xff, NEON_FN)
+NEON_VEC_SAT(qsub_s16, int16_t, H2, _mm_sub_epi16, _mm_subs_epi16,
+             -0x8000, 0x7fff, NEON_FN)
+NEON_VEC_SAT(qsub_u16, uint16_t, H2, _mm_sub_epi16, _mm_subs_epu16,
+             0, 0xffff, NEON_FN)
+#undef NEON_FN
+#undef NEON_VEC_SAT
@@ -114,6 +114,170 @@ void tlb_fill (target_ulong addr, int is_write, int mmu_idx, void *retaddr)
 }
 #endif
 
+/* Exclusive stores.  The load exclusive records the value it read, and
+   the store is made with a host compare and swap against it, so that no
+   update is lost when the CPUs run in parallel.  Memory that cannot be
+   accessed directly (MMIO, pages holding code) is updated with the
+   other CPUs stopped.  */
+
+#if defined(CONFIG_USER_ONLY)
+/* Return the host address of a guest location for a write.  Faults are
+   raised here, with the guest state restored, rather than by the host
+   compare and swap inside the helper.  */
+static void *exclusive_host_addr(uint32_t addr, int size, void *retaddr)
+{
+    TranslationBlock *tb;
+
+    if (page_check_range(addr, 1 << size, PAGE_READ | PAGE_WRITE) < 0) {
+        env->cp15.c6_data = addr;
+        tb = tb_find_pc((unsigned long)retaddr);
+        if (tb)
+            cpu_restore_state(tb, env, (unsigned long)retaddr, NULL);
+        raise_exception(EXCP_DATA_ABORT);
+    }
+    return g2h(addr);
+}
+#else
+/* Return the host address of a guest RAM location for a write, or NULL
+   if the access must go through the slow path.  Faults are raised
+   here, before anything has been modified.  */
+static void *exclusive_host_addr(uint32_t addr, int size, void *retaddr)
+{
+    int mmu_idx, index;
+    target_ulong tlb_addr;
+
+    mmu_idx = cpu_mmu_index(env);
+    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    if ((addr & TARGET_PAGE_MASK) !=
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        tlb_fill(addr, 1, mmu_idx, retaddr);
+        tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    }
+    if (tlb_addr & ~TARGET_PAGE_MASK)
+        return NULL;
+    return (void *)(unsigned long)(addr + env->tlb_table[mmu_idx][index].addend);
+}
+
+static uint32_t store_exclusive_slow(uint32_t addr, uint64_t oldval,
+                                     uint64_t newval, int size)
+{
+    int mmu_idx;
+    uint64_t val;
+
+    mmu_idx = cpu_mmu_index(env);
+    switch (size) {
+    case 0:
+        val = __ldb_mmu(addr, mmu_idx);
+        break;
+    case 1:
+        val = __ldw_mmu(addr, mmu_idx);
+        break;
+    case 2:
+        val = __ldl_mmu(addr, mmu_idx);
+        break;
+    default:
+        val = __ldq_mmu(addr, mmu_idx);
+        break;
+    }
+    if (val != oldval)
+        return 1;
+    switch (size) {
+    case 0:
+        __stb_mmu(addr, newval, mmu_idx);
+        break;
+    case 1:
+        __stw_mmu(addr, newval, mmu_idx);
+        break;
+    case 2:
+        __stl_mmu(addr, newval, mmu_idx);
+        break;
+    default:
+        __stq_mmu(addr, newval, mmu_idx);
+        break;
+    }
+    return 0;
+}
+#endif
+
+static inline int exclusive_cmpxchg(void *host, uint64_t oldval,
+                                    uint64_t newval, int size)
+{
+    switch (size) {
+    case 0:
+        return __sync_bool_compare_and_swap((uint8_t *)host,
+                                            (uint8_t)oldval, (uint8_t)newval);
+    case 1:
+        return __sync_bool_compare_and_swap((uint16_t *)host,
+                                            tswap16(oldval), tswap16(newval));
+    case 2:
+        return __sync_bool_compare_and_swap((uint32_t *)host,
+                                            tswap32(oldval), tswap32(newval));
+    default:
+        return __sync_bool_compare_and_swap((uint64_t *)host,
+                                            tswap64(oldval), tswap64(newval));
+    }
+}
+
+/* Value of a doubleword as a target endian 64-bit load would return
+   it.  */
+static inline uint64_t exclusive_pair(uint32_t lo, uint32_t hi)
+{
+#ifdef TARGET_WORDS_BIGENDIAN
+    return ((uint64_t)lo << 32) | hi;
+#else
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+/* Returns zero if the store was performed.  */
+static uint32_t do_store_exclusive(uint32_t addr, uint64_t val, int size,
+                                   void *retaddr)
+{
+    uint64_t oldval;
+    void *host;
+#if !defined(CONFIG_USER_ONLY)
+    uint32_t ret;
+#endif
+
+#if defined(CONFIG_USER_ONLY)
+    if (HELPER(test_exclusive)(env, addr))
+        return 1;
+    host = exclusive_host_addr(addr, size, retaddr);
+#else
+    if (env->mmon_addr != addr)
+        return 1;
+    host = exclusive_host_addr(addr, size, retaddr);
+    env->mmon_addr = -1;
+#endif
+    if (size == 3)
+        oldval = exclusive_pair(env->mmon_val[0], env->mmon_val[1]);
+    else
+        oldval = env->mmon_val[0];
+#if defined(CONFIG_USER_ONLY)
+    return !exclusive_cmpxchg(host, oldval, val, size);
+#else
+    if (host && (addr & ((1 << size) - 1)) == 0)
+        return !exclusive_cmpxchg(host, oldval, val, size);
+    if (cpu_threads_enabled)
+        start_exclusive();
+    ret = store_exclusive_slow(addr, oldval, val, size);
+    if (cpu_threads_enabled)
+        end_exclusive();
+    return ret;
+#endif
+}
+
+uint32_t HELPER(store_exclusive)(uint32_t addr, uint32_t val, uint32_t size)
+{
+    return do_store_exclusive(addr, val, size, GETPC());
+}
+
+uint32_t HELPER(store_exclusive64)(uint32_t addr, uint32_t lo, uint32_t hi)
+{
+    return do_store_exclusive(addr, exclusive_pair(lo, hi), 3, GETPC());
+}
+
 /* FIXME: Pass an axplicit pointer to QF to CPUState, and move saturating
    instructions into helper.c  */
 uint32_t HELPER(add_setq)(uint32_t a, uint32_t b)
@@ -252,6 +416,29 @@ void HELPER(wfi)(void)
     cpu_loop_exit();
 }
 
+/* Find the TB for the PC set by an indirect branch so that the generated
+   code can jump to it directly.  Only the jump cache is consulted.  NULL
+   is returned on a miss or when the main loop has work to do.  */
+void *HELPER(lookup_tb)(void)
+{
+    TranslationBlock *tb;
+    target_ulong pc, cs_base;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags))
+        return NULL;
+    /* cpu_interrupt() unlinks the jumps reachable from current_tb, so it
+       must be updated before interrupt_request is tested.  The volatile
+       accesses keep the two in order with respect to signal handlers.  */
+    *(TranslationBlock * volatile *)&env->current_tb = tb;
+    if (*(volatile int *)&env->interrupt_request)
+        return NULL;
+    return tb->tc_ptr;
+}
+
 void HELPER(exception)(uint32_t excp)
 {
     env->exception_index = excp;
@@ -796,12 +796,14 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
     dead_tmp(tmp);
 }
 
-/* Set PC and Thumb state from var.  var is marked as dead.  */
+/* Set PC and Thumb state from var.  var is marked as dead.  The Thumb
+   state is part of the TB flags, so the next TB can still be looked up
+   inline.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
     TCGv tmp;
 
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tmp = new_tmp();
     tcg_gen_andi_i32(tmp, var, 1);
     store_cpu_field(tmp, thumb);
@@ -874,6 +876,29 @@ static inline void gen_st32(TCGv val, TCGv addr, int index)
     dead_tmp(val);
 }
 
+/* Record word 'n' of the value read by a load exclusive.  */
+static inline void gen_mark_exclusive_val(TCGv val, int n)
+{
+    tcg_gen_st_i32(val, cpu_env, offsetof(CPUState, mmon_val[n]));
+}
+
+/* Store exclusive of 1 << size bytes.  T0 is set to zero if the store
+   was performed.  */
+static inline void gen_store_exclusive(TCGv val, TCGv addr, int size)
+{
+    TCGv tmp = tcg_const_i32(size);
+    gen_helper_store_exclusive(cpu_T[0], addr, val, tmp);
+    tcg_temp_free_i32(tmp);
+    dead_tmp(val);
+}
+
+static inline void gen_store_exclusive64(TCGv lo, TCGv hi, TCGv addr)
+{
+    gen_helper_store_exclusive64(cpu_T[0], addr, lo, hi);
+    dead_tmp(lo);
+    dead_tmp(hi);
+}
+
 static inline void gen_movl_T0_reg(DisasContext *s, int reg)
 {
     load_reg_var(s, cpu_T[0], reg);
@@ -3375,12 +3400,25 @@ static int disas_vfp_insn(CPUState * env, DisasContext *s, uint32_t insn)
     return 0;
 }
 
+static inline int use_goto_tb(DisasContext *s, uint32_t dest)
+{
+#if defined(CONFIG_USER_ONLY)
+    return (s->tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK);
+#else
+    /* Jumps to other pages are chained too.  They are unlinked when the
+       mapping of the target page is flushed.  */
+    return 1;
+#endif
+}
+
 static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
 {
     TranslationBlock *tb;
 
     tb = s->tb;
-    if ((tb->pc & TARGET_PAGE_MASK) == (dest & TARGET_PAGE_MASK)) {
+    if (gen_tb_nb_succ < 2)
+        gen_tb_succ[gen_tb_nb_succ++] = dest;
+    if (use_goto_tb(s, dest)) {
         tcg_gen_goto_tb(n);
         gen_set_pc_im(dest);
         tcg_gen_exit_tb((long)tb + n);
@@ -3390,6 +3428,23 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
     }
 }
 
+/* End the TB after an indirect branch.  The jump cache is searched for
+   the new PC and, on a hit, control goes straight to that TB.  */
+static inline void gen_lookup_and_goto_tb(void)
+{
+    TCGv_ptr ptr;
+    int label;
+
+    ptr = tcg_temp_local_new_ptr();
+    gen_helper_lookup_tb(ptr);
+    label = gen_new_label();
+    tcg_gen_brcondi_ptr(TCG_COND_EQ, ptr, 0, label);
+    tcg_gen_jmp(ptr);
+    gen_set_label(label);
+    tcg_temp_free_ptr(ptr);
+    tcg_gen_exit_tb(0);
+}
+
 static inline void gen_jmp (DisasContext *s, uint32_t dest)
 {
     if (unlikely(s->singlestep_enabled)) {
@@ -3912,6 +3967,155 @@ static void gen_neon_bsl(TCGv dest, TCGv t, TCGv f, TCGv c)
     tcg_gen_or_i32(dest, t, f);
 }
 
+/* Three register same length integer ops that have a whole register
+   helper, indexed by op, U and size.  */
+typedef void NeonGenVecFn(TCGv_ptr, TCGv_i32);
+static NeonGenVecFn * const neon_3same_vec_fns[32][2][3] = {
+    [1] = { /* VQADD */
+        { gen_helper_neon_qadd_s8_vec, gen_helper_neon_qadd_s16_vec, NULL },
+        { gen_helper_neon_qadd_u8_vec, gen_helper_neon_qadd_u16_vec, NULL }
+    },
+    [2] = { /* VRHADD */
+        { gen_helper_neon_rhadd_s8_vec, gen_helper_neon_rhadd_s16_vec, NULL },
+        { gen_helper_neon_rhadd_u8_vec, gen_helper_neon_rhadd_u16_vec, NULL }
+    },
+    [5] = { /* VQSUB */
+        { gen_helper_neon_qsub_s8_vec, gen_helper_neon_qsub_s16_vec, NULL },
+        { gen_helper_neon_qsub_u8_vec, gen_helper_neon_qsub_u16_vec, NULL }
+    },
+    [6] = { /* VCGT */
+        { gen_helper_neon_cgt_s8_vec,
+          gen_helper_neon_cgt_s16_vec,
+          gen_helper_neon_cgt_s32_vec },
+        { gen_helper_neon_cgt_u8_vec,
+          gen_helper_neon_cgt_u16_vec,
+          gen_helper_neon_cgt_u32_vec }
+    },
+    [7] = { /* VCGE */
+        { gen_helper_neon_cge_s8_vec,
+          gen_helper_neon_cge_s16_vec,
+          gen_helper_neon_cge_s32_vec },
+        { gen_helper_neon_cge_u8_vec,
+          gen_helper_neon_cge_u16_vec,
+          gen_helper_neon_cge_u32_vec }
+    },
+    [12] = { /* VMAX */
+        { gen_helper_neon_max_s8_vec,
+          gen_helper_neon_max_s16_vec,
+          gen_helper_neon_max_s32_vec },
+        { gen_helper_neon_max_u8_vec,
+          gen_helper_neon_max_u16_vec,
+          gen_helper_neon_max_u32_vec }
+    },
+    [13] = { /* VMIN */
+        { gen_helper_neon_min_s8_vec,
+          gen_helper_neon_min_s16_vec,
+          gen_helper_neon_min_s32_vec },
+        { gen_helper_neon_min_u8_vec,
+          gen_helper_neon_min_u16_vec,
+          gen_helper_neon_min_u32_vec }
+    },
+    [14] = { /* VABD */
+        { gen_helper_neon_abd_s8_vec,
+          gen_helper_neon_abd_s16_vec,
+          gen_helper_neon_abd_s32_vec },
+        { gen_helper_neon_abd_u8_vec,
+          gen_helper_neon_abd_u16_vec,
+          gen_helper_neon_abd_u32_vec }
+    },
+    [16] = { /* VADD, VSUB */
+        { gen_helper_neon_add_u8_vec,
+          gen_helper_neon_add_u16_vec,
+          gen_helper_neon_add_u32_vec },
+        { gen_helper_neon_sub_u8_vec,
+          gen_helper_neon_sub_u16_vec,
+          gen_helper_neon_sub_u32_vec }
+    },
+    [17] = { /* VTST, VCEQ */
+        { gen_helper_neon_tst_u8_vec,
+          gen_helper_neon_tst_u16_vec,
+          gen_helper_neon_tst_u32_vec },
+        { gen_helper_neon_ceq_u8_vec,
+          gen_helper_neon_ceq_u16_vec,
+          gen_helper_neon_ceq_u32_vec }
+    },
+    [18] = { /* VMLA, VMLS */
+        { gen_helper_neon_mla_u8_vec,
+          gen_helper_neon_mla_u16_vec,
+          gen_helper_neon_mla_u32_vec },
+        { gen_helper_neon_mls_u8_vec,
+          gen_helper_neon_mls_u16_vec,
+          gen_helper_neon_mls_u32_vec }
+    },
+    [19] = { /* VMUL */
+        { gen_helper_neon_mul_u8_vec,
+          gen_helper_neon_mul_u16_vec,
+          gen_helper_neon_mul_u32_vec },
+        { NULL, NULL, NULL }
+    },
+};
+
+/* Generate a three register same length op on the whole of a D or Q
+   register at once.  Returns nonzero if the op must be done one 32-bit
+   chunk at a time instead.  */
+static int gen_neon_3same_vec(int op, int u, int size, int q,
+                              int rd, int rn, int rm)
+{
+    NeonGenVecFn *fn;
+    int pass;
+
+    if (q && ((rd | rn | rm) & 1))
+        return 1;
+    if (op == 3) {
+        /* Logic ops.  */
+        for (pass = 0; pass < (q ? 2 : 1); pass++) {
+            neon_load_reg64(cpu_V0, rn + pass);
+            neon_load_reg64(cpu_V1, rm + pass);
+            switch ((u << 2) | size) {
+            case 0: /* VAND */
+                tcg_gen_and_i64(cpu_V0, cpu_V0, cpu_V1);
+                break;
+            case 1: /* BIC */
+                tcg_gen_andc_i64(cpu_V0, cpu_V0, cpu_V1);
+                break;
+            case 2: /* VORR */
+                tcg_gen_or_i64(cpu_V0, cpu_V0, cpu_V1);
+                break;
+            case 3: /* VORN */
+                tcg_gen_orc_i64(cpu_V0, cpu_V0, cpu_V1);
+                break;
+            case 4: /* VEOR */
+                tcg_gen_xor_i64(cpu_V0, cpu_V0, cpu_V1);
+                break;
+            case 5: /* VBSL */
+                neon_load_reg64(cpu_M0, rd + pass);
+                tcg_gen_and_i64(cpu_V0, cpu_V0, cpu_M0);
+                tcg_gen_andc_i64(cpu_V1, cpu_V1, cpu_M0);
+                tcg_gen_or_i64(cpu_V0, cpu_V0, cpu_V1);
+                break;
+            case 6: /* VBIT */
+                neon_load_reg64(cpu_M0, rd + pass);
+                tcg_gen_and_i64(cpu_V0, cpu_V0, cpu_V1);
+                tcg_gen_andc_i64(cpu_M0, cpu_M0, cpu_V1);
+                tcg_gen_or_i64(cpu_V0, cpu_V0, cpu_M0);
+                break;
+            case 7: /* VBIF */
+                neon_load_reg64(cpu_M0, rd + pass);
+                tcg_gen_and_i64(cpu_M0, cpu_M0, cpu_V1);
+                tcg_gen_andc_i64(cpu_V0, cpu_V0, cpu_V1);
+                tcg_gen_or_i64(cpu_V0, cpu_V0, cpu_M0);
+                break;
+            }
+            neon_store_reg64(cpu_V0, rd + pass);
+        }
+        return 0;
+    }
+    if (size > 2 || (fn = neon_3same_vec_fns[op][u][size]) == NULL)
+        return 1;
+    fn(cpu_env, tcg_const_i32(rd | (rn << 5) | (rm << 10) | (q << 15)));
+    return 0;
+}
+
 static inline void gen_neon_narrow(int size, TCGv dest, TCGv_i64 src)
 {
     switch (size) {
@@ -4161,6 +4365,8 @@ static int disas_neon_data_insn(CPUState * env, DisasContext *s, uint32_t insn)
             }
             return 0;
         }
+        if (gen_neon_3same_vec(op, u, size, q, rd, rn, rm) == 0)
+            return 0;
         switch (op) {
         case 8: /* VSHL */
         case 9: /* VQSHL */
@@ -6260,9 +6466,11 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                                 break;
                             case 1: /* ldrexd */
                                 tmp = gen_ld32(addr, IS_USER(s));
+                                gen_mark_exclusive_val(tmp, 0);
                                 store_reg(s, rd, tmp);
                                 tcg_gen_addi_i32(addr, addr, 4);
                                 tmp = gen_ld32(addr, IS_USER(s));
+                                gen_mark_exclusive_val(tmp, 1);
                                 rd++;
                                 break;
                             case 2: /* ldrexb */
@@ -6274,34 +6482,29 @@ static void disas_arm_insn(CPUState * env, DisasContext *s)
                             default:
                                 abort();
                             }
+                            if (op1 != 1)
+                                gen_mark_exclusive_val(tmp, 0);
                             store_reg(s, rd, tmp);
                         } else {
-                            int label = gen_new_label();
                             rm = insn & 0xf;
-                            gen_helper_test_exclusive(cpu_T[0], cpu_env, addr);
-                            tcg_gen_brcondi_i32(TCG_COND_NE, cpu_T[0],
-                                                0, label);
                             tmp = load_reg(s,rm);
                             switch (op1) {
                             case 0:  /*  strex */
-                                gen_st32(tmp, addr, IS_USER(s));
+                                gen_store_exclusive(tmp, addr, 2);
                                 break;
                             case 1: /*  strexd */
-                                gen_st32(tmp, addr, IS_USER(s));
-                                tcg_gen_addi_i32(addr, addr, 4);
-                                tmp = load_reg(s, rm + 1);
-                                gen_st32(tmp, addr, IS_USER(s));
+                                tmp2 = load_reg(s, rm + 1);
+                                gen_store_exclusive64(tmp, tmp2, addr);
                                 break;
                             case 2: /*  strexb */
-                                gen_st8(tmp, addr, IS_USER(s));
+                                gen_store_exclusive(tmp, addr, 0);
                                 break;
                             case 3: /* strexh */
-                                gen_st16(tmp, addr, IS_USER(s));
+                                gen_store_exclusive(tmp, addr, 1);
                                 break;
                             default:
                                 abort();
                             }
-                            gen_set_label(label);
                             gen_movl_reg_T0(s, rd);
                         }
                     } else {
@@ -7050,15 +7253,11 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                 if (insn & (1 << 20)) {
                     gen_helper_mark_exclusive(cpu_env, cpu_T[1]);
                     tmp = gen_ld32(addr, IS_USER(s));
+                    gen_mark_exclusive_val(tmp, 0);
                     store_reg(s, rd, tmp);
                 } else {
-                    int label = gen_new_label();
-                    gen_helper_test_exclusive(cpu_T[0], cpu_env, addr);
-                    tcg_gen_brcondi_i32(TCG_COND_NE, cpu_T[0],
-                                        0, label);
                     tmp = load_reg(s, rs);
-                    gen_st32(tmp, cpu_T[1], IS_USER(s));
-                    gen_set_label(label);
+                    gen_store_exclusive(tmp, addr, 2);
                     gen_movl_reg_T0(s, rd);
                 }
             } else if ((insn & (1 << 6)) == 0) {
@@ -7086,12 +7285,7 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                 store_reg(s, 15, tmp);
             } else {
                 /* Load/store exclusive byte/halfword/doubleword.  */
-                /* ??? These are not really atomic.  However we know
-                   we never have multiple CPUs running in parallel,
-                   so it is good enough.  */
                 op = (insn >> 4) & 0x3;
-                /* Must use a global reg for the address because we have
-                   a conditional branch in the store instruction.  */
                 gen_movl_T1_reg(s, rn);
                 addr = cpu_T[1];
                 if (insn & (1 << 20)) {
@@ -7107,35 +7301,31 @@ static int disas_thumb2_insn(CPUState *env, DisasContext *s, uint16_t insn_hw1)
                         tmp = gen_ld32(addr, IS_USER(s));
                         tcg_gen_addi_i32(addr, addr, 4);
                         tmp2 = gen_ld32(addr, IS_USER(s));
+                        gen_mark_exclusive_val(tmp2, 1);
                         store_reg(s, rd, tmp2);
                         break;
                     default:
                         goto illegal_op;
                     }
+                    gen_mark_exclusive_val(tmp, 0);
                     store_reg(s, rs, tmp);
                 } else {
-                    int label = gen_new_label();
-                    /* Must use a global that is not killed by the branch.  */
-                    gen_helper_test_exclusive(cpu_T[0], cpu_env, addr);
-                    tcg_gen_brcondi_i32(TCG_COND_NE, cpu_T[0], 0, label);
                     tmp = load_reg(s, rs);
                     switch (op) {
                     case 0:
-                        gen_st8(tmp, addr, IS_USER(s));
+                        gen_store_exclusive(tmp, addr, 0);
                         break;
                     case 1:
-                        gen_st16(tmp, addr, IS_USER(s));
+                        gen_store_exclusive(tmp, addr, 1);
                         break;
                     case 3:
-                        gen_st32(tmp, addr, IS_USER(s));
-                        tcg_gen_addi_i32(addr, addr, 4);
-                        tmp = load_reg(s, rd);
-                        gen_st32(tmp, addr, IS_USER(s));
+                        tmp2 = load_reg(s, rd);
+                        gen_store_exclusive64(tmp, tmp2, addr);
                         break;
                     default:
+                        dead_tmp(tmp);
                         goto illegal_op;
                     }
-                    gen_set_label(label);
                     gen_movl_reg_T0(s, rm);
                 }
             }
@@ -8797,8 +8987,10 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            gen_lookup_and_goto_tb();
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
@@ -1739,6 +1739,13 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Jump to the host code at 'dest', typically the start of another TB.  */
+static inline void tcg_gen_jmp(TCGv_ptr dest)
+{
+    *gen_opc_ptr++ = INDEX_op_jmp;
+    *gen_opparam_ptr++ = GET_TCGV_PTR(dest);
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -2054,9 +2061,11 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
 #define tcg_gen_add_ptr tcg_gen_add_i32
 #define tcg_gen_addi_ptr tcg_gen_addi_i32
 #define tcg_gen_ext_i32_ptr tcg_gen_mov_i32
+#define tcg_gen_brcondi_ptr tcg_gen_brcondi_i32
 #else /* TCG_TARGET_REG_BITS == 32 */
 #define tcg_gen_add_ptr tcg_gen_add_i64
 #define tcg_gen_addi_ptr tcg_gen_addi_i64
 #define tcg_gen_ext_i32_ptr tcg_gen_ext_i32_i64
+#define tcg_gen_brcondi_ptr tcg_gen_brcondi_i64
 #endif /* TCG_TARGET_REG_BITS != 32 */
 
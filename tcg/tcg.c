@@ -148,6 +148,21 @@ int gen_new_label(void)
     return idx;
 }
 
+#ifdef TCG_TARGET_HAS_slow_paths
+/* Register a slow path for the op being generated.  The backend fills in
+   the rest and emits it from tcg_out_slow_path() at the end of the TB.  */
+static inline TCGSlowPath *tcg_new_slow_path(TCGContext *s)
+{
+    TCGSlowPath *sp;
+
+    sp = tcg_malloc(sizeof(TCGSlowPath));
+    sp->op_index = s->op_index;
+    sp->next = s->slow_paths;
+    s->slow_paths = sp;
+    return sp;
+}
+#endif
+
 #include "tcg-target.c"
 
 /* pool based memory allocation */
@@ -1952,12 +1967,18 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+#ifdef TCG_TARGET_HAS_slow_paths
+    s->slow_paths = NULL;
+#endif
 
     args = gen_opparam_buf;
     op_index = 0;
 
     for(;;) {
         opc = gen_opc_buf[op_index];
+#ifdef TCG_TARGET_HAS_slow_paths
+        s->op_index = op_index;
+#endif
 #ifdef CONFIG_PROFILER
         dyngen_table_op_count[opc]++;
 #endif
@@ -2049,6 +2070,17 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 #endif
     }
  the_end:
+#ifdef TCG_TARGET_HAS_slow_paths
+    {
+        TCGSlowPath *sp;
+
+        for (sp = s->slow_paths; sp != NULL; sp = sp->next) {
+            tcg_out_slow_path(s, sp);
+            if (search_pc >= 0 && search_pc < s->code_ptr - gen_code_buf)
+                return sp->op_index;
+        }
+    }
+#endif
     return -1;
 }
 
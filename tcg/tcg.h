@@ -108,6 +108,18 @@ typedef int TCGType;
 
 typedef tcg_target_ulong TCGArg;
 
+#ifdef TCG_TARGET_HAS_slow_paths
+/* Rarely taken code for an op (e.g. the TLB miss call of a qemu_ld/st)
+   that the backend emits after the end of the TB instead of inline.  */
+typedef struct TCGSlowPath {
+    struct TCGSlowPath *next;
+    int op_index; /* op the slow path belongs to */
+    TCGArg args[4]; /* backend specific */
+    uint8_t *label_ptr; /* branch to the slow path, to be patched */
+    uint8_t *raddr; /* where the slow path jumps back to */
+} TCGSlowPath;
+#endif
+
 /* Define a type and accessor macros for varables.  Using a struct is
    nice because it gives some level of type safely.  Ideally the compiler
    be able to see through all this.  However in practice this is not true,
@@ -259,6 +271,11 @@ struct TCGContext {
     uint8_t *code_ptr;
     TCGTemp static_temps[TCG_MAX_TEMPS];
 
+#ifdef TCG_TARGET_HAS_slow_paths
+    TCGSlowPath *slow_paths;
+    int op_index; /* op currently being generated */
+#endif
+
     TCGHelperInfo *helpers;
     int nb_helpers;
     int allocated_helpers;
@@ -414,6 +431,7 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define tcg_global_reg_new_ptr tcg_global_reg_new_i32
 #define tcg_global_mem_new_ptr tcg_global_mem_new_i32
 #define tcg_temp_new_ptr tcg_temp_new_i32
+#define tcg_temp_local_new_ptr tcg_temp_local_new_i32
 #define tcg_temp_free_ptr tcg_temp_free_i32
 #else
 #define tcg_const_ptr tcg_const_i64
@@ -424,6 +442,7 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define tcg_global_reg_new_ptr tcg_global_reg_new_i64
 #define tcg_global_mem_new_ptr tcg_global_mem_new_i64
 #define tcg_temp_new_ptr tcg_temp_new_i64
+#define tcg_temp_local_new_ptr tcg_temp_local_new_i64
 #define tcg_temp_free_ptr tcg_temp_free_i64
 #endif
 
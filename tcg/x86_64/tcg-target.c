@@ -508,7 +508,8 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
 {
     int addr_reg, data_reg, r0, r1, mem_index, s_bits, bswap, rexw;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    uint8_t *label_ptr;
+    TCGSlowPath *sp;
 #endif
 
     data_reg = *args++;
@@ -550,49 +551,11 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
     
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-
-    /* XXX: move that code at the end of the TB */
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RSI, mem_index);
-    tcg_out8(s, 0xe8);
-    tcg_out32(s, (tcg_target_long)qemu_ld_helpers[s_bits] - 
-              (tcg_target_long)s->code_ptr - 4);
-
-    switch(opc) {
-    case 0 | 4:
-        /* movsbq */
-        tcg_out_modrm(s, 0xbe | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 1 | 4:
-        /* movswq */
-        tcg_out_modrm(s, 0xbf | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 2 | 4:
-        /* movslq */
-        tcg_out_modrm(s, 0x63 | P_REXW, data_reg, TCG_REG_RAX);
-        break;
-    case 0:
-    case 1:
-    case 2:
-    default:
-        /* movl */
-        tcg_out_modrm(s, 0x8b, data_reg, TCG_REG_RAX);
-        break;
-    case 3:
-        tcg_out_mov(s, data_reg, TCG_REG_RAX);
-        break;
-    }
-
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr = s->code_ptr;
+    s->code_ptr += 4;
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -675,8 +638,13 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    sp = tcg_new_slow_path(s);
+    sp->args[0] = 0;
+    sp->args[1] = opc;
+    sp->args[2] = data_reg;
+    sp->args[3] = mem_index;
+    sp->label_ptr = label_ptr;
+    sp->raddr = s->code_ptr;
 #endif
 }
 
@@ -685,7 +653,8 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
 {
     int addr_reg, data_reg, r0, r1, mem_index, s_bits, bswap, rexw;
 #if defined(CONFIG_SOFTMMU)
-    uint8_t *label1_ptr, *label2_ptr;
+    uint8_t *label_ptr;
+    TCGSlowPath *sp;
 #endif
 
     data_reg = *args++;
@@ -728,42 +697,11 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     /* mov */
     tcg_out_modrm(s, 0x8b | rexw, r0, addr_reg);
     
-    /* je label1 */
-    tcg_out8(s, 0x70 + JCC_JE);
-    label1_ptr = s->code_ptr;
-    s->code_ptr++;
-
-    /* XXX: move that code at the end of the TB */
-    switch(opc) {
-    case 0:
-        /* movzbl */
-        tcg_out_modrm(s, 0xb6 | P_EXT | P_REXB, TCG_REG_RSI, data_reg);
-        break;
-    case 1:
-        /* movzwl */
-        tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_RSI, data_reg);
-        break;
-    case 2:
-        /* movl */
-        tcg_out_modrm(s, 0x8b, TCG_REG_RSI, data_reg);
-        break;
-    default:
-    case 3:
-        tcg_out_mov(s, TCG_REG_RSI, data_reg);
-        break;
-    }
-    tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, mem_index);
-    tcg_out8(s, 0xe8);
-    tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
-              (tcg_target_long)s->code_ptr - 4);
-
-    /* jmp label2 */
-    tcg_out8(s, 0xeb);
-    label2_ptr = s->code_ptr;
-    s->code_ptr++;
-    
-    /* label1: */
-    *label1_ptr = s->code_ptr - label1_ptr - 1;
+    /* jne slow_path */
+    tcg_out8(s, 0x0f);
+    tcg_out8(s, 0x80 + JCC_JNE);
+    label_ptr = s->code_ptr;
+    s->code_ptr += 4;
 
     /* add x(r1), r0 */
     tcg_out_modrm_offset(s, 0x03 | P_REXW, r0, r1, offsetof(CPUTLBEntry, addend) - 
@@ -819,8 +757,92 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
 
 #if defined(CONFIG_SOFTMMU)
-    /* label2: */
-    *label2_ptr = s->code_ptr - label2_ptr - 1;
+    sp = tcg_new_slow_path(s);
+    sp->args[0] = 1;
+    sp->args[1] = opc;
+    sp->args[2] = data_reg;
+    sp->args[3] = mem_index;
+    sp->label_ptr = label_ptr;
+    sp->raddr = s->code_ptr;
+#endif
+}
+
+/* TLB miss path of a qemu_ld/st.  On entry r0 holds the guest address;
+   the helper call leaves the result in the register the fast path would
+   have used, then we jump back behind the fast path.  */
+static void tcg_out_slow_path(TCGContext *s, TCGSlowPath *sp)
+{
+#if defined(CONFIG_SOFTMMU)
+    int is_store, opc, data_reg, mem_index;
+
+    is_store = sp->args[0];
+    opc = sp->args[1];
+    data_reg = sp->args[2];
+    mem_index = sp->args[3];
+
+    /* label_ptr: */
+    *(int32_t *)sp->label_ptr = s->code_ptr - sp->label_ptr - 4;
+
+    if (is_store) {
+        switch(opc) {
+        case 0:
+            /* movzbl */
+            tcg_out_modrm(s, 0xb6 | P_EXT | P_REXB, TCG_REG_RSI, data_reg);
+            break;
+        case 1:
+            /* movzwl */
+            tcg_out_modrm(s, 0xb7 | P_EXT, TCG_REG_RSI, data_reg);
+            break;
+        case 2:
+            /* movl */
+            tcg_out_modrm(s, 0x8b, TCG_REG_RSI, data_reg);
+            break;
+        default:
+        case 3:
+            tcg_out_mov(s, TCG_REG_RSI, data_reg);
+            break;
+        }
+        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, mem_index);
+        tcg_out8(s, 0xe8);
+        tcg_out32(s, (tcg_target_long)qemu_st_helpers[opc] - 
+                  (tcg_target_long)s->code_ptr - 4);
+    } else {
+        tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RSI, mem_index);
+        tcg_out8(s, 0xe8);
+        tcg_out32(s, (tcg_target_long)qemu_ld_helpers[opc & 3] - 
+                  (tcg_target_long)s->code_ptr - 4);
+
+        switch(opc) {
+        case 0 | 4:
+            /* movsbq */
+            tcg_out_modrm(s, 0xbe | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
+            break;
+        case 1 | 4:
+            /* movswq */
+            tcg_out_modrm(s, 0xbf | P_EXT | P_REXW, data_reg, TCG_REG_RAX);
+            break;
+        case 2 | 4:
+            /* movslq */
+            tcg_out_modrm(s, 0x63 | P_REXW, data_reg, TCG_REG_RAX);
+            break;
+        case 0:
+        case 1:
+        case 2:
+        default:
+            /* movl */
+            tcg_out_modrm(s, 0x8b, data_reg, TCG_REG_RAX);
+            break;
+        case 3:
+            tcg_out_mov(s, data_reg, TCG_REG_RAX);
+            break;
+        }
+    }
+
+    /* jmp raddr */
+    tcg_out8(s, 0xe9);
+    tcg_out32(s, sp->raddr - s->code_ptr - 4);
+#else
+    tcg_abort();
 #endif
 }
 
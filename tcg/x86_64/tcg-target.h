@@ -66,6 +66,9 @@ enum {
 #define TCG_TARGET_HAS_ext16s_i64
 #define TCG_TARGET_HAS_ext32s_i64
 
+/* qemu_ld/st TLB miss calls are emitted after the end of the TB */
+#define TCG_TARGET_HAS_slow_paths
+
 /* Note: must be synced with dyngen-exec.h */
 #define TCG_AREG0 TCG_REG_R14
 #define TCG_AREG1 TCG_REG_R15
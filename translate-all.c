@@ -48,6 +48,8 @@ target_ulong gen_opc_jump_pc[2];
 #elif defined(TARGET_MIPS) || defined(TARGET_SH4)
 uint32_t gen_opc_hflags[OPC_BUF_SIZE];
 #endif
+target_ulong gen_tb_succ[2];
+int gen_tb_nb_succ;
 
 /* XXX: suppress that */
 unsigned long code_gen_max_block_size(void)
@@ -94,6 +96,7 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     tcg_func_start(s);
 
+    gen_tb_nb_succ = 0;
     gen_intermediate_code(env, tb);
 
     /* generate machine code */
@@ -144,12 +147,13 @@ int cpu_restore_state(TranslationBlock *tb,
                       void *puc)
 {
     TCGContext *s = &tcg_ctx;
-    int j;
+    int j, ret;
     unsigned long tc_ptr;
 #ifdef CONFIG_PROFILER
     int64_t ti;
 #endif
 
+    tb_gen_lock();
 #ifdef CONFIG_PROFILER
     ti = profile_getclock();
 #endif
@@ -165,9 +169,10 @@ int cpu_restore_state(TranslationBlock *tb,
     }
 
     /* find opc index corresponding to search_pc */
+    ret = -1;
     tc_ptr = (unsigned long)tb->tc_ptr;
     if (searched_pc < tc_ptr)
-        return -1;
+        goto out;
 
     s->tb_next_offset = tb->tb_next_offset;
 #ifdef USE_DIRECT_JUMP
@@ -179,7 +184,7 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     j = dyngen_code_search_pc(s, (uint8_t *)tc_ptr, searched_pc - tc_ptr);
     if (j < 0)
-        return -1;
+        goto out;
     /* now find start of instruction before */
     while (gen_opc_instr_start[j] == 0)
         j--;
@@ -191,5 +196,8 @@ int cpu_restore_state(TranslationBlock *tb,
     s->restore_time += profile_getclock() - ti;
     s->restore_count++;
 #endif
-    return 0;
+    ret = 0;
+ out:
+    tb_gen_unlock();
+    return ret;
 }
@@ -39,6 +39,7 @@
 #include "block.h"
 #include "audio/audio.h"
 #include "migration.h"
+#include "host-utils.h"
 #include "kvm.h"
 
 #include <unistd.h>
@@ -56,6 +57,7 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <net/if.h>
@@ -82,6 +84,8 @@
 #ifdef __linux__
 #include <pty.h>
 #include <malloc.h>
+#include <sys/vfs.h>
+#include <sys/syscall.h>
 #include <linux/rtc.h>
 
 /* For the benefit of older linux systems which don't supply it,
@@ -147,6 +151,10 @@
 
 #include "exec-all.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #define DEFAULT_NETWORK_SCRIPT "/etc/qemu-ifup"
 #define DEFAULT_NETWORK_DOWN_SCRIPT "/etc/qemu-ifdown"
 #ifdef __sun__
@@ -192,6 +200,12 @@ static int curses;
 const char* keyboard_layout = NULL;
 int64_t ticks_per_sec;
 ram_addr_t ram_size;
+static const char *mem_path;
+static int mem_prealloc;
+static int mem_node = -1;
+static const char *ram_template;
+/* nonzero while a template is saved: RAM goes to a file of its own */
+static int ram_template_saving;
 int nb_nics;
 NICInfo nd_table[MAX_NICS];
 int vm_running;
@@ -248,6 +262,7 @@ static struct drive_opt {
 
 static CPUState *cur_cpu;
 static CPUState *next_cpu;
+static int use_cpu_threads;
 static int event_pending = 1;
 /* Conversion factor from emulated instructions to virtual clock ticks.  */
 static int icount_time_shift;
@@ -1327,7 +1342,7 @@ static void host_alarm_handler(int host_signum)
 #endif
         alarm_timer->flags |= ALARM_FLAG_EXPIRED;
 
-        if (env) {
+        if (env && !cpu_threads_enabled) {
             /* stop the currently executing cpu because a timer occured */
             cpu_interrupt(env, CPU_INTERRUPT_EXIT);
 #ifdef USE_KQEMU
@@ -2201,12 +2216,15 @@ static int drive_init(struct drive_opt *arg, int snapshot,
     int max_devs;
     int index;
     int cache;
+    int native_aio;
+    int64_t l2_cache_size;
     int bdrv_flags;
     char *str = arg->opt;
     static const char * const params[] = { "bus", "unit", "if", "index",
                                            "cyls", "heads", "secs", "trans",
                                            "media", "snapshot", "file",
-                                           "cache", "format", NULL };
+                                           "cache", "format", "l2-cache-size",
+                                           "aio", NULL };
 
     if (check_params(buf, sizeof(buf), params, str) < 0) {
          fprintf(stderr, "qemu: unknown parameter '%s' in '%s'\n",
@@ -2221,6 +2239,7 @@ static int drive_init(struct drive_opt *arg, int snapshot,
     translation = BIOS_ATA_TRANSLATION_AUTO;
     index = -1;
     cache = 1;
+    native_aio = 0;
 
     if (machine->use_scsi) {
         type = IF_SCSI;
@@ -2371,6 +2390,38 @@ static int drive_init(struct drive_opt *arg, int snapshot,
         }
     }
 
+    if (get_param_value(buf, sizeof(buf), "aio", str)) {
+        if (!strcmp(buf, "threads"))
+            native_aio = 0;
+        else if (!strcmp(buf, "native"))
+            native_aio = 1;
+        else {
+           fprintf(stderr, "qemu: invalid aio option\n");
+           return -1;
+        }
+    }
+
+    l2_cache_size = 0;
+    if (get_param_value(buf, sizeof(buf), "l2-cache-size", str)) {
+        char *ptr;
+
+        l2_cache_size = strtoull(buf, &ptr, 10);
+        switch (*ptr) {
+        case 'K': case 'k':
+            l2_cache_size <<= 10;
+            break;
+        case 0: case 'M': case 'm':
+            l2_cache_size <<= 20;
+            break;
+        case 'G': case 'g':
+            l2_cache_size <<= 30;
+            break;
+        default:
+            fprintf(stderr, "qemu: invalid l2-cache-size option\n");
+            return -1;
+        }
+    }
+
     if (get_param_value(buf, sizeof(buf), "format", str)) {
        if (strcmp(buf, "?") == 0) {
             fprintf(stderr, "qemu: Supported formats:");
@@ -2491,6 +2542,9 @@ static int drive_init(struct drive_opt *arg, int snapshot,
         bdrv_flags |= BDRV_O_NOCACHE;
     else if (cache == 2) /* write-back */
         bdrv_flags |= BDRV_O_CACHE_WB;
+    if (native_aio)
+        bdrv_flags |= BDRV_O_NATIVE_AIO;
+    bdrv_set_l2_cache_hint(bdrv, l2_cache_size);
     if (bdrv_open2(bdrv, file, bdrv_flags, drv) < 0 || qemu_key_check(bdrv, file)) {
         fprintf(stderr, "qemu: could not open disk image %s\n",
                         file);
@@ -2899,6 +2953,253 @@ void qemu_del_wait_object(HANDLE handle, WaitObjectFunc *func, void *opaque)
 }
 #endif
 
+/***********************************************************/
+/* guest RAM backing */
+
+#ifdef __linux__
+#define HUGETLBFS_MAGIC 0x958458f6
+#define MPOL_BIND 2
+
+/* Back the guest RAM with an unlinked file below 'path', usually a
+   hugetlbfs mount.  The page size of the filesystem is returned in
+   *page_size.  */
+static void *ram_alloc_from_path(const char *path, size_t size,
+                                 size_t *page_size)
+{
+    struct statfs fs;
+    char *filename;
+    void *area;
+    int fd;
+
+    if (statfs(path, &fs) != 0) {
+        perror(path);
+        return NULL;
+    }
+    if (fs.f_type != HUGETLBFS_MAGIC)
+        fprintf(stderr, "Warning: path not on HugeTLBFS: %s\n", path);
+    *page_size = fs.f_bsize;
+
+    filename = qemu_malloc(strlen(path) + sizeof("/qemu_back_mem.XXXXXX"));
+    sprintf(filename, "%s/qemu_back_mem.XXXXXX", path);
+    fd = mkstemp(filename);
+    if (fd < 0) {
+        perror("mkstemp");
+        qemu_free(filename);
+        return NULL;
+    }
+    unlink(filename);
+    qemu_free(filename);
+
+    size = (size + *page_size - 1) & ~(*page_size - 1);
+    if (ftruncate(fd, size) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    /* hugetlbfs reserves the pages of shared mappings up front, so a
+       shortage is reported here rather than as SIGBUS later.  */
+    area = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    return area;
+}
+
+static void ram_bind_node(void *area, size_t size, int node)
+{
+    unsigned long mask[4];
+
+    if (node >= (int)(sizeof(mask) * 8)) {
+        fprintf(stderr, "Warning: invalid NUMA node %d\n", node);
+        return;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / (sizeof(long) * 8)] |= 1ul << (node % (sizeof(long) * 8));
+    if (syscall(__NR_mbind, area, size, MPOL_BIND, mask,
+                sizeof(mask) * 8, 0) != 0)
+        perror("mbind");
+}
+#endif
+
+#ifndef _WIN32
+static char *ram_template_file(const char *template, const char *suffix)
+{
+    char *filename;
+
+    filename = qemu_malloc(strlen(template) + strlen(suffix) + 1);
+    sprintf(filename, "%s%s", template, suffix);
+    return filename;
+}
+
+/* Map the RAM image of a template copy-on-write.  Every instance
+   started from the same template shares the pages it does not
+   modify through the host page cache.  If 'addr' is not NULL, the
+   image replaces the memory mapped there.  */
+static void *ram_alloc_from_template(const char *template, void *addr,
+                                     size_t size)
+{
+    char *filename;
+    struct stat st;
+    void *area;
+    size_t page_size = getpagesize();
+    size_t i;
+    int fd;
+
+    filename = ram_template_file(template, ".ram");
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        qemu_free(filename);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size != size) {
+        fprintf(stderr, "%s: RAM size does not match the template\n",
+                filename);
+        close(fd);
+        qemu_free(filename);
+        return NULL;
+    }
+    qemu_free(filename);
+    area = mmap(addr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | (addr ? MAP_FIXED : 0), fd, 0);
+    close(fd);
+    if (area == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    /* only read the pages, writing would unshare them */
+    if (mem_prealloc) {
+        for (i = 0; i < size; i += page_size)
+            (void)((volatile uint8_t *)area)[i];
+    }
+    return area;
+}
+
+/* Save the RAM and the device state of the stopped VM as a template
+   that new instances can be started from with -template.  RAM is
+   written raw to <filename>.ram, everything else to <filename>.  */
+void do_save_template(const char *filename)
+{
+    char *ram_file, *tmp_file;
+    QEMUFile *f;
+    size_t done;
+    ssize_t len;
+    int fd, ret;
+    int saved_vm_running;
+
+    saved_vm_running = vm_running;
+    vm_stop(0);
+
+    /* write to a new file, the old one may back our own RAM */
+    ram_file = ram_template_file(filename, ".ram");
+    tmp_file = ram_template_file(filename, ".ram.tmp");
+    fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        term_printf("Could not create '%s'\n", tmp_file);
+        goto the_end;
+    }
+    for (done = 0; done < phys_ram_size; done += len) {
+        len = write(fd, phys_ram_base + done, phys_ram_size - done);
+        if (len < 0 && errno == EINTR) {
+            len = 0;
+        } else if (len <= 0) {
+            term_printf("Error while writing '%s'\n", tmp_file);
+            close(fd);
+            unlink(tmp_file);
+            goto the_end;
+        }
+    }
+    close(fd);
+    if (rename(tmp_file, ram_file) != 0) {
+        term_printf("Could not rename '%s'\n", tmp_file);
+        unlink(tmp_file);
+        goto the_end;
+    }
+
+    f = qemu_fopen(filename, "wb");
+    if (!f) {
+        term_printf("Could not open '%s'\n", filename);
+        goto the_end;
+    }
+    ram_template_saving = 1;
+    ret = qemu_savevm_state(f);
+    ram_template_saving = 0;
+    qemu_fclose(f);
+    if (ret < 0)
+        term_printf("Error %d while writing VM state\n", ret);
+
+ the_end:
+    qemu_free(ram_file);
+    qemu_free(tmp_file);
+    if (saved_vm_running)
+        vm_start();
+}
+
+static int load_template(const char *filename)
+{
+    QEMUFile *f;
+    int ret;
+
+    /* the machine init loaded kernels and firmware over the RAM */
+    if (!ram_alloc_from_template(filename, phys_ram_base, phys_ram_size))
+        return -1;
+    f = qemu_fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "qemu: could not open template '%s'\n", filename);
+        return -1;
+    }
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        fprintf(stderr, "qemu: error %d while loading template '%s'\n",
+                ret, filename);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/* Allocate phys_ram_base.  It stays one contiguous block whatever
+   backs it, so the dirty bitmap and savevm keep addressing it by
+   offset.  */
+static void *ram_alloc(size_t size)
+{
+    void *area = NULL;
+    size_t page_size = getpagesize();
+    size_t i;
+
+#ifndef _WIN32
+    if (ram_template)
+        return ram_alloc_from_template(ram_template, NULL, size);
+#endif
+#ifdef __linux__
+    if (mem_path) {
+        area = ram_alloc_from_path(mem_path, size, &page_size);
+        if (!area)
+            fprintf(stderr, "Could not use -mem-path %s, "
+                    "falling back to ordinary memory\n", mem_path);
+    }
+#endif
+    if (!area) {
+        page_size = getpagesize();
+        area = qemu_vmalloc(size);
+        if (!area)
+            return NULL;
+    }
+#ifdef __linux__
+    if (mem_node >= 0)
+        ram_bind_node(area, size, mem_node);
+#endif
+    /* fault the memory in now, after the placement policy is set */
+    if (mem_prealloc) {
+        for (i = 0; i < size; i += page_size)
+            ((volatile uint8_t *)area)[i] = 0;
+    }
+    return area;
+}
+
 /***********************************************************/
 /* ram save/restore */
 
@@ -2997,6 +3298,8 @@ static void ram_decompress_close(RamDecompressState *s)
 #define RAM_SAVE_FLAG_MEM_SIZE	0x04
 #define RAM_SAVE_FLAG_PAGE	0x08
 #define RAM_SAVE_FLAG_EOS	0x10
+#define RAM_SAVE_FLAG_XBZRLE	0x20
+#define RAM_SAVE_FLAG_ZLIB	0x40
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -3012,73 +3315,405 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     return 1;
 }
 
-static int ram_save_block(QEMUFile *f)
+/* XBZRLE: the difference between a page and the copy last sent is
+   encoded as runs of unchanged bytes followed by runs of new bytes,
+   both lengths as ULEB128.  A trailing unchanged run is omitted.  */
+
+static int uleb128_encode(uint8_t *p, uint32_t n)
 {
-    static ram_addr_t current_addr = 0;
-    ram_addr_t saved_addr = current_addr;
-    ram_addr_t addr = 0;
-    int found = 0;
+    int len = 0;
 
-    while (addr < phys_ram_size) {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t ch;
+    do {
+        p[len] = n & 0x7f;
+        n >>= 7;
+        if (n)
+            p[len] |= 0x80;
+        len++;
+    } while (n);
+    return len;
+}
 
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
+static int uleb128_decode(const uint8_t *p, int size, int *pos, uint32_t *pn)
+{
+    uint32_t n = 0;
+    int shift = 0;
 
-            ch = *(phys_ram_base + current_addr);
+    do {
+        if (*pos >= size || shift > 28)
+            return -1;
+        n |= (p[*pos] & 0x7f) << shift;
+        shift += 7;
+    } while (p[(*pos)++] & 0x80);
+    *pn = n;
+    return 0;
+}
 
-            if (is_dup_page(phys_ram_base + current_addr, ch)) {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, ch);
-            } else {
-                qemu_put_be64(f, current_addr | RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer(f, phys_ram_base + current_addr, TARGET_PAGE_SIZE);
-            }
+/* returns the encoded length, or -1 if it would exceed 'dlen' */
+static int xbzrle_encode(const uint8_t *old, const uint8_t *new, int size,
+                         uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0, start;
+    uint32_t zrun;
 
-            found = 1;
+    while (i < size) {
+        start = i;
+        while (i < size && (i & 7))
+            if (old[i] == new[i])
+                i++;
+            else
+                goto nonzero;
+        while (i + 8 <= size &&
+               *(uint64_t *)(old + i) == *(uint64_t *)(new + i))
+            i += 8;
+        while (i < size && old[i] == new[i])
+            i++;
+    nonzero:
+        if (i == size)
             break;
-        }
-        addr += TARGET_PAGE_SIZE;
-        current_addr = (saved_addr + addr) % phys_ram_size;
+        zrun = i - start;
+        start = i;
+        while (i < size && old[i] != new[i])
+            i++;
+        /* two ULEB128 of at most 5 bytes each */
+        if (d + 10 + (i - start) > dlen)
+            return -1;
+        d += uleb128_encode(dst + d, zrun);
+        d += uleb128_encode(dst + d, i - start);
+        memcpy(dst + d, new + start, i - start);
+        d += i - start;
+    }
+    return d;
+}
+
+static int xbzrle_decode(const uint8_t *src, int slen, uint8_t *dst, int size)
+{
+    int i = 0, d = 0;
+    uint32_t zrun, nzrun;
+
+    while (i < slen) {
+        if (uleb128_decode(src, slen, &i, &zrun) < 0 ||
+            uleb128_decode(src, slen, &i, &nzrun) < 0)
+            return -1;
+        if (zrun > size - d || nzrun > size - d - zrun || nzrun > slen - i)
+            return -1;
+        d += zrun;
+        memcpy(dst + d, src + i, nzrun);
+        d += nzrun;
+        i += nzrun;
     }
+    return 0;
+}
 
-    return found;
+uint64_t ram_bytes_total(void)
+{
+    return phys_ram_size;
 }
 
-static ram_addr_t ram_save_threshold = 10;
+/* Direct mapped cache of the pages last sent, for XBZRLE.  */
+static ram_addr_t *ram_cache_tags;
+static uint8_t *ram_cache_data;
+static ram_addr_t ram_cache_slots;
 
-static ram_addr_t ram_save_remaining(void)
+static void ram_cache_init(void)
 {
+    ram_addr_t i;
+
+    ram_cache_slots = migrate_cache_size / TARGET_PAGE_SIZE;
+    if (ram_cache_slots == 0)
+        ram_cache_slots = 1;
+    ram_cache_tags = qemu_malloc(ram_cache_slots * sizeof(ram_addr_t));
+    ram_cache_data = qemu_vmalloc(ram_cache_slots * TARGET_PAGE_SIZE);
+    for (i = 0; i < ram_cache_slots; i++)
+        ram_cache_tags[i] = -1;
+}
+
+static void ram_cache_free(void)
+{
+    qemu_free(ram_cache_tags);
+    qemu_vfree(ram_cache_data);
+    ram_cache_tags = NULL;
+    ram_cache_data = NULL;
+}
+
+/* A page on its way into the stream.  Its contents are copied first,
+   as the guest may keep writing to it.  */
+typedef struct RamPage {
     ram_addr_t addr;
-    ram_addr_t count = 0;
+    int flag;           /* RAM_SAVE_FLAG_* it is sent with */
+    int len;            /* length of 'enc' for XBZRLE and ZLIB */
+    uint8_t data[TARGET_PAGE_SIZE];
+    uint8_t enc[TARGET_PAGE_SIZE + 64];
+} RamPage;
+
+static void ram_page_deflate(RamPage *p)
+{
+    uLongf zlen = sizeof(p->enc);
+
+    if (compress2(p->enc, &zlen, p->data, TARGET_PAGE_SIZE, 1) == Z_OK &&
+        zlen < TARGET_PAGE_SIZE - TARGET_PAGE_SIZE / 8) {
+        p->len = zlen;
+    } else {
+        p->flag = RAM_SAVE_FLAG_PAGE;
+    }
+}
+
+static void ram_page_put(QEMUFile *f, RamPage *p)
+{
+    qemu_put_be64(f, p->addr | p->flag);
+    switch (p->flag) {
+    case RAM_SAVE_FLAG_COMPRESS:
+        qemu_put_byte(f, p->data[0]);
+        break;
+    case RAM_SAVE_FLAG_XBZRLE:
+    case RAM_SAVE_FLAG_ZLIB:
+        qemu_put_be16(f, p->len);
+        qemu_put_buffer(f, p->enc, p->len);
+        break;
+    default:
+        qemu_put_buffer(f, p->data, TARGET_PAGE_SIZE);
+        break;
+    }
+}
+
+#ifndef _WIN32
+/* With migrate_set_compress_threads, pages are encoded in batches.
+   The main thread fills a batch, the workers and the main thread
+   deflate its pages, and the batch is then written out in order.  */
+#define RAM_BATCH_SIZE 64
+
+static RamPage *ram_batch;
+static int ram_batch_fill;      /* pages filled, main thread only */
+static int ram_batch_len;       /* pages handed to the workers */
+static int ram_batch_next;      /* next page to deflate */
+static int ram_batch_done;      /* pages deflated */
+static int ram_workers;
+static pthread_mutex_t ram_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ram_batch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ram_batch_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* deflate pages of the batch until none is left, called locked */
+static void ram_batch_work(void)
+{
+    RamPage *p;
+
+    while (ram_batch_next < ram_batch_len) {
+        p = &ram_batch[ram_batch_next++];
+        pthread_mutex_unlock(&ram_batch_lock);
+        if (p->flag == RAM_SAVE_FLAG_ZLIB)
+            ram_page_deflate(p);
+        pthread_mutex_lock(&ram_batch_lock);
+        if (++ram_batch_done == ram_batch_len)
+            pthread_cond_signal(&ram_batch_done_cond);
+    }
+}
+
+static void *ram_worker(void *opaque)
+{
+    sigset_t set;
+
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&ram_batch_lock);
+    for (;;) {
+        while (ram_batch_next >= ram_batch_len)
+            pthread_cond_wait(&ram_batch_cond, &ram_batch_lock);
+        ram_batch_work();
+    }
+    return NULL;
+}
+
+static void ram_batch_flush(QEMUFile *f)
+{
+    int i;
+
+    if (ram_batch_fill == 0)
+        return;
+    pthread_mutex_lock(&ram_batch_lock);
+    ram_batch_len = ram_batch_fill;
+    ram_batch_next = 0;
+    ram_batch_done = 0;
+    pthread_cond_broadcast(&ram_batch_cond);
+    ram_batch_work();
+    while (ram_batch_done < ram_batch_len)
+        pthread_cond_wait(&ram_batch_done_cond, &ram_batch_lock);
+    /* park the workers until the next batch */
+    ram_batch_next = ram_batch_len = 0;
+    pthread_mutex_unlock(&ram_batch_lock);
+    ram_batch_fill = 0;
+
+    for (i = 0; i < ram_batch_done; i++)
+        ram_page_put(f, &ram_batch[i]);
+}
+
+static int ram_batch_start(void)
+{
+    pthread_t thread;
+
+    if (migrate_compress_threads <= 0 ||
+        !(migrate_compression & MIGRATE_COMPRESS_ZLIB))
+        return 0;
+    if (!ram_batch)
+        ram_batch = qemu_malloc(RAM_BATCH_SIZE * sizeof(RamPage));
+    /* the main thread is one of the workers */
+    while (ram_workers < migrate_compress_threads - 1) {
+        if (pthread_create(&thread, NULL, ram_worker, NULL) != 0)
+            break;
+        pthread_detach(thread);
+        ram_workers++;
+    }
+    return 1;
+}
+#else
+static void ram_batch_flush(QEMUFile *f)
+{
+}
+
+static int ram_batch_start(void)
+{
+    return 0;
+}
+#endif
+
+/* nonzero while pages go through ram_batch */
+static int ram_batching;
+
+static void ram_save_page(QEMUFile *f, ram_addr_t current_addr)
+{
+    static RamPage single;
+    RamPage *p = &single;
+    uint8_t *cached;
+    ram_addr_t slot;
+
+#ifndef _WIN32
+    if (ram_batching)
+        p = &ram_batch[ram_batch_fill];
+#endif
+    p->addr = current_addr;
+    memcpy(p->data, phys_ram_base + current_addr, TARGET_PAGE_SIZE);
+
+    p->len = -1;
+    if (ram_cache_tags) {
+        slot = (current_addr >> TARGET_PAGE_BITS) % ram_cache_slots;
+        cached = ram_cache_data + slot * TARGET_PAGE_SIZE;
+        if (ram_cache_tags[slot] == current_addr) {
+            p->len = xbzrle_encode(cached, p->data, TARGET_PAGE_SIZE,
+                                   p->enc, TARGET_PAGE_SIZE / 2);
+        } else {
+            ram_cache_tags[slot] = current_addr;
+        }
+        memcpy(cached, p->data, TARGET_PAGE_SIZE);
+    }
+
+    if (p->len >= 0) {
+        p->flag = RAM_SAVE_FLAG_XBZRLE;
+    } else if (is_dup_page(p->data, p->data[0])) {
+        p->flag = RAM_SAVE_FLAG_COMPRESS;
+    } else if (migrate_compression & MIGRATE_COMPRESS_ZLIB) {
+        p->flag = RAM_SAVE_FLAG_ZLIB;
+    } else {
+        p->flag = RAM_SAVE_FLAG_PAGE;
+    }
 
-    for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
-        if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-            count++;
+#ifndef _WIN32
+    if (ram_batching) {
+        if (++ram_batch_fill == RAM_BATCH_SIZE)
+            ram_batch_flush(f);
+        return;
     }
+#endif
+    if (p->flag == RAM_SAVE_FLAG_ZLIB)
+        ram_page_deflate(p);
+    ram_page_put(f, p);
+}
+
+/* pages still to be sent, one bit per page */
+static uint64_t *ram_save_bitmap;
+static ram_addr_t ram_save_dirty;
 
-    return count;
+/* fold the pages written since the last call into ram_save_bitmap */
+static void ram_save_sync(void)
+{
+    ram_save_dirty += cpu_physical_memory_collect_dirty(ram_save_bitmap,
+                                                        MIGRATION_DIRTY_FLAG);
+}
+
+static int ram_save_block(QEMUFile *f)
+{
+    static ram_addr_t current_page = 0;
+    ram_addr_t nb_pages = phys_ram_size >> TARGET_PAGE_BITS;
+    ram_addr_t nb_words = (nb_pages + 63) / 64;
+    ram_addr_t current_addr, i, word;
+    uint64_t bits;
+
+    if (ram_save_dirty == 0)
+        return 0;
+
+    /* find the next set bit at or after current_page, wrapping once */
+    word = current_page / 64;
+    bits = ram_save_bitmap[word] & (~0ULL << (current_page & 63));
+    for (i = 0; bits == 0 && i < nb_words; i++) {
+        word = (word + 1) % nb_words;
+        bits = ram_save_bitmap[word];
+    }
+    if (bits == 0)
+        return 0;
+    current_page = word * 64 + ctz64(bits);
+    ram_save_bitmap[word] &= ~(1ULL << (current_page & 63));
+    ram_save_dirty--;
+
+    current_addr = current_page << TARGET_PAGE_BITS;
+    ram_save_page(f, current_addr);
+
+    if (++current_page >= nb_pages)
+        current_page = 0;
+    return 1;
+}
+
+static ram_addr_t ram_save_threshold = 10;
+
+static ram_addr_t ram_save_remaining(void)
+{
+    ram_save_sync();
+    return ram_save_dirty;
 }
 
 static int ram_save_live(QEMUFile *f, int stage, void *opaque)
 {
-    ram_addr_t addr;
+    ram_addr_t nb_pages = phys_ram_size >> TARGET_PAGE_BITS;
+    ram_addr_t size = (nb_pages + 63) / 64 * sizeof(uint64_t);
+
+    if (ram_template_saving) {
+        /* the pages are in the template's RAM file */
+        if (stage == 1)
+            qemu_put_be64(f, phys_ram_size | RAM_SAVE_FLAG_MEM_SIZE);
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 1;
+    }
 
     if (stage == 1) {
-        /* Make sure all dirty bits are set */
-        for (addr = 0; addr < phys_ram_size; addr += TARGET_PAGE_SIZE) {
-            if (!cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG))
-                cpu_physical_memory_set_dirty(addr);
-        }
-        
+        /* Every page has to be sent once */
+        if (!ram_save_bitmap)
+            ram_save_bitmap = qemu_malloc(size);
+        memset(ram_save_bitmap, 0xff, size);
+        if (nb_pages & 63)
+            ram_save_bitmap[nb_pages / 64] = (1ULL << (nb_pages & 63)) - 1;
+        ram_save_dirty = nb_pages;
+
+        if (ram_cache_tags)
+            ram_cache_free();
+        if (migrate_compression & MIGRATE_COMPRESS_XBZRLE)
+            ram_cache_init();
+
         /* Enable dirty memory tracking */
         cpu_physical_memory_set_dirty_tracking(1);
 
         qemu_put_be64(f, phys_ram_size | RAM_SAVE_FLAG_MEM_SIZE);
     }
 
+    ram_batching = ram_batch_start();
+
+    ram_save_sync();
     while (!qemu_file_rate_limit(f)) {
         int ret;
 
@@ -3093,9 +3728,15 @@ static int ram_save_live(QEMUFile *f, int stage, void *opaque)
         cpu_physical_memory_set_dirty_tracking(0);
 
         /* flush all remaining blocks regardless of rate limiting */
+        ram_save_sync();
         while (ram_save_block(f) != 0);
+
+        if (ram_cache_tags)
+            ram_cache_free();
     }
 
+    ram_batch_flush(f);
+    ram_batching = 0;
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return (stage == 2) && (ram_save_remaining() < ram_save_threshold);
@@ -3166,13 +3807,33 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             uint8_t ch = qemu_get_byte(f);
             memset(phys_ram_base + addr, ch, TARGET_PAGE_SIZE);
-        } else if (flags & RAM_SAVE_FLAG_PAGE)
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
             qemu_get_buffer(f, phys_ram_base + addr, TARGET_PAGE_SIZE);
+        } else if (flags & (RAM_SAVE_FLAG_XBZRLE | RAM_SAVE_FLAG_ZLIB)) {
+            uint8_t buf[TARGET_PAGE_SIZE + 64];
+            uLongf len = qemu_get_be16(f);
+
+            if (addr >= phys_ram_size || len > sizeof(buf))
+                return -EINVAL;
+            qemu_get_buffer(f, buf, len);
+            if (flags & RAM_SAVE_FLAG_XBZRLE) {
+                if (xbzrle_decode(buf, len, phys_ram_base + addr,
+                                  TARGET_PAGE_SIZE) < 0)
+                    return -EINVAL;
+            } else {
+                uLongf size = TARGET_PAGE_SIZE;
+                if (uncompress(phys_ram_base + addr, &size, buf, len) != Z_OK
+                    || size != TARGET_PAGE_SIZE)
+                    return -EINVAL;
+            }
+        }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
     return 0;
 }
 
+volatile int qemu_in_cpu_exec;
+
 void qemu_service_io(void)
 {
     CPUState *env = cpu_single_env;
@@ -3251,6 +3912,15 @@ void qemu_bh_schedule_idle(QEMUBH *bh)
     bh->idle = 1;
 }
 
+/* wake up the main loop from a CPU thread */
+static void qemu_notify_event(void)
+{
+#ifndef _WIN32
+    static const char byte = 0;
+    write(alarm_timer_wfd, &byte, sizeof(byte));
+#endif
+}
+
 void qemu_bh_schedule(QEMUBH *bh)
 {
     CPUState *env = cpu_single_env;
@@ -3259,7 +3929,9 @@ void qemu_bh_schedule(QEMUBH *bh)
     bh->scheduled = 1;
     bh->idle = 0;
     /* stop the currently executing CPU to execute the BH ASAP */
-    if (env) {
+    if (cpu_threads_enabled) {
+        qemu_notify_event();
+    } else if (env) {
         cpu_interrupt(env, CPU_INTERRUPT_EXIT);
     }
 }
@@ -3390,6 +4062,19 @@ void qemu_del_vm_stop_handler(VMStopHandler *cb, void *opaque)
     vm_stop_cb = NULL;
 }
 
+#ifdef USE_CPU_THREADS
+static void pause_all_cpus(void);
+static void resume_all_cpus(void);
+#else
+static inline void pause_all_cpus(void)
+{
+}
+
+static inline void resume_all_cpus(void)
+{
+}
+#endif
+
 void vm_start(void)
 {
     if (!vm_running) {
@@ -3397,12 +4082,14 @@ void vm_start(void)
         vm_running = 1;
         vm_state_notify(1);
         qemu_rearm_alarm_timer(alarm_timer);
+        resume_all_cpus();
     }
 }
 
 void vm_stop(int reason)
 {
     if (vm_running) {
+        pause_all_cpus();
         cpu_disable_ticks();
         vm_running = 0;
         if (reason != 0) {
@@ -3479,21 +4166,27 @@ void qemu_system_reset_request(void)
     } else {
         reset_requested = 1;
     }
-    if (cpu_single_env)
+    if (cpu_threads_enabled)
+        qemu_notify_event();
+    else if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
 }
 
 void qemu_system_shutdown_request(void)
 {
     shutdown_requested = 1;
-    if (cpu_single_env)
+    if (cpu_threads_enabled)
+        qemu_notify_event();
+    else if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
 }
 
 void qemu_system_powerdown_request(void)
 {
     powerdown_requested = 1;
-    if (cpu_single_env)
+    if (cpu_threads_enabled)
+        qemu_notify_event();
+    else if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
 }
 
@@ -3589,7 +4282,9 @@ void main_loop_wait(int timeout)
         slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
     }
 #endif
+    qemu_global_unlock();
     ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    qemu_global_lock();
     if (ret > 0) {
         IOHandlerRecord **pioh;
 
@@ -3639,6 +4334,256 @@ void main_loop_wait(int timeout)
 
 }
 
+#ifdef USE_CPU_THREADS
+/* With -cpu-threads every CPU runs cpu_exec() in a host thread of its
+   own.  Device emulation, timers and the monitor are not thread safe:
+   they run under the global lock, which the main loop only drops while
+   it sleeps in select() and which the CPU threads take around MMIO.
+   Code generation is serialized by the translation lock of exec.c.  */
+int cpu_threads_enabled;
+
+static pthread_mutex_t qemu_global_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int qemu_global_lock_count;
+/* signalled when a CPU may have something to do */
+static pthread_cond_t cpu_wake_cond = PTHREAD_COND_INITIALIZER;
+/* signalled when a CPU leaves cpu_exec() */
+static pthread_cond_t cpu_idle_cond = PTHREAD_COND_INITIALIZER;
+/* signalled at the end of an exclusive section */
+static pthread_cond_t cpu_exclusive_cond = PTHREAD_COND_INITIALIZER;
+static int cpu_threads_running;
+static int cpu_threads_paused;
+static int cpu_exclusive_pending;
+static CPUState *cpu_debug_env;
+/* nonzero in a CPU thread while it is inside cpu_exec() */
+static __thread int cpu_thread_running;
+
+void qemu_global_lock(void)
+{
+    if (!cpu_threads_enabled)
+        return;
+    if (qemu_global_lock_count++ == 0)
+        pthread_mutex_lock(&qemu_global_mutex);
+}
+
+void qemu_global_unlock(void)
+{
+    if (!cpu_threads_enabled)
+        return;
+    if (--qemu_global_lock_count == 0)
+        pthread_mutex_unlock(&qemu_global_mutex);
+}
+
+/* called when cpu_exec() longjmps out of a device access */
+void qemu_global_lock_reset(void)
+{
+    if (qemu_global_lock_count > 0) {
+        qemu_global_lock_count = 0;
+        pthread_mutex_unlock(&qemu_global_mutex);
+    }
+}
+
+/* the global lock must be held */
+static void wait_for_idle_cpus(void)
+{
+    while (cpu_threads_running > cpu_thread_running)
+        pthread_cond_wait(&cpu_idle_cond, &qemu_global_mutex);
+}
+
+static void interrupt_all_cpus(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env != cpu_single_env)
+            cpu_interrupt(env, CPU_INTERRUPT_EXIT);
+    }
+}
+
+/* Stop all the other CPUs at a TB boundary.  The caller keeps the
+   global lock until end_exclusive().  A CPU thread does not count as
+   running meanwhile, so that two of them can ask at the same time.  */
+void start_exclusive(void)
+{
+    qemu_global_lock();
+    if (cpu_thread_running) {
+        cpu_threads_running--;
+        pthread_cond_broadcast(&cpu_idle_cond);
+    }
+    while (cpu_exclusive_pending)
+        pthread_cond_wait(&cpu_exclusive_cond, &qemu_global_mutex);
+    cpu_exclusive_pending = 1;
+    interrupt_all_cpus();
+    while (cpu_threads_running > 0)
+        pthread_cond_wait(&cpu_idle_cond, &qemu_global_mutex);
+}
+
+void end_exclusive(void)
+{
+    cpu_exclusive_pending = 0;
+    pthread_cond_broadcast(&cpu_exclusive_cond);
+    pthread_cond_broadcast(&cpu_wake_cond);
+    if (cpu_thread_running) {
+        while (cpu_threads_paused || cpu_exclusive_pending)
+            pthread_cond_wait(&cpu_wake_cond, &qemu_global_mutex);
+        cpu_threads_running++;
+    }
+    qemu_global_unlock();
+}
+
+static void pause_all_cpus(void)
+{
+    if (!cpu_threads_enabled)
+        return;
+    qemu_global_lock();
+    cpu_threads_paused = 1;
+    interrupt_all_cpus();
+    wait_for_idle_cpus();
+    qemu_global_unlock();
+}
+
+static void resume_all_cpus(void)
+{
+    if (!cpu_threads_enabled)
+        return;
+    qemu_global_lock();
+    cpu_threads_paused = 0;
+    pthread_cond_broadcast(&cpu_wake_cond);
+    qemu_global_unlock();
+}
+
+void qemu_cpu_kick(CPUState *env)
+{
+    qemu_global_lock();
+    pthread_cond_broadcast(&cpu_wake_cond);
+    qemu_global_unlock();
+}
+
+/* run 'func' in the thread of 'env', before it executes more code */
+void async_run_on_cpu(CPUState *env, CPUWorkFunc *func, target_ulong arg)
+{
+    CPUWorkItem *wi, **pwi;
+
+    wi = qemu_malloc(sizeof(CPUWorkItem));
+    wi->func = func;
+    wi->arg = arg;
+    wi->next = NULL;
+    qemu_global_lock();
+    pwi = &env->queued_work;
+    while (*pwi != NULL)
+        pwi = &(*pwi)->next;
+    *pwi = wi;
+    qemu_global_unlock();
+    cpu_interrupt(env, CPU_INTERRUPT_EXIT);
+}
+
+static void cpu_run_queued_work(CPUState *env)
+{
+    CPUWorkItem *wi;
+
+    while ((wi = env->queued_work) != NULL) {
+        env->queued_work = wi->next;
+        cpu_single_env = env;
+        wi->func(env, wi->arg);
+        cpu_single_env = NULL;
+        qemu_free(wi);
+    }
+}
+
+static int cpu_thread_can_run(CPUState *env)
+{
+    if (!vm_running || cpu_threads_paused || cpu_exclusive_pending ||
+        cpu_debug_env)
+        return 0;
+    if (env->halted &&
+        !(env->interrupt_request & (CPU_INTERRUPT_HARD | CPU_INTERRUPT_FIQ)))
+        return 0;
+    return 1;
+}
+
+static void *cpu_thread(void *opaque)
+{
+    CPUState *env = opaque;
+    sigset_t set;
+    int ret;
+
+    /* signals are handled by the main loop */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    qemu_global_lock();
+    for(;;) {
+        cpu_run_queued_work(env);
+        /* set by tlb_protect_code(), which cannot queue work */
+        if (__sync_lock_test_and_set(&env->tlb_resync, 0))
+            cpu_tlb_update_dirty(env);
+        if (!cpu_thread_can_run(env)) {
+            pthread_cond_wait(&cpu_wake_cond, &qemu_global_mutex);
+            continue;
+        }
+        cpu_threads_running++;
+        cpu_thread_running = 1;
+        qemu_global_unlock();
+        ret = cpu_exec(env);
+        qemu_global_lock();
+        cpu_thread_running = 0;
+        cpu_threads_running--;
+        pthread_cond_broadcast(&cpu_idle_cond);
+        if (ret == EXCP_DEBUG) {
+            cpu_debug_env = env;
+            qemu_notify_event();
+        }
+    }
+    return NULL;
+}
+
+static int main_loop_threads(void)
+{
+    pthread_t thread;
+    CPUState *env;
+
+    cur_cpu = first_cpu;
+    cpu_threads_enabled = 1;
+    tb_gen_lock_init();
+    qemu_global_lock();
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (pthread_create(&thread, NULL, cpu_thread, env) != 0) {
+            fprintf(stderr, "qemu: could not create CPU thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+
+    for(;;) {
+        if (shutdown_requested) {
+            if (!no_shutdown)
+                break;
+            vm_stop(0);
+            no_shutdown = 0;
+            shutdown_requested = 0;
+        }
+        if (reset_requested) {
+            reset_requested = 0;
+            pause_all_cpus();
+            qemu_system_reset();
+            resume_all_cpus();
+        }
+        if (powerdown_requested) {
+            powerdown_requested = 0;
+            qemu_system_powerdown();
+        }
+        if (cpu_debug_env) {
+            gdb_set_stop_cpu(cpu_debug_env);
+            vm_stop(EXCP_DEBUG);
+            cpu_debug_env = NULL;
+        }
+        main_loop_wait(1000);
+    }
+    pause_all_cpus();
+    cpu_disable_ticks();
+    return EXCP_INTERRUPT;
+}
+#endif
+
 static int main_loop(void)
 {
     int ret, timeout;
@@ -3647,6 +4592,10 @@ static int main_loop(void)
 #endif
     CPUState *env;
 
+#ifdef USE_CPU_THREADS
+    if (use_cpu_threads)
+        return main_loop_threads();
+#endif
     cur_cpu = first_cpu;
     next_cpu = cur_cpu->next_cpu ?: first_cpu;
     for(;;) {
@@ -3673,7 +4622,9 @@ static int main_loop(void)
                     env->icount_decr.u16.low = decr;
                     env->icount_extra = count;
                 }
+                qemu_in_cpu_exec = 1;
                 ret = cpu_exec(env);
+                qemu_in_cpu_exec = 0;
 #ifdef CONFIG_PROFILER
                 qemu_time += profile_getclock() - ti;
 #endif
@@ -3805,6 +4756,7 @@ static void help(int exitcode)
 	   "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
            "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
            "       [,cache=writethrough|writeback|none][,format=f]\n"
+           "       [,l2-cache-size=size][,aio=threads|native]\n"
 	   "                use 'file' as a drive image\n"
            "-mtdblock file  use 'file' as on-board Flash memory image\n"
            "-sd file        use 'file' as SecureDigital card image\n"
@@ -3820,6 +4772,11 @@ static void help(int exitcode)
            "-no-fd-bootchk  disable boot signature checking for floppy disks\n"
 #endif
            "-m megs         set virtual RAM size to megs MB [default=%d]\n"
+#ifdef __linux__
+           "-mem-path path  back guest RAM with a file below 'path' (hugetlbfs)\n"
+           "-mem-node n     bind guest RAM to host NUMA node 'n'\n"
+#endif
+           "-mem-prealloc   allocate all of guest RAM at startup\n"
            "-smp n          set the number of CPUs to 'n' [default=1]\n"
            "-nographic      disable graphical output and redirect serial I/Os to console\n"
            "-portrait       rotate graphical output 90 deg left (only PXA LCD)\n"
@@ -3934,6 +4891,10 @@ static void help(int exitcode)
            "-no-reboot      exit instead of rebooting\n"
            "-no-shutdown    stop before shutdown\n"
            "-loadvm [tag|id]  start right away with a saved state (loadvm in monitor)\n"
+#ifndef _WIN32
+           "-template file  start from a template saved with 'save_template',\n"
+           "                sharing its RAM copy-on-write\n"
+#endif
 	   "-vnc display    start a VNC server on display\n"
 #ifndef _WIN32
 	   "-daemonize      daemonize QEMU after initializing\n"
@@ -3947,6 +4908,11 @@ static void help(int exitcode)
            "-startdate      select initial date of the clock\n"
            "-icount [N|auto]\n"
            "                Enable virtual instruction counter with 2^N clock ticks per instruction\n"
+           "-tb-threads n   translate likely next blocks on 'n' helper threads\n"
+           "-cpu-threads    run each emulated CPU in a host thread of its own\n"
+#ifndef _WIN32
+           "-aio-threads n  do asynchronous disk I/O on up to 'n' host threads\n"
+#endif
            "\n"
            "During emulation, the following keys are useful:\n"
            "ctrl-alt-f      toggle full screen\n"
@@ -3990,6 +4956,9 @@ enum {
     QEMU_OPTION_no_fd_bootchk,
 #endif
     QEMU_OPTION_m,
+    QEMU_OPTION_mem_path,
+    QEMU_OPTION_mem_prealloc,
+    QEMU_OPTION_mem_node,
     QEMU_OPTION_nographic,
     QEMU_OPTION_portrait,
 #ifdef HAS_AUDIO
@@ -4024,6 +4993,7 @@ enum {
     QEMU_OPTION_serial,
     QEMU_OPTION_parallel,
     QEMU_OPTION_loadvm,
+    QEMU_OPTION_template,
     QEMU_OPTION_full_screen,
     QEMU_OPTION_no_frame,
     QEMU_OPTION_alt_grab,
@@ -4051,6 +5021,9 @@ enum {
     QEMU_OPTION_clock,
     QEMU_OPTION_startdate,
     QEMU_OPTION_tb_size,
+    QEMU_OPTION_tb_threads,
+    QEMU_OPTION_cpu_threads,
+    QEMU_OPTION_aio_threads,
     QEMU_OPTION_icount,
     QEMU_OPTION_uuid,
     QEMU_OPTION_incoming,
@@ -4085,6 +5058,9 @@ static const QEMUOption qemu_options[] = {
     { "no-fd-bootchk", 0, QEMU_OPTION_no_fd_bootchk },
 #endif
     { "m", HAS_ARG, QEMU_OPTION_m },
+    { "mem-path", HAS_ARG, QEMU_OPTION_mem_path },
+    { "mem-prealloc", 0, QEMU_OPTION_mem_prealloc },
+    { "mem-node", HAS_ARG, QEMU_OPTION_mem_node },
     { "nographic", 0, QEMU_OPTION_nographic },
     { "portrait", 0, QEMU_OPTION_portrait },
     { "k", HAS_ARG, QEMU_OPTION_k },
@@ -4132,6 +5108,7 @@ static const QEMUOption qemu_options[] = {
     { "serial", HAS_ARG, QEMU_OPTION_serial },
     { "parallel", HAS_ARG, QEMU_OPTION_parallel },
     { "loadvm", HAS_ARG, QEMU_OPTION_loadvm },
+    { "template", HAS_ARG, QEMU_OPTION_template },
     { "full-screen", 0, QEMU_OPTION_full_screen },
 #ifdef CONFIG_SDL
     { "no-frame", 0, QEMU_OPTION_no_frame },
@@ -4169,6 +5146,11 @@ static const QEMUOption qemu_options[] = {
     { "clock", HAS_ARG, QEMU_OPTION_clock },
     { "startdate", HAS_ARG, QEMU_OPTION_startdate },
     { "tb-size", HAS_ARG, QEMU_OPTION_tb_size },
+    { "tb-threads", HAS_ARG, QEMU_OPTION_tb_threads },
+    { "cpu-threads", 0, QEMU_OPTION_cpu_threads },
+#ifndef _WIN32
+    { "aio-threads", HAS_ARG, QEMU_OPTION_aio_threads },
+#endif
     { "icount", HAS_ARG, QEMU_OPTION_icount },
     { "incoming", HAS_ARG, QEMU_OPTION_incoming },
     { NULL },
@@ -4462,6 +5444,7 @@ int main(int argc, char **argv)
     int usb_devices_index;
     int fds[2];
     int tb_size;
+    int tb_threads;
     const char *pid_file = NULL;
     int autostart;
     const char *incoming = NULL;
@@ -4537,6 +5520,7 @@ int main(int argc, char **argv)
     nb_nics = 0;
 
     tb_size = 0;
+    tb_threads = 0;
     autostart= 1;
 
     optind = 1;
@@ -4817,6 +5801,23 @@ int main(int argc, char **argv)
                 ram_size = value;
                 break;
             }
+            case QEMU_OPTION_mem_path:
+#ifdef __linux__
+                mem_path = optarg;
+#else
+                fprintf(stderr, "qemu: -mem-path not supported, ignored\n");
+#endif
+                break;
+            case QEMU_OPTION_mem_prealloc:
+                mem_prealloc = 1;
+                break;
+            case QEMU_OPTION_mem_node:
+#ifdef __linux__
+                mem_node = strtol(optarg, NULL, 0);
+#else
+                fprintf(stderr, "qemu: -mem-node not supported, ignored\n");
+#endif
+                break;
             case QEMU_OPTION_d:
                 {
                     int mask;
@@ -4923,6 +5924,13 @@ int main(int argc, char **argv)
 	    case QEMU_OPTION_loadvm:
 		loadvm = optarg;
 		break;
+            case QEMU_OPTION_template:
+#ifndef _WIN32
+                ram_template = optarg;
+#else
+                fprintf(stderr, "qemu: -template not supported, ignored\n");
+#endif
+                break;
             case QEMU_OPTION_full_screen:
                 full_screen = 1;
                 break;
@@ -5080,6 +6088,21 @@ int main(int argc, char **argv)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_tb_threads:
+                tb_threads = strtol(optarg, NULL, 0);
+                break;
+#ifndef _WIN32
+            case QEMU_OPTION_aio_threads:
+                bdrv_set_aio_threads(strtol(optarg, NULL, 0));
+                break;
+#endif
+            case QEMU_OPTION_cpu_threads:
+#ifdef USE_CPU_THREADS
+                use_cpu_threads = 1;
+#else
+                fprintf(stderr, "qemu: CPU threads not supported, ignored\n");
+#endif
+                break;
             case QEMU_OPTION_icount:
                 use_icount = 1;
                 if (strcmp(optarg, "auto") == 0) {
@@ -5206,6 +6229,10 @@ int main(int argc, char **argv)
         fprintf(stderr, "could not initialize alarm timer\n");
         exit(1);
     }
+    if (use_icount && use_cpu_threads) {
+        fprintf(stderr, "-icount is not supported with -cpu-threads\n");
+        exit(1);
+    }
     if (use_icount && icount_time_shift < 0) {
         use_icount = 2;
         /* 125MIPS seems a reasonable initial guess at the guest speed.
@@ -5288,7 +6315,7 @@ int main(int argc, char **argv)
         phys_ram_size += ram_size;
     }
 
-    phys_ram_base = qemu_vmalloc(phys_ram_size);
+    phys_ram_base = ram_alloc(phys_ram_size);
     if (!phys_ram_base) {
         fprintf(stderr, "Could not allocate physical memory\n");
         exit(1);
@@ -5296,6 +6323,7 @@ int main(int argc, char **argv)
 
     /* init the dynamic translator */
     cpu_exec_init_all(tb_size * 1024 * 1024);
+    tb_threads_init(tb_threads);
 
     bdrv_init();
 
@@ -5452,6 +6480,11 @@ int main(int argc, char **argv)
     }
 #endif
 
+#ifndef _WIN32
+    if (ram_template && load_template(ram_template) < 0)
+        exit(1);
+#endif
+
     if (loadvm)
         do_loadvm(loadvm);
 